@@ -0,0 +1,334 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hyperbloom.h"
+#include "perfcount.h"
+
+/**
+ * hyperbloom_bench: times the insert and lookup loops of each filter layout
+ * over a range of filter sizes. With -p it also reads the CPU's performance
+ * counters around each loop and reports cycles, instructions, cache, dTLB and
+ * branch misses per operation, to show why a layout slows down at a given
+ * size.
+ *
+ * Usage: hyperbloom_bench [-l bit|byte|blocked|all] [-n min bits]
+ *                         [-N max bits] [-k hf] [-m keys] [-w key width]
+ *                         [-p] [-H]
+ *
+ * Sizes go from -n to -N, quadrupling each step. A key width of 0 inserts
+ * and looks up hex string keys one at a time (HyperInsert/HyperLookup);
+ * otherwise fixed-width binary keys go through the batch calls. Lookups probe
+ * the inserted keys and as many fresh ones. -H asks for transparent huge
+ * pages on the filter's vector.
+ */
+
+typedef struct BenchConfig {
+  HyperBloomLayout layout; // HB_LAYOUT_AUTO runs every layout
+  uint64_t min_size;
+  uint64_t max_size;
+  int hf;
+  size_t keys;
+  int width;
+  bool profile;
+  bool huge_pages;
+} BenchConfig;
+
+typedef struct BenchKeys {
+  uint8_t *fixed; // 2 * keys fixed-width keys, back to back
+  char **strs;    // 2 * keys hex strings
+  bool *found;
+} BenchKeys;
+
+static uint64_t nowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+static void freeKeys(BenchKeys *k, size_t n) {
+  if (k->strs) {
+    for (size_t i = 0; i < n; i++) {
+      free(k->strs[i]);
+    }
+  }
+  free(k->strs);
+  free(k->fixed);
+  free(k->found);
+}
+
+/**
+ * Generate twice `cfg->keys` keys: the first half is inserted, lookups probe
+ * all of them.
+ */
+static int makeKeys(const BenchConfig *cfg, BenchKeys *k) {
+  size_t n = 2 * cfg->keys;
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  memset(k, 0, sizeof(*k));
+
+  k->found = malloc(n * sizeof(bool));
+  if (k->found == NULL) {
+    perror("Failed to allocate keys");
+    return -1;
+  }
+  if (cfg->width > 0) {
+    // Rounded up to whole words so keys can be filled 8 bytes at a time.
+    k->fixed = malloc(n * (size_t)cfg->width + 8);
+    if (k->fixed == NULL) {
+      perror("Failed to allocate keys");
+      return -1;
+    }
+    for (size_t i = 0; i < n * (size_t)cfg->width; i += 8) {
+      uint64_t r = xorshift(&seed);
+      memcpy(k->fixed + i, &r, 8);
+    }
+    return 0;
+  }
+
+  k->strs = calloc(n, sizeof(char *));
+  if (k->strs == NULL) {
+    perror("Failed to allocate keys");
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if ((k->strs[i] = malloc(33)) == NULL) {
+      perror("Failed to allocate keys");
+      return -1;
+    }
+    snprintf(k->strs[i], 33, "%016llx%016llx",
+             (unsigned long long)xorshift(&seed),
+             (unsigned long long)xorshift(&seed));
+  }
+  return 0;
+}
+
+static void runInserts(const BenchConfig *cfg, HyperBloom *hb,
+                       const BenchKeys *k) {
+  if (cfg->width > 0) {
+    HyperInsertBatch(hb, k->fixed, (size_t)cfg->width, cfg->keys);
+    return;
+  }
+  for (size_t i = 0; i < cfg->keys; i++) {
+    HyperInsert(hb, k->strs[i]);
+  }
+}
+
+static void runLookups(const BenchConfig *cfg, HyperBloom *hb,
+                       BenchKeys *k) {
+  if (cfg->width > 0) {
+    HyperLookupBatch(hb, k->fixed, (size_t)cfg->width, 2 * cfg->keys,
+                     k->found);
+    return;
+  }
+  for (size_t i = 0; i < 2 * cfg->keys; i++) {
+    k->found[i] = HyperLookup(hb, k->strs[i]);
+  }
+}
+
+static void printHeader(const BenchConfig *cfg) {
+  printf("%-8s %12s %-7s %9s %9s", "layout", "bits", "op", "ns/op",
+         "Mops/s");
+  if (cfg->profile) {
+    for (int i = 0; i < PERF_EV_COUNT; i++) {
+      printf(" %10s", PerfEventName((PerfEvent)i));
+    }
+  }
+  printf("\n");
+}
+
+static void printRow(const BenchConfig *cfg, const char *layout,
+                     uint64_t size, const char *op, size_t ops,
+                     uint64_t elapsed, const PerfSample *sample) {
+  printf("%-8s %12" PRIu64 " %-7s %9.2f %9.2f", layout, size, op,
+         (double)elapsed / (double)ops, (double)ops * 1e3 / (double)elapsed);
+  if (cfg->profile) {
+    // Per operation, like the timings.
+    for (int i = 0; i < PERF_EV_COUNT; i++) {
+      if (sample->valid[i]) {
+        printf(" %10.3f", (double)sample->values[i] / (double)ops);
+      } else {
+        printf(" %10s", "n/a");
+      }
+    }
+  }
+  printf("\n");
+}
+
+/**
+ * Benchmark one layout at one size. Returns -1 if the filter can't be
+ * created.
+ */
+static int benchOne(const BenchConfig *cfg, PerfCounters *pc,
+                    HyperBloomLayout layout, uint64_t size, BenchKeys *k) {
+  HyperBloom *hb = NewHyperBloom(size, cfg->hf, layout);
+  if (hb == NULL) {
+    return -1;
+  }
+
+  uint64_t len;
+  uint8_t *vector = hb->ops->vector(hb->filter, &len);
+  if (cfg->huge_pages) {
+    // madvise wants page aligned ranges; the unaligned ends keep small pages.
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)vector + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)vector + len) & ~(page - 1);
+    if (end > start &&
+        madvise((void *)start, end - start, MADV_HUGEPAGE) != 0) {
+      perror("madvise(MADV_HUGEPAGE)");
+    }
+  }
+  // Fault every page in first so the insert loop doesn't time page faults.
+  memset(vector, 0, len);
+
+  const char *name = HyperBloomLayoutName(hb->ops->layout);
+  PerfSample sample;
+
+  StartPerfCounters(pc);
+  uint64_t start = nowNanos();
+  runInserts(cfg, hb, k);
+  uint64_t elapsed = nowNanos() - start;
+  StopPerfCounters(pc, &sample);
+  printRow(cfg, name, size, "insert", cfg->keys, elapsed, &sample);
+
+  StartPerfCounters(pc);
+  start = nowNanos();
+  runLookups(cfg, hb, k);
+  elapsed = nowNanos() - start;
+  StopPerfCounters(pc, &sample);
+  printRow(cfg, name, size, "lookup", 2 * cfg->keys, elapsed, &sample);
+
+  DestroyHyperBloom(hb);
+  return 0;
+}
+
+static int parseLayout(const char *s, HyperBloomLayout *out) {
+  if (strcmp(s, "all") == 0) {
+    *out = HB_LAYOUT_AUTO;
+    return 0;
+  }
+  HyperBloomLayout layouts[] = {HB_LAYOUT_BIT, HB_LAYOUT_BYTE,
+                                HB_LAYOUT_BLOCKED};
+  for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+    if (strcmp(s, HyperBloomLayoutName(layouts[i])) == 0) {
+      *out = layouts[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  BenchConfig cfg = {.layout = HB_LAYOUT_AUTO,
+                     .min_size = 1ULL << 16,
+                     .max_size = 1ULL << 28,
+                     .hf = 4,
+                     .keys = 1 << 20,
+                     .width = 16};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:N:k:m:w:pH")) != -1) {
+    switch (opt) {
+    case 'l':
+      if (parseLayout(optarg, &cfg.layout) != 0) {
+        fprintf(stderr, "Unknown layout: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n':
+      cfg.min_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'N':
+      cfg.max_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'k':
+      cfg.hf = atoi(optarg);
+      break;
+    case 'm':
+      cfg.keys = strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      cfg.width = atoi(optarg);
+      break;
+    case 'p':
+      cfg.profile = true;
+      break;
+    case 'H':
+      cfg.huge_pages = true;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-l bit|byte|blocked|all] [-n min bits] "
+              "[-N max bits] [-k hf] [-m keys] [-w key width] [-p] [-H]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (cfg.min_size == 0 || (cfg.min_size & (cfg.min_size - 1)) != 0 ||
+      cfg.max_size < cfg.min_size || cfg.hf < 1 || cfg.keys == 0 ||
+      cfg.width < 0) {
+    fprintf(stderr, "Invalid benchmark configuration\n");
+    return 1;
+  }
+
+  PerfCounters pc;
+  if (cfg.profile) {
+    OpenPerfCounters(&pc);
+    if (pc.open == 0) {
+      fprintf(stderr,
+              "Performance counters unavailable (%s); reporting timings "
+              "only. Check /proc/sys/kernel/perf_event_paranoid.\n",
+              strerror(pc.err));
+    } else if (pc.open < PERF_EV_COUNT) {
+      fprintf(stderr, "Some performance counters unavailable (%s)\n",
+              strerror(pc.err));
+    }
+  } else {
+    // Closed counters: Start/Stop do nothing and samples come back invalid.
+    for (int i = 0; i < PERF_EV_COUNT; i++) {
+      pc.fds[i] = -1;
+    }
+    pc.open = 0;
+  }
+
+  BenchKeys keys;
+  if (makeKeys(&cfg, &keys) != 0) {
+    freeKeys(&keys, 2 * cfg.keys);
+    return 1;
+  }
+
+  HyperBloomLayout layouts[] = {HB_LAYOUT_BIT, HB_LAYOUT_BYTE,
+                                HB_LAYOUT_BLOCKED};
+  int failed = 0;
+  printf("hf=%d keys=%zu width=%d\n", cfg.hf, cfg.keys, cfg.width);
+  printHeader(&cfg);
+  for (uint64_t size = cfg.min_size; size <= cfg.max_size; size *= 4) {
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+      if (cfg.layout != HB_LAYOUT_AUTO && cfg.layout != layouts[i]) {
+        continue;
+      }
+      if (benchOne(&cfg, &pc, layouts[i], size, &keys) != 0) {
+        fprintf(stderr, "Skipping %s at %" PRIu64 " bits\n",
+                HyperBloomLayoutName(layouts[i]), size);
+        failed = 1;
+      }
+    }
+    if (size > UINT64_MAX / 4) {
+      break;
+    }
+  }
+
+  ClosePerfCounters(&pc);
+  freeKeys(&keys, 2 * cfg.keys);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+#include "perfcount.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define HW_CACHE(cache, op, result)                                            \
+  ((PERF_COUNT_HW_CACHE_##cache) | (PERF_COUNT_HW_CACHE_OP_##op << 8) |        \
+   (PERF_COUNT_HW_CACHE_RESULT_##result << 16))
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+  const char *name;
+} events[PERF_EV_COUNT] = {
+    [PERF_EV_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+                        "cycles"},
+    [PERF_EV_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+                              "instrs"},
+    [PERF_EV_L1D_MISSES] = {PERF_TYPE_HW_CACHE, HW_CACHE(L1D, READ, MISS),
+                            "L1d-miss"},
+    [PERF_EV_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+                              "LLC-miss"},
+    [PERF_EV_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, HW_CACHE(DTLB, READ, MISS),
+                             "dTLB-miss"},
+    [PERF_EV_BRANCH_MISSES] = {PERF_TYPE_HARDWARE,
+                               PERF_COUNT_HW_BRANCH_MISSES, "br-miss"},
+};
+
+int OpenPerfCounters(PerfCounters *pc) {
+  pc->open = 0;
+  pc->err = 0;
+  for (int i = 0; i < PERF_EV_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    pc->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (pc->fds[i] < 0) {
+      if (pc->err == 0) {
+        pc->err = errno;
+      }
+      pc->fds[i] = -1;
+      continue;
+    }
+    pc->open++;
+  }
+  return pc->open;
+}
+
+void ClosePerfCounters(PerfCounters *pc) {
+  for (int i = 0; i < PERF_EV_COUNT; i++) {
+    if (pc->fds[i] >= 0) {
+      close(pc->fds[i]);
+      pc->fds[i] = -1;
+    }
+  }
+  pc->open = 0;
+}
+
+void StartPerfCounters(PerfCounters *pc) {
+  for (int i = 0; i < PERF_EV_COUNT; i++) {
+    if (pc->fds[i] >= 0) {
+      ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void StopPerfCounters(PerfCounters *pc, PerfSample *out) {
+  for (int i = 0; i < PERF_EV_COUNT; i++) {
+    if (pc->fds[i] >= 0) {
+      ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  for (int i = 0; i < PERF_EV_COUNT; i++) {
+    out->values[i] = 0;
+    out->valid[i] = false;
+
+    // value, time enabled, time running
+    uint64_t buf[3];
+    if (pc->fds[i] < 0 || read(pc->fds[i], buf, sizeof(buf)) != sizeof(buf) ||
+        buf[2] == 0) {
+      continue;
+    }
+    // With more events than hardware counters the kernel time-slices them;
+    // scale each count up to the whole window.
+    out->values[i] = buf[2] < buf[1]
+                         ? (uint64_t)((double)buf[0] * buf[1] / buf[2])
+                         : buf[0];
+    out->valid[i] = true;
+  }
+}
+
+const char *PerfEventName(PerfEvent ev) {
+  return ev < PERF_EV_COUNT ? events[ev].name : "unknown";
+}
@@ -0,0 +1,67 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Hardware performance counters for the benchmark, read straight from the
+ * kernel with perf_event_open(2) so no perf binary is needed.
+ *
+ * Each event is opened on its own rather than as a group: a CPU or VM that
+ * lacks one event (dTLB misses are a common gap) still reports the others.
+ * Counting is limited to user space, which works at the default
+ * perf_event_paranoid level of 2. Where the kernel refuses counters
+ * altogether, as in most containers, OpenPerfCounters opens none and the
+ * benchmark reports timings only.
+ */
+
+typedef enum PerfEvent {
+  PERF_EV_CYCLES = 0,
+  PERF_EV_INSTRUCTIONS,
+  PERF_EV_L1D_MISSES,    // L1 data cache load misses
+  PERF_EV_CACHE_MISSES,  // Last level cache misses
+  PERF_EV_DTLB_MISSES,   // Data TLB load misses
+  PERF_EV_BRANCH_MISSES, // Mispredicted branches
+  PERF_EV_COUNT,
+} PerfEvent;
+
+typedef struct PerfCounters {
+  int fds[PERF_EV_COUNT]; // -1 for events that couldn't be opened
+  int open;               // Number of events opened
+  int err;                // errno of the first event that failed to open
+} PerfCounters;
+
+/**
+ * Counts from one StartPerfCounters/StopPerfCounters window, scaled up when
+ * the kernel had to multiplex the counters.
+ */
+typedef struct PerfSample {
+  uint64_t values[PERF_EV_COUNT];
+  bool valid[PERF_EV_COUNT];
+} PerfSample;
+
+/**
+ * Open every event for the calling thread. Returns the number of events
+ * opened; `pc->err` says why the first missing one failed.
+ */
+int OpenPerfCounters(PerfCounters *pc);
+
+void ClosePerfCounters(PerfCounters *pc);
+
+/**
+ * Zero and enable the open counters.
+ */
+void StartPerfCounters(PerfCounters *pc);
+
+/**
+ * Disable the open counters and read them into `out`.
+ */
+void StopPerfCounters(PerfCounters *pc, PerfSample *out);
+
+/**
+ * Short column name for an event, e.g. "dTLB-miss".
+ */
+const char *PerfEventName(PerfEvent ev);
+
+#endif // PERFCOUNT_H
@@ -0,0 +1,333 @@
+#include "blocked.h"
+#include "bitvec.h"
+#include "chunkio.h"
+#include "hashing.h"
+#include "xxhash.h"
+
+#include <string.h>
+
+/**
+ * Bits of the hash that pick a bit inside a block, and how many of those fit
+ * in one 64 bit word of remixed hash.
+ */
+#define PROBE_BITS 9
+#define PROBES_PER_WORD (64 / PROBE_BITS)
+
+BlockedBloomFilter *NewBlockedBloomFilter(uint64_t size, int hf) {
+  if (size < BLOCKED_BLOCK_BITS) {
+    fprintf(stderr, "Filter size must be at least %d\n", BLOCKED_BLOCK_BITS);
+    return NULL;
+  }
+  if ((size & (size - 1)) != 0) {
+    fprintf(stderr, "Filter must be a power of 2\n");
+    return NULL;
+  }
+
+  BlockedBloomFilter *bf = malloc(sizeof(BlockedBloomFilter));
+  if (!bf) {
+    perror("Failed to allocate bloom filter.");
+    return NULL;
+  }
+
+  bf->size = size;
+  bf->nblocks = size / BLOCKED_BLOCK_BITS;
+  bf->hf = hf;
+  bf->bv = aligned_alloc(64, size / 8);
+
+  if (!bf->bv) {
+    perror("Failed to allocate bit vector.");
+    free(bf);
+    return NULL;
+  }
+  memset(bf->bv, 0, size / 8);
+
+  if (pthread_rwlock_init(&bf->rwlock, NULL) != 0) {
+    perror("Failed to initialize rwlock");
+    free(bf->bv);
+    free(bf);
+    return NULL;
+  }
+
+  return bf;
+}
+
+void DestroyBlockedBloomFilter(BlockedBloomFilter *bf) {
+  if (bf) {
+    pthread_rwlock_destroy(&bf->rwlock);
+    free(bf->bv);
+    free(bf);
+  }
+}
+
+/**
+ * The low bits of the entry hash pick the block. The bits inside the block
+ * come from a remix of the whole hash (the 64 bit finalizer from
+ * MurmurHash3), so they do depend on the block index bits, but not on how
+ * many blocks there are. Folding only drops high block index bits, so an
+ * entry keeps the same bits in its new block.
+ */
+static inline uint64_t remix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t *blockOf(BlockedBloomFilter *bf, uint64_t h) {
+  return &bf->bv[(h & (bf->nblocks - 1)) * BLOCKED_BLOCK_WORDS];
+}
+
+static void setHash(BlockedBloomFilter *bf, uint64_t h) {
+  uint64_t *block = blockOf(bf, h);
+  uint64_t m = h;
+  for (int i = 0; i < bf->hf; i++) {
+    if (i % PROBES_PER_WORD == 0) {
+      m = remix(m + i);
+    }
+    unsigned bit = m & (BLOCKED_BLOCK_BITS - 1);
+    m >>= PROBE_BITS;
+    block[bit / 64] |= 1ULL << (bit & 63);
+  }
+}
+
+static bool testHash(BlockedBloomFilter *bf, uint64_t h) {
+  const uint64_t *block = blockOf(bf, h);
+  uint64_t m = h;
+  for (int i = 0; i < bf->hf; i++) {
+    if (i % PROBES_PER_WORD == 0) {
+      m = remix(m + i);
+    }
+    unsigned bit = m & (BLOCKED_BLOCK_BITS - 1);
+    m >>= PROBE_BITS;
+    if ((block[bit / 64] & (1ULL << (bit & 63))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BlockedLookup(BlockedBloomFilter *bf, const char *entry) {
+  uint64_t h = XXH64(entry, strlen(entry), 0);
+  pthread_rwlock_rdlock(&bf->rwlock);
+  bool found = testHash(bf, h);
+  pthread_rwlock_unlock(&bf->rwlock);
+  return found;
+}
+
+int BlockedInsert(BlockedBloomFilter *bf, const char *entry) {
+  uint64_t h = XXH64(entry, strlen(entry), 0);
+  pthread_rwlock_wrlock(&bf->rwlock);
+  setHash(bf, h);
+  pthread_rwlock_unlock(&bf->rwlock);
+  return 0;
+}
+
+int BlockedInsertBatch(BlockedBloomFilter *bf, const uint8_t *keys,
+                       size_t width, size_t n) {
+  uint64_t hashes[BATCH_BLOCK];
+
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_wrlock(&bf->rwlock);
+    for (size_t j = 0; j < count; j++) {
+      __builtin_prefetch(blockOf(bf, hashes[j]), 1);
+    }
+    for (size_t j = 0; j < count; j++) {
+      setHash(bf, hashes[j]);
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+  }
+  return 0;
+}
+
+int BlockedLookupBatch(BlockedBloomFilter *bf, const uint8_t *keys,
+                       size_t width, size_t n, bool *out) {
+  uint64_t hashes[BATCH_BLOCK];
+
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_rdlock(&bf->rwlock);
+    for (size_t j = 0; j < count; j++) {
+      __builtin_prefetch(blockOf(bf, hashes[j]), 0);
+    }
+    for (size_t j = 0; j < count; j++) {
+      out[start + j] = testHash(bf, hashes[j]);
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+  }
+  return 0;
+}
+
+int BlockedWrite(BlockedBloomFilter *bf, const char *filename) {
+  printf("Writing bit vector to file...\n");
+
+  pthread_rwlock_rdlock(&bf->rwlock);
+  BloomFileMeta meta = {.size = bf->size, .hf = (uint64_t)bf->hf};
+  int rc = WriteChunkedFile(filename, CHUNKED_KIND_BLOCKED, &meta,
+                            sizeof(meta), bf->bv, bf->size / 8,
+                            CHUNKED_FILE_CHUNK_SIZE, 0);
+  pthread_rwlock_unlock(&bf->rwlock);
+  if (rc != 0) {
+    return -1;
+  }
+
+  printf("Successfully wrote bitvector to file: %s\n", filename);
+  return 0;
+}
+
+/**
+ * Reads a filter file, folding it by `factor` (a power of 2) on the way in.
+ */
+static BlockedBloomFilter *loadChunked(const char *filename, uint64_t factor) {
+  BloomFileMeta meta;
+  ChunkedFile *cf =
+      OpenChunkedFile(filename, CHUNKED_KIND_BLOCKED, &meta, sizeof(meta));
+  if (cf == NULL) {
+    if (errno == EILSEQ) {
+      fprintf(stderr, "%s: not a blocked bloom filter file\n", filename);
+    }
+    return NULL;
+  }
+
+  BlockedBloomFilter *bf =
+      meta.size / factor >= BLOCKED_BLOCK_BITS
+          ? NewBlockedBloomFilter(meta.size / factor, (int)meta.hf)
+          : NULL;
+  if (bf == NULL || cf->hdr.payload_len != meta.size / 8) {
+    fprintf(stderr, "%s: bad filter metadata\n", filename);
+    DestroyBlockedBloomFilter(bf);
+    CloseChunkedFile(cf);
+    return NULL;
+  }
+
+  int64_t corrupt =
+      factor == 1 ? ReadChunkedPayload(cf, bf->bv, 0)
+                  : ReadChunkedPayloadFolded(cf, bf->bv, bf->size / 8, 0);
+  CloseChunkedFile(cf);
+  if (corrupt != 0) {
+    if (corrupt > 0) {
+      fprintf(stderr, "%s: %lld corrupt chunk(s), refusing to load\n",
+              filename, (long long)corrupt);
+    }
+    DestroyBlockedBloomFilter(bf);
+    return NULL;
+  }
+
+  printf("Loaded bitvector from file: %s\n", filename);
+  return bf;
+}
+
+BlockedBloomFilter *BlockedLoad(const char *filename) {
+  return loadChunked(filename, 1);
+}
+
+BlockedBloomFilter *BlockedLoadFolded(const char *filename, uint64_t factor,
+                                      double target_fpr) {
+  if (factor == 0) {
+    BlockedBloomFilter *bf = BlockedLoad(filename);
+    if (bf != NULL &&
+        FoldBlockedBloomFilter(bf, BlockedFoldFactor(bf, target_fpr)) != 0) {
+      DestroyBlockedBloomFilter(bf);
+      return NULL;
+    }
+    return bf;
+  }
+  if ((factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return NULL;
+  }
+  return loadChunked(filename, factor);
+}
+
+int FoldBlockedBloomFilter(BlockedBloomFilter *bf, uint64_t factor) {
+  if (factor == 0 || (factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&bf->rwlock);
+  if (bf->size / factor < BLOCKED_BLOCK_BITS) {
+    pthread_rwlock_unlock(&bf->rwlock);
+    fprintf(stderr, "Folded filter size must be at least %d\n",
+            BLOCKED_BLOCK_BITS);
+    return -1;
+  }
+  if (factor > 1) {
+    // Block b of the folded filter collects blocks b, b + nblocks / factor,
+    // ... of this one; the bits inside a block don't depend on the block
+    // count, so every entry is still found.
+    foldVector(bf->bv, bf->size / 8, factor);
+    bf->size /= factor;
+    bf->nblocks /= factor;
+  }
+  pthread_rwlock_unlock(&bf->rwlock);
+  return 0;
+}
+
+double BlockedFillRatio(BlockedBloomFilter *bf) {
+  pthread_rwlock_rdlock(&bf->rwlock);
+  double fill = (double)countBits(bf->bv, bf->size / 8) / (double)bf->size;
+  pthread_rwlock_unlock(&bf->rwlock);
+  return fill;
+}
+
+uint64_t BlockedFoldFactor(BlockedBloomFilter *bf, double target_fpr) {
+  pthread_rwlock_rdlock(&bf->rwlock);
+  uint64_t factor = foldFactorFor(countBits(bf->bv, bf->size / 8), bf->size,
+                                  bf->hf, BLOCKED_BLOCK_BITS, target_fpr);
+  pthread_rwlock_unlock(&bf->rwlock);
+  return factor;
+}
+
+/**
+ * Merges the filter saved in `filename` into `bf`, folding `bf` down to the
+ * size of a smaller file if `fold` is set.
+ */
+static int mergeFile(BlockedBloomFilter *bf, const char *filename,
+                     bool fold) {
+  BlockedBloomFilter *loaded_bf = BlockedLoad(filename);
+  if (loaded_bf == NULL) {
+    return -1;
+  }
+
+  if (bf->hf != loaded_bf->hf) {
+    fprintf(stderr, "Mismatch in BloomFilter parameters\n");
+    DestroyBlockedBloomFilter(loaded_bf);
+    return -1;
+  }
+
+  // A larger file is folded down as it is OR-ed in. A smaller one means
+  // folding `bf`, which only happens if the caller asked for it.
+  pthread_rwlock_wrlock(&bf->rwlock);
+  int rc = 0;
+  if (bf->size > loaded_bf->size && fold) {
+    foldVector(bf->bv, bf->size / 8, bf->size / loaded_bf->size);
+    bf->size = loaded_bf->size;
+    bf->nblocks = loaded_bf->nblocks;
+  }
+  if (bf->size <= loaded_bf->size) {
+    orFolded(bf->bv, bf->size / 8, loaded_bf->bv, loaded_bf->size / 8);
+  } else {
+    fprintf(stderr, "Filter in file is smaller; fold the filter first\n");
+    rc = -1;
+  }
+  pthread_rwlock_unlock(&bf->rwlock);
+
+  DestroyBlockedBloomFilter(loaded_bf);
+  return rc;
+}
+
+int MergeBlockedBloomFilter(BlockedBloomFilter *bf, const char *filename) {
+  return mergeFile(bf, filename, false);
+}
+
+int MergeBlockedBloomFilterFolding(BlockedBloomFilter *bf,
+                                   const char *filename) {
+  return mergeFile(bf, filename, true);
+}
@@ -0,0 +1,155 @@
+#ifndef BLOCKED_H
+#define BLOCKED_H
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Macro to perform assertions.
+ */
+#define assert(condition, message)                                             \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "Assertion failed: %s\n", message);                      \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Bits per block: one 64 byte cache line.
+ */
+#define BLOCKED_BLOCK_BITS 512
+#define BLOCKED_BLOCK_WORDS (BLOCKED_BLOCK_BITS / 64)
+
+/**
+ * BlockedBloomFilter is a cache-line blocked bloom filter. The bit vector is
+ * split into 512 bit blocks aligned to cache lines; an entry's hash picks one
+ * block and all of its bits are set and tested inside that block. A lookup
+ * therefore costs at most one cache miss no matter how many hash functions
+ * are used, which makes this the fastest layout once the filter no longer
+ * fits in the last level cache. The price is a slightly higher false positive
+ * rate than BloomFilter at the same size, since bits crowd into blocks
+ * unevenly.
+ *
+ * Like BloomFilter it uses central locking via a RWMutex, taken once per key
+ * rather than once per bit.
+ */
+typedef struct BlockedBloomFilter {
+  uint64_t *bv;     // Bit vector, BLOCKED_BLOCK_WORDS words per block
+  uint64_t size;    // Size of bit vector. Power of 2, at least 512.
+  uint64_t nblocks; // Number of blocks
+  int hf;           // Number of hash functions (bits set per entry)
+
+  pthread_rwlock_t rwlock;
+} BlockedBloomFilter;
+
+/**
+ * Create and return a pointer to a new blocked Bloom filter, given a size and
+ * number of hash functions to apply.
+ *
+ * Parameters:
+ * - `size`: the size (in bits) of the filter, a power of 2 of at least 512
+ * - `hf`: number of hash functions to apply in the filter.
+ */
+BlockedBloomFilter *NewBlockedBloomFilter(uint64_t size, int hf);
+
+/**
+ * Manually free a blocked Bloom filter after use in order to avoid memory
+ * leaks.
+ */
+void DestroyBlockedBloomFilter(BlockedBloomFilter *bf);
+
+/**
+ * Looks up an entry in the filter. Returns true if a match is found, false
+ * otherwise. Takes the reader lock once.
+ */
+bool BlockedLookup(BlockedBloomFilter *bf, const char *entry);
+
+/**
+ * Inserts an entry into the filter. Takes the writer lock once.
+ */
+int BlockedInsert(BlockedBloomFilter *bf, const char *entry);
+
+/**
+ * Inserts `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each, hashing them with the vectorized kernels in hashing.h. A key inserted
+ * here is found by BlockedLookup on the same bytes and vice versa.
+ */
+int BlockedInsertBatch(BlockedBloomFilter *bf, const uint8_t *keys,
+                       size_t width, size_t n);
+
+/**
+ * Looks up `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each. `out[i]` is set to true if the i-th key may be in the filter.
+ */
+int BlockedLookupBatch(BlockedBloomFilter *bf, const uint8_t *keys,
+                       size_t width, size_t n, bool *out);
+
+/**
+ * Flushes the filter to a file in checksummed chunks (see chunkio.h).
+ */
+int BlockedWrite(BlockedBloomFilter *bf, const char *filename);
+
+/**
+ * Reads a filter written by BlockedWrite.
+ */
+BlockedBloomFilter *BlockedLoad(const char *filename);
+
+/**
+ * Like BlockedLoad, but folds the filter by `factor` (a power of 2) as it is
+ * read. With a `factor` of 0 the filter is loaded whole and folded by
+ * BlockedFoldFactor(bf, target_fpr). See LoadFolded in bloom.h.
+ */
+BlockedBloomFilter *BlockedLoadFolded(const char *filename, uint64_t factor,
+                                      double target_fpr);
+
+/**
+ * Shrinks the filter to `size / factor` bits, for a power of 2 `factor`, by
+ * OR-ing whole blocks of the upper parts into the lowest one. The folded
+ * filter must keep at least one block. Like FoldBloomFilter in bloom.h, it
+ * folds in place, keeping the memory until the filter is destroyed.
+ */
+int FoldBlockedBloomFilter(BlockedBloomFilter *bf, uint64_t factor);
+
+/**
+ * Fraction of the filter's bits that are set.
+ */
+double BlockedFillRatio(BlockedBloomFilter *bf);
+
+/**
+ * The largest fold factor that keeps the estimated false positive rate at or
+ * under `target_fpr` (1 if the filter can't be folded).
+ */
+uint64_t BlockedFoldFactor(BlockedBloomFilter *bf, double target_fpr);
+
+/**
+ * Function to merge a loaded BlockedBloomFilter with an existing one. A
+ * larger filter in the file is folded down to the size of `bf` as it is
+ * merged. A smaller one is refused; to merge it, fold `bf` down to its size
+ * first or use MergeBlockedBloomFilterFolding.
+ */
+int MergeBlockedBloomFilter(BlockedBloomFilter *bf, const char *filename);
+
+/**
+ * Like MergeBlockedBloomFilter, but a smaller filter in the file is merged by
+ * first folding `bf` down to its size (see FoldBlockedBloomFilter).
+ */
+int MergeBlockedBloomFilterFolding(BlockedBloomFilter *bf,
+                                   const char *filename);
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestNewBlockedBloomFilter();
+void TestBlockedBloomFilter();
+void TestBlockedBatch();
+void TestBlockedWriteLoad();
+void TestBlockedFold();
+
+#endif // BLOCKED_H
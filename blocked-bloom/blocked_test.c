@@ -0,0 +1,189 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocked.h"
+
+int main() {
+  printf("Running tests...\n");
+  TestNewBlockedBloomFilter();
+  TestBlockedBloomFilter();
+  TestBlockedBatch();
+  TestBlockedWriteLoad();
+  TestBlockedFold();
+  printf("All tests passed!\n");
+  return 0;
+}
+
+void TestNewBlockedBloomFilter() {
+  BlockedBloomFilter *bf = NewBlockedBloomFilter(100000, 4);
+  assert(bf == NULL, "NewBlockedBloomFilter should return NULL for bad size");
+
+  bf = NewBlockedBloomFilter(256, 4);
+  assert(bf == NULL, "NewBlockedBloomFilter should need at least one block");
+
+  bf = NewBlockedBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewBlockedBloomFilter should not return NULL");
+  assert(((uintptr_t)bf->bv & 63) == 0, "Blocks should be cache line aligned");
+  assert(bf->nblocks == 2048, "1048576 bits should be 2048 blocks");
+
+  DestroyBlockedBloomFilter(bf);
+  printf("TestNewBlockedBloomFilter passed\n");
+}
+
+void TestBlockedBloomFilter() {
+  BlockedBloomFilter *bf = NewBlockedBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewBlockedBloomFilter should not return NULL");
+
+  const char *entries[] = {"b99afb65c9f97b2e0feea844eea55f69",
+                           "f530e3093a1617d64f400c5578005b7c",
+                           "b29317ac342ceafc79e59996678efeb3",
+                           "00421829519ccc2834eedc2bac21df68"};
+  const char *fakes[] = {"hahaidontexist", "foobar", "turnips", "lavacakes"};
+
+  for (int i = 0; i < 4; i++) {
+    assert(BlockedInsert(bf, entries[i]) == 0,
+           "BlockedInsert should not return an error");
+  }
+  for (int i = 0; i < 4; i++) {
+    assert(BlockedLookup(bf, entries[i]), "Entry should exist in the filter");
+    assert(!BlockedLookup(bf, fakes[i]), "Fake should not exist in the filter");
+  }
+
+  // Every entry's bits land in a single block.
+  int blocks = 0;
+  for (uint64_t b = 0; b < bf->nblocks; b++) {
+    for (int w = 0; w < BLOCKED_BLOCK_WORDS; w++) {
+      if (bf->bv[b * BLOCKED_BLOCK_WORDS + w] != 0) {
+        blocks++;
+        break;
+      }
+    }
+  }
+  assert(blocks <= 4, "Four entries should touch at most four blocks");
+
+  DestroyBlockedBloomFilter(bf);
+  printf("TestBlockedBloomFilter passed\n");
+}
+
+void TestBlockedBatch() {
+  enum { N = 4096, WIDTH = 16 };
+  BlockedBloomFilter *bf = NewBlockedBloomFilter(65536, 4);
+  assert(bf != NULL, "NewBlockedBloomFilter should not return NULL");
+
+  uint8_t *keys = malloc(2 * N * WIDTH);
+  uint64_t x = 1;
+  for (size_t i = 0; i < 2 * N * WIDTH; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    keys[i] = 'a' + (x >> 33) % 26;
+  }
+  bool *found = malloc(N * sizeof(bool));
+
+  assert(BlockedInsertBatch(bf, keys, WIDTH, N) == 0,
+         "BlockedInsertBatch should not return an error");
+  assert(BlockedLookupBatch(bf, keys, WIDTH, N, found) == 0,
+         "BlockedLookupBatch should not return an error");
+  for (int i = 0; i < N; i++) {
+    assert(found[i], "Batch inserted key should be found");
+  }
+
+  // Batch inserts must be visible to single-key lookups.
+  char key[WIDTH + 1] = {0};
+  memcpy(key, keys, WIDTH);
+  assert(BlockedLookup(bf, key), "Batch inserted key should exist");
+
+  // 16 bits per key and 4 hash functions: a plain bloom filter would see
+  // about 0.24% false positives, blocking costs a little on top of that.
+  assert(BlockedLookupBatch(bf, keys + N * WIDTH, WIDTH, N, found) == 0,
+         "BlockedLookupBatch should not return an error");
+  int fp = 0;
+  for (int i = 0; i < N; i++) {
+    fp += found[i];
+  }
+  assert(fp < N / 100, "False positive rate should stay under 1%");
+
+  free(found);
+  free(keys);
+  DestroyBlockedBloomFilter(bf);
+  printf("TestBlockedBatch passed\n");
+}
+
+void TestBlockedWriteLoad() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-blocked-%d.bf", (int)getpid());
+  BlockedBloomFilter *bf = NewBlockedBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewBlockedBloomFilter should not return NULL");
+  assert(BlockedInsert(bf, "b99afb65c9f97b2e0feea844eea55f69") == 0,
+         "BlockedInsert should not return an error");
+
+  assert(BlockedWrite(bf, path) == 0, "BlockedWrite should not fail");
+  BlockedBloomFilter *loaded = BlockedLoad(path);
+  assert(loaded != NULL, "BlockedLoad should not return NULL");
+  assert(memcmp(loaded->bv, bf->bv, bf->size / 8) == 0,
+         "Loaded bit vector should match");
+  assert(BlockedLookup(loaded, "b99afb65c9f97b2e0feea844eea55f69"),
+         "Inserted key should exist in the loaded filter");
+
+  BlockedInsert(loaded, "f530e3093a1617d64f400c5578005b7c");
+  assert(BlockedWrite(loaded, path) == 0, "BlockedWrite should not fail");
+  assert(MergeBlockedBloomFilter(bf, path) == 0,
+         "MergeBlockedBloomFilter should not fail");
+  assert(BlockedLookup(bf, "f530e3093a1617d64f400c5578005b7c"),
+         "Merged key should exist in the filter");
+
+  unlink(path);
+  DestroyBlockedBloomFilter(loaded);
+  DestroyBlockedBloomFilter(bf);
+  printf("TestBlockedWriteLoad passed\n");
+}
+
+void TestBlockedFold() {
+  BlockedBloomFilter *bf = NewBlockedBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewBlockedBloomFilter should not return NULL");
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    BlockedInsert(bf, key);
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-bfold-%d.bf", (int)getpid());
+  assert(BlockedWrite(bf, path) == 0, "BlockedWrite should not fail");
+
+  assert(FoldBlockedBloomFilter(bf, 4096) != 0,
+         "Folding below one block should fail");
+
+  // Four bits per key: the filter can fold much further for the same target
+  // than one filling a bit per key, but not all the way.
+  uint64_t factor = BlockedFoldFactor(bf, 0.01);
+  assert(factor > 1 && factor < 2048, "Fold factor should be in range");
+  assert(FoldBlockedBloomFilter(bf, factor) == 0,
+         "FoldBlockedBloomFilter should not fail");
+  assert(bf->size == 1048576 / factor && bf->nblocks == bf->size / 512,
+         "Folded filter parameters");
+  assert(((uintptr_t)bf->bv & 63) == 0, "Folded blocks should stay aligned");
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(BlockedLookup(bf, key), "Keys should survive folding");
+  }
+
+  BlockedBloomFilter *loaded = BlockedLoadFolded(path, factor, 0);
+  assert(loaded != NULL, "BlockedLoadFolded should not return NULL");
+  assert(memcmp(loaded->bv, bf->bv, bf->size / 8) == 0,
+         "Streamed fold should match folding in memory");
+  DestroyBlockedBloomFilter(loaded);
+
+  BlockedBloomFilter *small = NewBlockedBloomFilter(4096, 4);
+  BlockedInsert(small, "small-key");
+  assert(MergeBlockedBloomFilter(small, path) == 0,
+         "Merging a larger filter should fold it");
+  assert(BlockedLookup(small, "key-1") && BlockedLookup(small, "small-key"),
+         "Merged filter should have both filters' keys");
+
+  unlink(path);
+  DestroyBlockedBloomFilter(small);
+  DestroyBlockedBloomFilter(bf);
+  printf("TestBlockedFold passed\n");
+}
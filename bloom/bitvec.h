@@ -0,0 +1,173 @@
+#ifndef BITVEC_H
+#define BITVEC_H
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Whole-vector operations shared by the filter layouts: OR-ing one bit or
+ * byte vector into another (merging and folding) and counting set bits (fill
+ * ratio). OR has AVX2 and AVX-512 kernels, picked at runtime like the hashing
+ * kernels in hashing.h.
+ */
+typedef void (*orVectorFn)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static void orVectorScalar(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a |= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for (; i < len; i++) {
+    dst[i] |= src[i];
+  }
+}
+
+__attribute__((target("avx2"))) static void
+orVectorAVX2(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    for (int j = 0; j < 128; j += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i + j));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + j));
+      _mm256_storeu_si256((__m256i *)(dst + i + j), _mm256_or_si256(a, b));
+    }
+  }
+  orVectorScalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx512f"))) static void
+orVectorAVX512(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  for (; i + 256 <= len; i += 256) {
+    for (int j = 0; j < 256; j += 64) {
+      __m512i a = _mm512_loadu_si512(dst + i + j);
+      __m512i b = _mm512_loadu_si512(src + i + j);
+      _mm512_storeu_si512(dst + i + j, _mm512_or_si512(a, b));
+    }
+  }
+  orVectorScalar(dst + i, src + i, len - i);
+}
+
+typedef uint64_t (*countBitsFn)(const uint8_t *v, size_t len);
+
+static uint64_t countBitsScalar(const uint8_t *v, size_t len) {
+  uint64_t n = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, v + i, 8);
+    n += (uint64_t)__builtin_popcountll(w);
+  }
+  for (; i < len; i++) {
+    n += (uint64_t)__builtin_popcount(v[i]);
+  }
+  return n;
+}
+
+__attribute__((target("popcnt"))) static uint64_t
+countBitsPopcnt(const uint8_t *v, size_t len) {
+  uint64_t n = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, v + i, 8);
+    n += (uint64_t)__builtin_popcountll(w);
+  }
+  for (; i < len; i++) {
+    n += (uint64_t)__builtin_popcount(v[i]);
+  }
+  return n;
+}
+
+static orVectorFn orVectorImpl = orVectorScalar;
+static countBitsFn countBitsImpl = countBitsScalar;
+static pthread_once_t bitVecOnce = PTHREAD_ONCE_INIT;
+
+static void bitVecResolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    orVectorImpl = orVectorAVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    orVectorImpl = orVectorAVX2;
+  }
+  if (__builtin_cpu_supports("popcnt")) {
+    countBitsImpl = countBitsPopcnt;
+  }
+}
+
+/**
+ * dst[i] |= src[i] for `len` bytes. The ranges must not overlap.
+ */
+static inline void orVector(void *dst, const void *src, size_t len) {
+  pthread_once(&bitVecOnce, bitVecResolve);
+  orVectorImpl(dst, src, len);
+}
+
+/**
+ * Number of set bits in `len` bytes. Byte-array filters store 0 or 1 per
+ * byte, so this counts their set bytes too.
+ */
+static inline uint64_t countBits(const void *v, size_t len) {
+  pthread_once(&bitVecOnce, bitVecResolve);
+  return countBitsImpl(v, len);
+}
+
+/**
+ * Fold `len` bytes in place down to the first `len / factor`, OR-ing every
+ * other slice into it. Filters index with `hash & (size - 1)`, so after
+ * folding a power of two filter, `hash & (size / factor - 1)` finds every bit
+ * that was set before.
+ */
+static inline void foldVector(void *v, size_t len, uint64_t factor) {
+  size_t part = len / factor;
+  for (uint64_t j = 1; j < factor; j++) {
+    orVector(v, (uint8_t *)v + j * part, part);
+  }
+}
+
+/**
+ * OR `src` (`src_len` bytes) folded down to `dst_len` bytes into `dst`,
+ * leaving `src` untouched. `dst_len` must divide `src_len`.
+ */
+static inline void orFolded(void *dst, size_t dst_len, const void *src,
+                            size_t src_len) {
+  for (size_t off = 0; off < src_len; off += dst_len) {
+    orVector(dst, (const uint8_t *)src + off, dst_len);
+  }
+}
+
+/**
+ * Largest power of two fold factor that keeps the estimated false positive
+ * rate at or under `target`, for a filter of `size` bits of which `set` are
+ * set and where an entry sets `probes` distinct bits. With fill ratio p,
+ * folding by f ORs f bits into each remaining bit, so the fill becomes
+ * 1 - (1 - p)^f and the false positive rate about fill^probes. The folded
+ * filter keeps at least `min_size` bits. Returns 1 if it can't be folded.
+ */
+static inline uint64_t foldFactorFor(uint64_t set, uint64_t size, int probes,
+                                     uint64_t min_size, double target) {
+  double empty = 1.0 - (double)set / (double)size; // (1 - p)^f, f = 1
+  uint64_t factor = 1;
+
+  while (size / (factor * 2) >= min_size) {
+    double folded_empty = empty * empty;
+    double fpr = 1.0;
+    for (int i = 0; i < probes; i++) {
+      fpr *= 1.0 - folded_empty;
+    }
+    if (fpr > target) {
+      break;
+    }
+    empty = folded_empty;
+    factor *= 2;
+  }
+  return factor;
+}
+
+#endif // BITVEC_H
@@ -1,5 +1,8 @@
 #include "bloom.h"
+#include "bitvec.h"
+#include "chunkio.h"
 #include "hashing.h"
+#include "probe.h"
 #include "xxhash.h"
 
 BloomFilter *NewBloomFilter(uint64_t size, int hf) {
@@ -24,6 +27,7 @@ BloomFilter *NewBloomFilter(uint64_t size, int hf) {
 
   if (!bf->bv) {
     perror("Failed to allocate bit vector.");
+    free(bf);
     return NULL;
   }
 
@@ -100,57 +104,178 @@ bool getBitAsync(BloomFilter *bf, uint64_t idx) {
 
 bool Lookup(BloomFilter *bf, const char *entry) {
   uint64_t *hashes = hashEntry(entry, strlen(entry), bf->hf);
-  for (int i = 0; i < bf->hf; i++) {
+  if (hashes == NULL) {
+    return false;
+  }
+  bool found = true;
+  for (int i = 0; i < bf->hf && found; i++) {
     uint64_t lookup_idx = hashes[i] & (bf->size - 1);
-    if (!getBit(bf, lookup_idx)) {
-      return false;
-    }
+    found = getBit(bf, lookup_idx);
   }
-  return true;
+  free(hashes);
+  return found;
 }
 
 int Insert(BloomFilter *bf, const char *entry) {
   uint64_t *hashes = hashEntry(entry, strlen(entry), bf->hf);
-  for (int i = 0; i < bf->hf; i++) {
+  if (hashes == NULL) {
+    return -1;
+  }
+  int rc = 0;
+  for (int i = 0; i < bf->hf && rc == 0; i++) {
     uint64_t lookup_idx = hashes[i] & (bf->size - 1);
-    if (setBit(bf, lookup_idx) != 0) {
-      return -1;
-    }
+    rc = setBit(bf, lookup_idx);
+  }
+  free(hashes);
+  return rc;
+}
+
+bool LookupAsync(BloomFilter *bf, const char *entry) {
+  uint64_t stack[PROBE_STACK_HASHES];
+  uint64_t *hashes = bf->hf <= PROBE_STACK_HASHES
+                         ? stack
+                         : malloc(bf->hf * sizeof(uint64_t));
+  if (hashes == NULL) {
+    perror("Failed to allocate memory for hashes.");
+    return false;
+  }
+
+  // No locking here
+  expandHash(XXH64(entry, strlen(entry), 0), bf->hf, hashes);
+  bool found = probeBits(bf->bv, bf->size - 1, hashes, bf->hf);
+  if (hashes != stack) {
+    free(hashes);
+  }
+  return found;
+}
+
+int InsertAsync(BloomFilter *bf, const char *entry) {
+  uint64_t stack[PROBE_STACK_HASHES];
+  uint64_t *hashes = bf->hf <= PROBE_STACK_HASHES
+                         ? stack
+                         : malloc(bf->hf * sizeof(uint64_t));
+  if (hashes == NULL) {
+    perror("Failed to allocate memory for hashes.");
+    return -1;
+  }
+
+  // No locking here
+  expandHash(XXH64(entry, strlen(entry), 0), bf->hf, hashes);
+  for (int i = 0; i < bf->hf; i++) {
+    uint64_t idx = hashes[i] & (bf->size - 1);
+    bf->bv[idx / 64] |= 1ULL << (idx & 63);
+  }
+  if (hashes != stack) {
+    free(hashes);
   }
   return 0;
 }
 
-int Write(BloomFilter *bf, const char *filename) {
-  FILE *f = fopen(filename, "wb");
-  if (f == NULL) {
-    perror("Failed to open file for writing");
+/**
+ * Prefetch every word the block of hashes is about to touch so the probing
+ * pass overlaps its cache misses instead of taking them one at a time. Called
+ * under the lock, like the probes, since a fold changes the size.
+ */
+static void prefetchBlock(BloomFilter *bf, const uint64_t *hashes,
+                          size_t count, uint64_t *expanded, int rw) {
+  for (size_t j = 0; j < count; j++) {
+    expandHash(hashes[j], bf->hf, expanded);
+    for (int i = 0; i < bf->hf; i++) {
+      uint64_t idx = expanded[i] & (bf->size - 1);
+      if (rw) {
+        __builtin_prefetch(&bf->bv[idx / 64], 1);
+      } else {
+        __builtin_prefetch(&bf->bv[idx / 64], 0);
+      }
+    }
+  }
+}
+
+int InsertBatch(BloomFilter *bf, const uint8_t *keys, size_t width, size_t n) {
+  uint64_t hashes[BATCH_BLOCK];
+  uint64_t *expanded = malloc(bf->hf * sizeof(uint64_t));
+  if (expanded == NULL) {
+    perror("Failed to allocate memory for hashes.");
     return -1;
   }
 
-  printf("Writing bit vector to file...\n");
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_wrlock(&bf->rwlock);
+    prefetchBlock(bf, hashes, count, expanded, 1);
+    for (size_t j = 0; j < count; j++) {
+      expandHash(hashes[j], bf->hf, expanded);
+      for (int i = 0; i < bf->hf; i++) {
+        uint64_t idx = expanded[i] & (bf->size - 1);
+        bf->bv[idx / 64] |= (1ULL << (idx & 63));
+      }
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+  }
 
-  // Write the size and number of hash functions
-  if (fwrite(&bf->size, sizeof(uint64_t), 1, f) != 1 ||
-      fwrite(&bf->hf, sizeof(int), 1, f) != 1) {
-    perror("Failed to write filter metadata");
-    fclose(f);
+  free(expanded);
+  return 0;
+}
+
+int LookupBatch(BloomFilter *bf, const uint8_t *keys, size_t width, size_t n,
+                bool *out) {
+  uint64_t hashes[BATCH_BLOCK];
+  uint64_t *expanded = malloc(bf->hf * sizeof(uint64_t));
+  if (expanded == NULL) {
+    perror("Failed to allocate memory for hashes.");
     return -1;
   }
 
-  // Write the bit vector
-  size_t bv_size = bf->size / 64;
-  if (fwrite(bf->bv, sizeof(uint64_t), bv_size, f) != bv_size) {
-    perror("Failed to write bit vector");
-    fclose(f);
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_rdlock(&bf->rwlock);
+    prefetchBlock(bf, hashes, count, expanded, 0);
+    for (size_t j = 0; j < count; j++) {
+      bool found = true;
+      expandHash(hashes[j], bf->hf, expanded);
+      for (int i = 0; i < bf->hf && found; i++) {
+        uint64_t idx = expanded[i] & (bf->size - 1);
+        found = (bf->bv[idx / 64] & (1ULL << (idx & 63))) != 0;
+      }
+      out[start + j] = found;
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+  }
+
+  free(expanded);
+  return 0;
+}
+
+int Write(BloomFilter *bf, const char *filename) {
+  return WriteParallel(bf, filename, 0);
+}
+
+int WriteParallel(BloomFilter *bf, const char *filename, int threads) {
+  printf("Writing bit vector to file...\n");
+
+  pthread_rwlock_rdlock(&bf->rwlock);
+  BloomFileMeta meta = {.size = bf->size, .hf = (uint64_t)bf->hf};
+  int rc = WriteChunkedFile(filename, CHUNKED_KIND_BLOOM, &meta, sizeof(meta),
+                            bf->bv, bf->size / 8, CHUNKED_FILE_CHUNK_SIZE,
+                            threads);
+  pthread_rwlock_unlock(&bf->rwlock);
+  if (rc != 0) {
     return -1;
   }
 
-  fclose(f);
   printf("Successfully wrote bitvector to file: %s\n", filename);
   return 0;
 }
 
-BloomFilter *Load(const char *filename) {
+/**
+ * Reads a file in the original unchunked layout: size, number of hash
+ * functions, then the raw bit vector.
+ */
+static BloomFilter *loadLegacy(const char *filename) {
   FILE *f = fopen(filename, "rb");
   if (f == NULL) {
     perror("Failed to open file for reading");
@@ -168,7 +293,8 @@ BloomFilter *Load(const char *filename) {
     return NULL;
   }
 
-  BloomFilter *bf = NewBloomFilter(size, hf);
+  // Legacy files predate double hashing.
+  BloomFilter *bf = NewBloomFilter(size, singleHashHf(hf));
   if (bf == NULL) {
     fclose(f);
     return NULL;
@@ -184,32 +310,163 @@ BloomFilter *Load(const char *filename) {
   }
 
   fclose(f);
-  printf("Loaded bitvector from file: %s\n", filename);
   return bf;
 }
 
 /**
- * Function to merge a loaded BloomFilter with an existing one
+ * Reads a chunked file, folding it by `factor` (a power of 2) on the way in.
+ * Falls back to the legacy layout, folded after loading, when the file isn't
+ * chunked.
  */
-int MergeBloomFilter(BloomFilter *bf, const char *filename) {
+static BloomFilter *loadChunked(const char *filename, uint64_t factor,
+                                int threads) {
+  BloomFileMeta meta;
+  BloomFilter *bf;
+  ChunkedFile *cf =
+      OpenChunkedFile(filename, CHUNKED_KIND_BLOOM, &meta, sizeof(meta));
+
+  if (cf == NULL) {
+    if (errno != EILSEQ) {
+      return NULL;
+    }
+    bf = loadLegacy(filename);
+    if (bf != NULL && FoldBloomFilter(bf, factor) != 0) {
+      DestroyBloomFilter(bf);
+      return NULL;
+    }
+  } else {
+    bf = meta.size / factor >= 64
+             ? NewBloomFilter(meta.size / factor, (int)meta.hf)
+             : NULL;
+    if (bf == NULL || cf->hdr.payload_len != meta.size / 8) {
+      fprintf(stderr, "%s: bad filter metadata\n", filename);
+      DestroyBloomFilter(bf);
+      CloseChunkedFile(cf);
+      return NULL;
+    }
+
+    int64_t corrupt =
+        factor == 1
+            ? ReadChunkedPayload(cf, bf->bv, threads)
+            : ReadChunkedPayloadFolded(cf, bf->bv, bf->size / 8, threads);
+    CloseChunkedFile(cf);
+    if (corrupt != 0) {
+      if (corrupt > 0) {
+        fprintf(stderr, "%s: %lld corrupt chunk(s), refusing to load\n",
+                filename, (long long)corrupt);
+      }
+      DestroyBloomFilter(bf);
+      return NULL;
+    }
+  }
+
+  if (bf != NULL) {
+    printf("Loaded bitvector from file: %s\n", filename);
+  }
+  return bf;
+}
+
+BloomFilter *Load(const char *filename) { return LoadParallel(filename, 0); }
+
+BloomFilter *LoadParallel(const char *filename, int threads) {
+  return loadChunked(filename, 1, threads);
+}
+
+BloomFilter *LoadFolded(const char *filename, uint64_t factor,
+                        double target_fpr) {
+  if (factor == 0) {
+    BloomFilter *bf = Load(filename);
+    if (bf != NULL &&
+        FoldBloomFilter(bf, BloomFoldFactor(bf, target_fpr)) != 0) {
+      DestroyBloomFilter(bf);
+      return NULL;
+    }
+    return bf;
+  }
+  if ((factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return NULL;
+  }
+  return loadChunked(filename, factor, 0);
+}
+
+int FoldBloomFilter(BloomFilter *bf, uint64_t factor) {
+  if (factor == 0 || (factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&bf->rwlock);
+  if (bf->size / factor < 64) {
+    pthread_rwlock_unlock(&bf->rwlock);
+    fprintf(stderr, "Folded filter size must be at least 64\n");
+    return -1;
+  }
+  if (factor > 1) {
+    // The vector stays where it is, so nothing holding `bv` can be left
+    // pointing at freed memory; the upper part is unused until it is freed.
+    foldVector(bf->bv, bf->size / 8, factor);
+    bf->size /= factor;
+  }
+  pthread_rwlock_unlock(&bf->rwlock);
+  return 0;
+}
+
+double BloomFillRatio(BloomFilter *bf) {
+  pthread_rwlock_rdlock(&bf->rwlock);
+  double fill = (double)countBits(bf->bv, bf->size / 8) / (double)bf->size;
+  pthread_rwlock_unlock(&bf->rwlock);
+  return fill;
+}
+
+uint64_t BloomFoldFactor(BloomFilter *bf, double target_fpr) {
+  pthread_rwlock_rdlock(&bf->rwlock);
+  uint64_t factor = foldFactorFor(countBits(bf->bv, bf->size / 8), bf->size,
+                                  bf->hf, 64, target_fpr);
+  pthread_rwlock_unlock(&bf->rwlock);
+  return factor;
+}
+
+/**
+ * Merges the filter saved in `filename` into `bf`, folding `bf` down to the
+ * size of a smaller file if `fold` is set.
+ */
+static int mergeFile(BloomFilter *bf, const char *filename, bool fold) {
   BloomFilter *loaded_bf = Load(filename);
   if (loaded_bf == NULL) {
     return -1;
   }
 
-  if (bf->size != loaded_bf->size || bf->hf != loaded_bf->hf) {
+  if (bf->hf != loaded_bf->hf) {
     fprintf(stderr, "Mismatch in BloomFilter parameters\n");
     DestroyBloomFilter(loaded_bf);
     return -1;
   }
 
-  size_t bv_size = bf->size / 64;
+  // A larger file is folded down as it is OR-ed in. A smaller one means
+  // folding `bf`, which only happens if the caller asked for it.
   pthread_rwlock_wrlock(&bf->rwlock);
-  for (size_t i = 0; i < bv_size; i++) {
-    bf->bv[i] |= loaded_bf->bv[i];
+  int rc = 0;
+  if (bf->size > loaded_bf->size && fold) {
+    foldVector(bf->bv, bf->size / 8, bf->size / loaded_bf->size);
+    bf->size = loaded_bf->size;
+  }
+  if (bf->size <= loaded_bf->size) {
+    orFolded(bf->bv, bf->size / 8, loaded_bf->bv, loaded_bf->size / 8);
+  } else {
+    fprintf(stderr, "Filter in file is smaller; fold the filter first\n");
+    rc = -1;
   }
   pthread_rwlock_unlock(&bf->rwlock);
 
   DestroyBloomFilter(loaded_bf);
-  return 0;
+  return rc;
+}
+
+int MergeBloomFilter(BloomFilter *bf, const char *filename) {
+  return mergeFile(bf, filename, false);
+}
+
+int MergeBloomFilterFolding(BloomFilter *bf, const char *filename) {
+  return mergeFile(bf, filename, true);
 }
\ No newline at end of file
@@ -1,3 +1,6 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
@@ -114,23 +117,126 @@ bool Lookup(BloomFilter *bf, const char *entry);
 int Insert(BloomFilter *bf, const char *entry);
 
 /**
- * Flushes the Bloom filter to a file.
+ * Looks up an entry without taking the lock. All of the entry's positions are
+ * fetched at once with AVX2/AVX-512 gathers (a scalar loop elsewhere) and
+ * checked without branching, so this is much faster than Lookup on filters
+ * that fit in cache. To be used when nothing inserts concurrently.
+ */
+bool LookupAsync(BloomFilter *bf, const char *entry);
+
+/**
+ * Inserts an entry without taking the lock. To be used in a single threaded
+ * context to avoid the mutex wait.
+ */
+int InsertAsync(BloomFilter *bf, const char *entry);
+
+/**
+ * Inserts `n` fixed-width keys into the filter. The keys are laid out back to
+ * back in `keys`, `width` bytes each (e.g. 16 byte UUIDs). Keys are hashed
+ * several at a time with the vectorized kernels in hashing.h and the writer
+ * lock is taken once per block of keys rather than once per bit.
+ *
+ * A key inserted here is found by Lookup on the same bytes and vice versa.
+ */
+int InsertBatch(BloomFilter *bf, const uint8_t *keys, size_t width, size_t n);
+
+/**
+ * Looks up `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each. `out[i]` is set to true if the i-th key may be in the filter. Takes the
+ * reader lock once per block of keys.
+ */
+int LookupBatch(BloomFilter *bf, const uint8_t *keys, size_t width, size_t n,
+                bool *out);
+
+/**
+ * Flushes the Bloom filter to a file. The bit vector is written in
+ * checksummed chunks, using one thread per online CPU.
  */
 int Write(BloomFilter *bf, const char *filename);
 
 /**
- * Reads an existing Bloom filter from a file.
+ * Like Write, with an explicit number of writer threads (0 picks one per
+ * online CPU).
+ */
+int WriteParallel(BloomFilter *bf, const char *filename, int threads);
+
+/**
+ * Reads an existing Bloom filter from a file. Every chunk is verified against
+ * its checksum; corrupt chunks are reported on stderr and the load fails.
+ * Files written before chunking was introduced are still read.
  */
 BloomFilter *Load(const char *filename);
 
 /**
- * Function to merge a loaded BloomFilter with an existing one
+ * Like Load, with an explicit number of reader threads (0 picks one per
+ * online CPU).
+ */
+BloomFilter *LoadParallel(const char *filename, int threads);
+
+/**
+ * Like Load, but folds the filter by `factor` (a power of 2) as it is read,
+ * without ever holding the full size bit vector in memory. With a `factor` of
+ * 0 the filter is loaded whole and folded by BloomFoldFactor(bf, target_fpr).
+ */
+BloomFilter *LoadFolded(const char *filename, uint64_t factor,
+                        double target_fpr);
+
+/**
+ * Shrinks the filter to `size / factor` bits, for a power of 2 `factor`, by
+ * OR-ing the upper parts of the bit vector into the lowest one. Entries are
+ * indexed with `hash & (size - 1)`, so everything inserted before is still
+ * found; the false positive rate goes up with the fill ratio. The folded
+ * filter must keep at least 64 bits.
+ *
+ * The fold happens in place under the write lock, and the memory of the upper
+ * parts is only given back when the filter is destroyed. It must not run
+ * alongside the calls that skip the lock (LookupAsync, InsertAsync,
+ * getBitAsync and setBitAsync), which would probe with the old size.
+ */
+int FoldBloomFilter(BloomFilter *bf, uint64_t factor);
+
+/**
+ * Fraction of the filter's bits that are set.
+ */
+double BloomFillRatio(BloomFilter *bf);
+
+/**
+ * The largest fold factor that keeps the estimated false positive rate at or
+ * under `target_fpr`, given the current fill ratio (1 if the filter can't be
+ * folded).
+ */
+uint64_t BloomFoldFactor(BloomFilter *bf, double target_fpr);
+
+/**
+ * Function to merge a loaded BloomFilter with an existing one. A larger filter
+ * in the file is folded down to the size of `bf` as it is merged. A smaller
+ * one is refused; to merge it, fold `bf` down to its size first or use
+ * MergeBloomFilterFolding.
  */
 int MergeBloomFilter(BloomFilter *bf, const char *filename);
 
+/**
+ * Like MergeBloomFilter, but a smaller filter in the file is merged by first
+ * folding `bf` down to its size, under the same write lock. The same caveats
+ * as FoldBloomFilter apply.
+ */
+int MergeBloomFilterFolding(BloomFilter *bf, const char *filename);
+
 /**
  * Testing functions to verify intended functionality.
  */
 void TestBFSetBit();
 void TestNewBloomFilter();
-void TestBloomFilter();
\ No newline at end of file
+void TestBloomFilter();
+void TestHashFixed();
+void TestBatch();
+void TestCrc32c();
+void TestWriteLoad();
+void TestLoadCorrupt();
+void TestLoadCrafted();
+void TestLoadLegacy();
+void TestFold();
+void TestLoadFolded();
+void TestLookupAsync();
+
+#endif // BLOOM_H
@@ -3,14 +3,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "bloom.h"
+#include "chunkio.h"
+#include "hashing.h"
+#include "scheduler.h"
+#include "shared.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 int main() {
   printf("Running tests...\n");
   TestBFSetBit();
   TestNewBloomFilter();
   TestBloomFilter();
+  TestHashFixed();
+  TestBatch();
+  TestSharedBloomFilter();
+  TestSharedBloomFilterStale();
+  TestCrc32c();
+  TestWriteLoad();
+  TestLoadCorrupt();
+  TestLoadCrafted();
+  TestLoadLegacy();
+  TestFold();
+  TestLoadFolded();
+  TestLookupAsync();
+  TestLookupScheduler();
   printf("All tests passed!\n");
   return 0;
 }
@@ -73,4 +95,698 @@ void TestBloomFilter() {
 
   DestroyBloomFilter(bf);
   printf("TestBloomFilter passed\n");
-}
\ No newline at end of file
+}
+
+void TestHashFixed() {
+  const size_t widths[] = {8, 16, 24, 32, 64};
+  const size_t n = 37; // Not a multiple of any lane count
+  uint8_t keys[37 * 64];
+  uint64_t got[37];
+
+  for (size_t i = 0; i < sizeof(keys); i++) {
+    keys[i] = (uint8_t)(i * 131 + 7);
+  }
+
+  for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+    size_t width = widths[w];
+
+    hashFixedBatch(keys, width, n, got);
+    for (size_t i = 0; i < n; i++) {
+      assert(got[i] == XXH64(keys + i * width, width, 0),
+             "hashFixedBatch should match XXH64");
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      hashFixedAVX2(keys, width, n, got);
+      for (size_t i = 0; i < n; i++) {
+        assert(got[i] == XXH64(keys + i * width, width, 0),
+               "AVX2 kernel should match XXH64");
+      }
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512dq")) {
+      hashFixedAVX512(keys, width, n, got);
+      for (size_t i = 0; i < n; i++) {
+        assert(got[i] == XXH64(keys + i * width, width, 0),
+               "AVX-512 kernel should match XXH64");
+      }
+    }
+  }
+
+  printf("TestHashFixed passed (%s)\n", hashFixedKernel());
+}
+
+void TestBatch() {
+  BloomFilter *bf = NewBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewBloomFilter should not return NULL");
+
+  const char *present = "b99afb65c9f97b2e0feea844eea55f69"
+                        "f530e3093a1617d64f400c5578005b7c"
+                        "b29317ac342ceafc79e59996678efeb3"
+                        "00421829519ccc2834eedc2bac21df68";
+  const char *absent = "hahaidontexisthahaidontexist0000"
+                       "foobarfoobarfoobarfoobarfoobar00";
+  bool found[4];
+
+  assert(InsertBatch(bf, (const uint8_t *)present, 32, 4) == 0,
+         "InsertBatch should not return an error");
+
+  // Batch inserts must be visible to single-key lookups.
+  char key[33] = {0};
+  for (int i = 0; i < 4; i++) {
+    memcpy(key, present + i * 32, 32);
+    assert(Lookup(bf, key), "Batch inserted key should exist in the filter");
+  }
+
+  assert(LookupBatch(bf, (const uint8_t *)present, 32, 4, found) == 0,
+         "LookupBatch should not return an error");
+  for (int i = 0; i < 4; i++) {
+    assert(found[i], "Batch inserted key should be found by LookupBatch");
+  }
+
+  assert(LookupBatch(bf, (const uint8_t *)absent, 32, 2, found) == 0,
+         "LookupBatch should not return an error");
+  assert(!found[0] && !found[1], "Absent keys should not exist in the filter");
+
+  // And single-key inserts must be visible to batch lookups.
+  assert(Insert(bf, "hahaidontexisthahaidontexist0000") == 0,
+         "Insert should not return an error");
+  assert(LookupBatch(bf, (const uint8_t *)absent, 32, 1, found) == 0,
+         "LookupBatch should not return an error");
+  assert(found[0], "Inserted key should be found by LookupBatch");
+
+  DestroyBloomFilter(bf);
+  printf("TestBatch passed\n");
+}
+
+void TestSharedBloomFilter() {
+  char name[64];
+  snprintf(name, sizeof(name), "/hyperbloom-test-%d", (int)getpid());
+
+  SharedBloomFilter *sbf = OpenSharedBloomFilter(name, 1048576, 4);
+  assert(sbf != NULL, "OpenSharedBloomFilter should not return NULL");
+
+  const char *e1 = "b99afb65c9f97b2e0feea844eea55f69";
+  const char *e2 = "f530e3093a1617d64f400c5578005b7c";
+  const char *fake1 = "hahaidontexist";
+
+  // A second process attaches by name and inserts.
+  pid_t pid = fork();
+  assert(pid >= 0, "fork should not fail");
+  if (pid == 0) {
+    SharedBloomFilter *child = OpenSharedBloomFilter(name, 1048576, 4);
+    int rc = child != NULL && SharedInsert(child, e1) == 0 ? 0 : 1;
+    DetachSharedBloomFilter(child);
+    _exit(rc);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+         "Child should insert into the shared filter");
+
+  assert(SharedLookup(sbf, e1), "e1 inserted by the child should exist");
+  assert(!SharedLookup(sbf, fake1), "fake1 should not exist in the filter");
+  assert(sbf->hdr->attached == 1, "Only the parent should still be attached");
+
+  assert(OpenSharedBloomFilter(name, 2048, 4) == NULL,
+         "Opening with different parameters should fail");
+
+  DetachSharedBloomFilter(sbf);
+  assert(UnlinkSharedBloomFilter(name) == 0, "Unlink should not fail");
+  assert(AttachSharedBloomFilter(name) == NULL,
+         "Attaching to an unlinked filter should fail");
+
+  // File-backed filters behave the same way.
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-test-%d.bf", (int)getpid());
+  SharedBloomFilter *a = CreateSharedBloomFilter(path, 4096, 3);
+  assert(a != NULL, "CreateSharedBloomFilter should not return NULL");
+  SharedBloomFilter *b = AttachSharedBloomFilter(path);
+  assert(b != NULL, "AttachSharedBloomFilter should not return NULL");
+  assert(b->size == 4096 && b->hf == 3, "Attached filter parameters");
+  assert(SharedInsert(a, e2) == 0, "SharedInsert should not return an error");
+  assert(SharedLookup(b, e2), "e2 should be visible through both handles");
+  assert(CreateSharedBloomFilter(path, 4096, 3) == NULL,
+         "Creating an existing filter should fail");
+  DetachSharedBloomFilter(a);
+  DetachSharedBloomFilter(b);
+  UnlinkSharedBloomFilter(path);
+
+  printf("TestSharedBloomFilter passed\n");
+}
+
+void TestSharedBloomFilterStale() {
+  char name[64];
+  snprintf(name, sizeof(name), "/hyperbloom-stale-%d", (int)getpid());
+
+  // Simulate a creator that died after sizing the segment but before
+  // publishing it.
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  assert(fd >= 0, "shm_open should not fail");
+  SharedBloomHeader pending = {.magic = SHARED_BLOOM_PENDING,
+                               .version = SHARED_BLOOM_VERSION,
+                               .size = 4096,
+                               .hf = 4};
+  assert(pwrite(fd, &pending, sizeof(pending), 0) == sizeof(pending),
+         "pwrite should not fail");
+  assert(ftruncate(fd, sizeof(SharedBloomHeader) + 4096 / 8) == 0,
+         "ftruncate should not fail");
+  close(fd);
+
+  errno = 0;
+  assert(AttachSharedBloomFilter(name) == NULL && errno == ESTALE,
+         "Attaching to a half created filter should fail with ESTALE");
+
+  SharedBloomFilter *sbf = OpenSharedBloomFilter(name, 4096, 4);
+  assert(sbf != NULL, "OpenSharedBloomFilter should recover a stale filter");
+  assert(sbf->size == 4096 && sbf->hf == 4, "Recovered filter parameters");
+  assert(SharedInsert(sbf, "turnips") == 0,
+         "SharedInsert should not return an error");
+  assert(SharedLookup(sbf, "turnips"), "turnips should exist in the filter");
+
+  DetachSharedBloomFilter(sbf);
+  UnlinkSharedBloomFilter(name);
+
+  // A file that isn't a filter is never taken for a stale one, whatever its
+  // size.
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-unrelated-%d", (int)getpid());
+  size_t lens[] = {0, 10, 4096};
+  char text[4096];
+  memset(text, 'x', sizeof(text));
+  for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL, "fopen should not fail");
+    fwrite(text, 1, lens[i], f);
+    fclose(f);
+
+    errno = 0;
+    assert(OpenSharedBloomFilter(path, 4096, 4) == NULL && errno == EINVAL,
+           "Opening a file that isn't a filter should fail with EINVAL");
+    struct stat st;
+    assert(stat(path, &st) == 0 && (size_t)st.st_size == lens[i],
+           "A file that isn't a filter should be left alone");
+  }
+  unlink(path);
+  printf("TestSharedBloomFilterStale passed\n");
+}
+
+void TestCrc32c() {
+  assert(Crc32c(0, "123456789", 9) == 0xE3069283u,
+         "Crc32c should match the check value");
+  assert(Crc32cSoftware(0, "123456789", 9) == 0xE3069283u,
+         "Crc32cSoftware should match the check value");
+
+  size_t n = 1 << 20;
+  uint8_t *buf = malloc(n);
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (uint8_t)(i * 2654435761u >> 11);
+  }
+  // Odd offsets and lengths exercise the unaligned head and tail.
+  assert(Crc32c(0, buf + 3, n - 10) == Crc32cSoftware(0, buf + 3, n - 10),
+         "Crc32c implementations should agree");
+  assert(Crc32c(Crc32c(0, buf, 1000), buf + 1000, 5000) ==
+             Crc32c(0, buf, 6000),
+         "Crc32c should be incremental");
+  free(buf);
+  printf("TestCrc32c passed\n");
+}
+
+/**
+ * A filter spanning four chunks, with a few entries in it.
+ */
+static BloomFilter *newChunkedTestFilter() {
+  BloomFilter *bf = NewBloomFilter(4ULL * 8 * CHUNKED_FILE_CHUNK_SIZE, 4);
+  assert(bf != NULL, "NewBloomFilter should not return NULL");
+  assert(Insert(bf, "b99afb65c9f97b2e0feea844eea55f69") == 0,
+         "Insert should not return an error");
+  assert(Insert(bf, "f530e3093a1617d64f400c5578005b7c") == 0,
+         "Insert should not return an error");
+  // Make sure every chunk has something in it.
+  for (uint64_t i = 0; i < bf->size / 64; i += 4096) {
+    bf->bv[i] |= i;
+  }
+  return bf;
+}
+
+void TestWriteLoad() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-io-%d.bf", (int)getpid());
+  BloomFilter *bf = newChunkedTestFilter();
+
+  assert(WriteParallel(bf, path, 3) == 0, "WriteParallel should not fail");
+  BloomFilter *loaded = LoadParallel(path, 4);
+  assert(loaded != NULL, "LoadParallel should not return NULL");
+  assert(loaded->size == bf->size && loaded->hf == bf->hf,
+         "Loaded filter parameters");
+  assert(memcmp(loaded->bv, bf->bv, bf->size / 8) == 0,
+         "Loaded bit vector should match");
+  assert(Lookup(loaded, "b99afb65c9f97b2e0feea844eea55f69"),
+         "e1 should exist in the loaded filter");
+  assert(!Lookup(loaded, "hahaidontexist"),
+         "fake1 should not exist in the loaded filter");
+  DestroyBloomFilter(loaded);
+
+  // Single threaded round trip through the default entry points.
+  assert(Write(bf, path) == 0, "Write should not fail");
+  loaded = Load(path);
+  assert(loaded != NULL && memcmp(loaded->bv, bf->bv, bf->size / 8) == 0,
+         "Load should read back what Write wrote");
+  DestroyBloomFilter(loaded);
+
+  // A write that fails leaves the previous file in place.
+  char tmp[96];
+  snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+  assert(access(tmp, F_OK) != 0, "No temporary file should be left behind");
+  assert(mkdir(tmp, 0755) == 0, "mkdir should not fail");
+  BloomFilter *other = NewBloomFilter(4096, 3);
+  assert(Write(other, path) != 0, "Write should fail if it can't write");
+  rmdir(tmp);
+  DestroyBloomFilter(other);
+  loaded = Load(path);
+  assert(loaded != NULL && loaded->size == bf->size,
+         "A failed write should keep the old file");
+  DestroyBloomFilter(loaded);
+
+  DestroyBloomFilter(bf);
+  unlink(path);
+  printf("TestWriteLoad passed\n");
+}
+
+void TestLoadCorrupt() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-io-%d.bf", (int)getpid());
+  BloomFilter *bf = newChunkedTestFilter();
+  assert(Write(bf, path) == 0, "Write should not fail");
+  DestroyBloomFilter(bf);
+
+  // Flip one bit in the second chunk.
+  FILE *f = fopen(path, "r+b");
+  ChunkedFileHeader hdr;
+  assert(fread(&hdr, sizeof(hdr), 1, f) == 1, "fread should not fail");
+  long off = (long)(hdr.data_offset + hdr.chunk_size + 12345);
+  uint8_t byte;
+  fseek(f, off, SEEK_SET);
+  assert(fread(&byte, 1, 1, f) == 1, "fread should not fail");
+  byte ^= 0x10;
+  fseek(f, off, SEEK_SET);
+  fwrite(&byte, 1, 1, f);
+  fclose(f);
+
+  BloomFileMeta meta;
+  ChunkedFile *cf = OpenChunkedFile(path, CHUNKED_KIND_BLOOM, &meta,
+                                    sizeof(meta));
+  assert(cf != NULL, "Header and chunk table are intact");
+  uint8_t *buf = malloc(cf->hdr.payload_len);
+  assert(ReadChunkedPayload(cf, buf, 2) == 1,
+         "Exactly one chunk should fail verification");
+  free(buf);
+  CloseChunkedFile(cf);
+
+  assert(Load(path) == NULL, "Load should refuse a corrupt file");
+  unlink(path);
+  printf("TestLoadCorrupt passed\n");
+}
+
+/**
+ * Header of a chunked file.
+ */
+static ChunkedFileHeader readChunkedHeader(const char *path) {
+  ChunkedFileHeader hdr;
+  FILE *f = fopen(path, "rb");
+  assert(f != NULL && fread(&hdr, sizeof(hdr), 1, f) == 1,
+         "Header should be readable");
+  fclose(f);
+  return hdr;
+}
+
+/**
+ * Overwrite the header of a chunked file with `hdr`, with a valid checksum
+ * over it and `meta`.
+ */
+static void writeChunkedHeader(const char *path, ChunkedFileHeader hdr,
+                               const BloomFileMeta *meta) {
+  hdr.header_crc = 0;
+  hdr.header_crc = Crc32c(Crc32c(0, &hdr, sizeof(hdr)), meta, sizeof(*meta));
+  FILE *f = fopen(path, "r+b");
+  assert(f != NULL && fwrite(&hdr, sizeof(hdr), 1, f) == 1,
+         "Header should be writable");
+  fclose(f);
+}
+
+void TestLoadCrafted() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-io-%d.bf", (int)getpid());
+  BloomFilter *bf = NewBloomFilter(4096, 3);
+  assert(Write(bf, path) == 0, "Write should not fail");
+  DestroyBloomFilter(bf);
+
+  BloomFileMeta meta = {.size = 4096, .hf = 3};
+  ChunkedFileHeader good = readChunkedHeader(path);
+
+  // A payload that runs past the end of the address space, from a data
+  // offset that still matches its (four) chunks.
+  ChunkedFileHeader hdr = good;
+  hdr.payload_len = UINT64_MAX - 100;
+  hdr.chunk_size = 1ULL << 62;
+  writeChunkedHeader(path, hdr, &meta);
+  assert(OpenChunkedFile(path, CHUNKED_KIND_BLOOM, &meta, sizeof(meta)) ==
+             NULL,
+         "Payloads past the end of the address space should be refused");
+
+  // So many chunks that the checksum table's size overflows.
+  hdr = good;
+  hdr.payload_len = 1ULL << 63;
+  hdr.chunk_size = 1;
+  writeChunkedHeader(path, hdr, &meta);
+  assert(OpenChunkedFile(path, CHUNKED_KIND_BLOOM, &meta, sizeof(meta)) ==
+             NULL,
+         "Checksum tables that overflow should be refused");
+
+  hdr = good;
+  hdr.chunk_size = 0;
+  writeChunkedHeader(path, hdr, &meta);
+  assert(OpenChunkedFile(path, CHUNKED_KIND_BLOOM, &meta, sizeof(meta)) ==
+             NULL,
+         "Empty chunks should be refused");
+
+  // The untouched header still opens.
+  writeChunkedHeader(path, good, &meta);
+  ChunkedFile *cf =
+      OpenChunkedFile(path, CHUNKED_KIND_BLOOM, &meta, sizeof(meta));
+  assert(cf != NULL, "A valid header should open");
+  CloseChunkedFile(cf);
+
+  unlink(path);
+  printf("TestLoadCrafted passed\n");
+}
+
+void TestLoadLegacy() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-io-%d.bf", (int)getpid());
+  // Before double hashing every hash function probed the entry hash itself,
+  // so a legacy filter with 3 hash functions set one bit per entry: the bit a
+  // single function sets now.
+  BloomFilter *bf = NewBloomFilter(4096, 1);
+  assert(Insert(bf, "lavacakes") == 0, "Insert should not return an error");
+  int hf = 3;
+
+  // The layout Write produced before chunking.
+  FILE *f = fopen(path, "wb");
+  fwrite(&bf->size, sizeof(uint64_t), 1, f);
+  fwrite(&hf, sizeof(int), 1, f);
+  fwrite(bf->bv, sizeof(uint64_t), bf->size / 64, f);
+  fclose(f);
+
+  BloomFilter *loaded = Load(path);
+  assert(loaded != NULL, "Load should read legacy files");
+  assert(loaded->size == 4096 && loaded->hf == 1,
+         "Legacy filters should load with a single hash function");
+  assert(Lookup(loaded, "lavacakes"), "lavacakes should exist in the filter");
+  DestroyBloomFilter(loaded);
+  DestroyBloomFilter(bf);
+  unlink(path);
+  printf("TestLoadLegacy passed\n");
+}
+
+/**
+ * False positive rate of a filter with the given fill ratio, whose entries
+ * set `hf` distinct bits each.
+ */
+static double estimatedFpr(double fill, int hf) {
+  double fpr = 1.0;
+  for (int i = 0; i < hf; i++) {
+    fpr *= fill;
+  }
+  return fpr;
+}
+
+/**
+ * Reference fold: OR every `size / factor` bit slice of `bv` together.
+ */
+static uint64_t *foldReference(const uint64_t *bv, uint64_t size,
+                               uint64_t factor) {
+  uint64_t words = size / factor / 64;
+  uint64_t *out = calloc(words, sizeof(uint64_t));
+  for (uint64_t i = 0; i < size / 64; i++) {
+    out[i % words] |= bv[i];
+  }
+  return out;
+}
+
+void TestFold() {
+  BloomFilter *bf = NewBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewBloomFilter should not return NULL");
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    Insert(bf, key);
+  }
+
+  assert(FoldBloomFilter(bf, 3) != 0, "Fold factor must be a power of 2");
+  assert(FoldBloomFilter(bf, 1ULL << 20) != 0,
+         "Folding below 64 bits should fail");
+
+  // 1000 keys of 4 bits in 2^20 bits: folding by 8 keeps the false positive
+  // rate under 2e-6 (about 8e-7), folding by 16 doesn't (about 1e-5).
+  uint64_t factor = BloomFoldFactor(bf, 2e-6);
+  assert(factor == 8, "Fold factor for a 2e-6 target should be 8");
+
+  uint64_t *want = foldReference(bf->bv, bf->size, factor);
+  uint64_t *bv = bf->bv;
+  assert(FoldBloomFilter(bf, factor) == 0, "FoldBloomFilter should not fail");
+  assert(bf->size == 131072, "Folded filter should be 2^17 bits");
+  assert(bf->bv == bv, "Folding should not move the bit vector");
+  assert(memcmp(bf->bv, want, bf->size / 8) == 0,
+         "Folded bits should be the OR of every slice");
+  assert(estimatedFpr(BloomFillRatio(bf), bf->hf) <= 2e-6,
+         "Folded filter should meet the target");
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(Lookup(bf, key), "Keys should survive folding");
+  }
+  free(want);
+
+  // A smaller filter only merges once this one is folded to its size.
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-fold-%d.bf", (int)getpid());
+  BloomFilter *small = NewBloomFilter(65536, 4);
+  Insert(small, "small-key");
+  assert(Write(small, path) == 0, "Write should not fail");
+  assert(MergeBloomFilter(bf, path) != 0,
+         "Merging a smaller filter should not fold this one");
+  assert(bf->size == 131072, "A refused merge should keep the size");
+  assert(FoldBloomFilter(bf, 2) == 0, "FoldBloomFilter should not fail");
+  assert(MergeBloomFilter(bf, path) == 0,
+         "Merging a filter of the same size should not fail");
+  assert(Lookup(bf, "small-key") && Lookup(bf, "key-1"),
+         "Merged filter should have both filters' keys");
+
+  BloomFilter *large = NewBloomFilter(1048576, 4);
+  Insert(large, "large-key");
+  assert(Write(large, path) == 0, "Write should not fail");
+  assert(MergeBloomFilter(small, path) == 0,
+         "Merging a larger filter should fold it");
+  assert(small->size == 65536, "Smaller filter should keep its size");
+  assert(Lookup(small, "large-key") && Lookup(small, "small-key"),
+         "Merged filter should have both filters' keys");
+
+  unlink(path);
+  DestroyBloomFilter(large);
+  DestroyBloomFilter(small);
+  DestroyBloomFilter(bf);
+  printf("TestFold passed\n");
+}
+
+void TestLoadFolded() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-lf-%d.bf", (int)getpid());
+  BloomFilter *bf = newChunkedTestFilter();
+  assert(Write(bf, path) == 0, "Write should not fail");
+
+  // Folding by 8 makes the bit vector smaller than a chunk, so chunks wrap
+  // around it.
+  uint64_t *want = foldReference(bf->bv, bf->size, 8);
+  BloomFilter *loaded = LoadFolded(path, 8, 0);
+  assert(loaded != NULL, "LoadFolded should not return NULL");
+  assert(loaded->size == bf->size / 8 && loaded->hf == bf->hf,
+         "Folded filter parameters");
+  assert(memcmp(loaded->bv, want, loaded->size / 8) == 0,
+         "Streamed fold should match folding in memory");
+  assert(Lookup(loaded, "b99afb65c9f97b2e0feea844eea55f69"),
+         "e1 should exist in the folded filter");
+  DestroyBloomFilter(loaded);
+  free(want);
+
+  assert(LoadFolded(path, 6, 0) == NULL, "Fold factor must be a power of 2");
+
+  // Automatic factor: the filter is nearly empty, so it folds a long way.
+  loaded = LoadFolded(path, 0, 0.01);
+  assert(loaded != NULL, "LoadFolded should not return NULL");
+  assert(loaded->size < bf->size, "Nearly empty filter should fold");
+  assert(estimatedFpr(BloomFillRatio(loaded), loaded->hf) <= 0.01,
+         "Folded filter should meet the target");
+  assert(Lookup(loaded, "f530e3093a1617d64f400c5578005b7c"),
+         "e2 should exist in the folded filter");
+  DestroyBloomFilter(loaded);
+
+  unlink(path);
+  DestroyBloomFilter(bf);
+  printf("TestLoadFolded passed\n");
+}
+
+void TestLookupAsync() {
+  // Hash counts that fill, split and overrun the gather vectors.
+  int hfs[] = {1, 3, 4, 8, 9, 17, 70};
+  char key[32];
+
+  for (size_t h = 0; h < sizeof(hfs) / sizeof(hfs[0]); h++) {
+    BloomFilter *bf = NewBloomFilter(4096, hfs[h]);
+    assert(bf != NULL, "NewBloomFilter should not return NULL");
+    for (int i = 0; i < 300; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      if (i % 2 == 0) {
+        assert(Insert(bf, key) == 0, "Insert should not fail");
+      } else {
+        assert(InsertAsync(bf, key) == 0,
+               "InsertAsync should not fail");
+      }
+    }
+
+    for (int i = 0; i < 300; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      assert(LookupAsync(bf, key), "Inserted key should be found");
+    }
+    // Unlocked lookups answer exactly like the locked ones.
+    for (int i = 300; i < 3000; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      assert(LookupAsync(bf, key) == Lookup(bf, key),
+             "LookupAsync should agree with Lookup");
+    }
+    DestroyBloomFilter(bf);
+  }
+
+  printf("TestLookupAsync passed\n");
+}
+
+typedef struct SchedulerResult {
+  LookupScheduler *s;
+  bool *found;
+  int *calls;
+  int resubmit; // Submit the key with this index from the callback, or -1
+  char *key;
+} SchedulerResult;
+
+static void onLookup(void *ctx, bool found) {
+  SchedulerResult *r = ctx;
+  *r->found = found;
+  (*r->calls)++;
+  if (r->resubmit >= 0) {
+    // Callbacks may submit more lookups.
+    SubmitLookup(r->s, r->key, onLookup, r + 1);
+    r->resubmit = -1;
+  }
+}
+
+typedef struct PassResult {
+  const int *pass; // PollLookups passes so far
+  int done_at;     // Pass the lookup finished in
+  bool found;
+} PassResult;
+
+static void onPass(void *ctx, bool found) {
+  PassResult *r = ctx;
+  r->done_at = *r->pass;
+  r->found = found;
+}
+
+void TestLookupScheduler() {
+  enum { N = 2000 };
+  BloomFilter *bf = NewBloomFilter(1 << 20, 4);
+  char (*keys)[32] = malloc(N * sizeof(*keys));
+  bool *found = malloc(N * sizeof(bool));
+  SchedulerResult *results = calloc(N + 1, sizeof(SchedulerResult));
+  for (int i = 0; i < N; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "key-%d", i);
+    if (i % 2 == 0) {
+      Insert(bf, keys[i]);
+    }
+  }
+
+  int inflight[] = {1, 7, 64, 200};
+  for (size_t t = 0; t < sizeof(inflight) / sizeof(inflight[0]); t++) {
+    LookupScheduler *s = NewLookupScheduler(bf, inflight[t]);
+    assert(s != NULL, "NewLookupScheduler should not return NULL");
+    int calls = 0;
+    for (int i = 0; i < N; i++) {
+      results[i] = (SchedulerResult){s, &found[i], &calls, -1, NULL};
+      assert(SubmitLookup(s, keys[i], onLookup, &results[i]) == 0,
+             "SubmitLookup should not fail");
+      assert(s->active <= inflight[t], "Slots should not be overcommitted");
+    }
+    DrainLookups(s);
+    assert(s->active == 0, "DrainLookups should finish every lookup");
+    assert(calls == N, "Every lookup should call back exactly once");
+    for (int i = 0; i < N; i++) {
+      assert(found[i] == Lookup(bf, keys[i]),
+             "Scheduled lookups should agree with Lookup");
+    }
+    DestroyLookupScheduler(s);
+  }
+
+  // Resubmitting from a callback, with every slot busy.
+  LookupScheduler *s = NewLookupScheduler(bf, 2);
+  int calls = 0;
+  results[0] = (SchedulerResult){s, &found[0], &calls, 0, keys[0]};
+  results[1] = (SchedulerResult){s, &found[1], &calls, -1, NULL};
+  results[2] = (SchedulerResult){s, &found[2], &calls, -1, NULL};
+  found[1] = false;
+  SubmitLookup(s, keys[1], onLookup, &results[0]);
+  SubmitLookup(s, keys[3], onLookup, &results[2]);
+  DrainLookups(s);
+  assert(calls == 3, "Lookups submitted from callbacks should finish");
+  assert(found[1], "Resubmitted key should be found");
+  DestroyLookupScheduler(s);
+
+  // With 8 hash functions on 2^24 bits, an entry's probes land on different
+  // cache lines, so a lookup that gets past its first probe has to yield and
+  // finish in a later pass. Every slot is submitted before polling starts.
+  enum { HF = 8, M = 512 };
+  BloomFilter *large = NewBloomFilter(1 << 24, HF);
+  assert(large != NULL, "NewBloomFilter should not return NULL");
+  for (int i = 0; i < M; i += 2) {
+    Insert(large, keys[i]);
+  }
+  s = NewLookupScheduler(large, M);
+  assert(s != NULL, "NewLookupScheduler should not return NULL");
+  int pass = 0;
+  PassResult *passes = calloc(M, sizeof(PassResult));
+  for (int i = 0; i < M; i++) {
+    passes[i] = (PassResult){&pass, 0, false};
+    SubmitLookup(s, keys[i], onPass, &passes[i]);
+  }
+  while (s->active > 0) {
+    pass++;
+    PollLookups(s);
+  }
+  int multi = 0;
+  for (int i = 0; i < M; i++) {
+    assert(passes[i].found == Lookup(large, keys[i]),
+           "Multi-pass lookups should agree with Lookup");
+    assert(passes[i].done_at >= 1 && passes[i].done_at <= HF,
+           "A lookup should take at most one pass per probe");
+    multi += passes[i].done_at > 1;
+  }
+  printf("Lookups needing more than one pass: %d of %d\n", multi, M);
+  assert(multi >= M / 2, "Inserted keys should need more than one pass");
+  free(passes);
+  DestroyLookupScheduler(s);
+  DestroyBloomFilter(large);
+
+  free(results);
+  free(found);
+  free(keys);
+  DestroyBloomFilter(bf);
+  printf("TestLookupScheduler passed\n");
+}
@@ -0,0 +1,512 @@
+#include "chunkio.h"
+#include "bitvec.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * CRC32C. The SSE4.2 kernel is picked once at runtime; the table is the
+ * fallback for CPUs without it.
+ */
+static uint32_t crc32cTable[256];
+static uint32_t (*crc32cImpl)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32cSoft(uint32_t crc, const uint8_t *p, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc = crc32cTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32cHW(uint32_t crc, const uint8_t *p, size_t len) {
+  uint64_t c = ~crc & 0xFFFFFFFFu;
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+  }
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+  }
+  for (; len > 0; len--) {
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+  }
+  return ~(uint32_t)c;
+}
+
+static void crc32cInit(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+    }
+    crc32cTable[i] = c;
+  }
+
+  __builtin_cpu_init();
+  crc32cImpl = __builtin_cpu_supports("sse4.2") ? crc32cHW : crc32cSoft;
+}
+
+uint32_t Crc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32cOnce, crc32cInit);
+  return crc32cImpl(crc, buf, len);
+}
+
+uint32_t Crc32cSoftware(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32cOnce, crc32cInit);
+  return crc32cSoft(crc, buf, len);
+}
+
+static uint64_t chunkCount(uint64_t len, uint64_t chunk_size) {
+  return len / chunk_size + (len % chunk_size != 0);
+}
+
+/**
+ * Offset of the payload in a file with `meta_len` bytes of metadata and
+ * `nchunks` chunks. Returns -1 if it doesn't fit in 64 bits, which only a
+ * crafted header can cause.
+ */
+static int dataOffset(size_t meta_len, uint64_t nchunks, uint64_t *out) {
+  uint64_t table, end;
+  if (__builtin_mul_overflow(nchunks, sizeof(uint32_t), &table) ||
+      __builtin_add_overflow(sizeof(ChunkedFileHeader) + meta_len, table,
+                             &end) ||
+      __builtin_add_overflow(end, CHUNKED_FILE_ALIGN - 1, &end)) {
+    return -1;
+  }
+  *out = end & ~(uint64_t)(CHUNKED_FILE_ALIGN - 1);
+  return 0;
+}
+
+static int pickThreads(int threads, uint64_t nchunks) {
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((uint64_t)threads > nchunks) {
+    threads = (int)nchunks;
+  }
+  return threads < 1 ? 1 : threads;
+}
+
+static uint32_t headerCrc(const ChunkedFileHeader *hdr, const void *meta,
+                          size_t meta_len) {
+  ChunkedFileHeader tmp = *hdr;
+  tmp.header_crc = 0;
+  return Crc32c(Crc32c(0, &tmp, sizeof(tmp)), meta, meta_len);
+}
+
+/**
+ * Shared state for a parallel chunk transfer. Threads claim chunks from
+ * `next` until all are done.
+ */
+typedef struct ChunkJob {
+  int fd;
+  uint8_t *buf;
+  uint64_t len;
+  uint64_t chunk_size;
+  uint64_t nchunks;
+  uint64_t data_offset;
+  uint32_t *crcs;
+  const char *filename;
+  uint64_t fold_len;         // Folded reads: length of `buf`
+  pthread_mutex_t fold_lock; // Folded reads: serializes OR-ing into `buf`
+  uint64_t next;             // Next chunk to claim, updated atomically
+  int64_t corrupt;           // Chunks that failed verification, atomically
+  int failed;                // Set on any I/O error
+} ChunkJob;
+
+static int pwriteFull(int fd, const uint8_t *p, size_t n, off_t off) {
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, off);
+    if (w < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += w;
+    n -= (size_t)w;
+    off += w;
+  }
+  return 0;
+}
+
+static int preadFull(int fd, uint8_t *p, size_t n, off_t off) {
+  while (n > 0) {
+    ssize_t r = pread(fd, p, n, off);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO; // Truncated file
+      return -1;
+    }
+    p += r;
+    n -= (size_t)r;
+    off += r;
+  }
+  return 0;
+}
+
+static void *writeChunks(void *arg) {
+  ChunkJob *job = arg;
+  for (;;) {
+    uint64_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->nchunks || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+    uint64_t off = i * job->chunk_size;
+    uint64_t n = job->len - off < job->chunk_size ? job->len - off
+                                                  : job->chunk_size;
+    job->crcs[i] = Crc32c(0, job->buf + off, n);
+    if (pwriteFull(job->fd, job->buf + off, n,
+                   (off_t)(job->data_offset + off)) != 0) {
+      perror("Failed to write chunk");
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void *readChunks(void *arg) {
+  ChunkJob *job = arg;
+  for (;;) {
+    uint64_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->nchunks || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+    uint64_t off = i * job->chunk_size;
+    uint64_t n = job->len - off < job->chunk_size ? job->len - off
+                                                  : job->chunk_size;
+    if (preadFull(job->fd, job->buf + off, n,
+                  (off_t)(job->data_offset + off)) != 0) {
+      perror("Failed to read chunk");
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (Crc32c(0, job->buf + off, n) != job->crcs[i]) {
+      fprintf(stderr,
+              "%s: checksum mismatch in chunk %llu (bytes %llu-%llu)\n",
+              job->filename, (unsigned long long)i, (unsigned long long)off,
+              (unsigned long long)(off + n - 1));
+      __atomic_fetch_add(&job->corrupt, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void *readFoldedChunks(void *arg) {
+  ChunkJob *job = arg;
+  uint8_t *scratch =
+      malloc(job->chunk_size < job->len ? job->chunk_size : job->len);
+  if (scratch == NULL) {
+    perror("Failed to allocate chunk buffer");
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  for (;;) {
+    uint64_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->nchunks || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+      break;
+    }
+    uint64_t off = i * job->chunk_size;
+    uint64_t n = job->len - off < job->chunk_size ? job->len - off
+                                                  : job->chunk_size;
+    if (preadFull(job->fd, scratch, n, (off_t)(job->data_offset + off)) != 0) {
+      perror("Failed to read chunk");
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (Crc32c(0, scratch, n) != job->crcs[i]) {
+      fprintf(stderr,
+              "%s: checksum mismatch in chunk %llu (bytes %llu-%llu)\n",
+              job->filename, (unsigned long long)i, (unsigned long long)off,
+              (unsigned long long)(off + n - 1));
+      __atomic_fetch_add(&job->corrupt, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    // A chunk may be larger than the folded buffer, or straddle its end.
+    pthread_mutex_lock(&job->fold_lock);
+    for (uint64_t done = 0; done < n;) {
+      uint64_t dst = (off + done) % job->fold_len;
+      uint64_t run = job->fold_len - dst < n - done ? job->fold_len - dst
+                                                     : n - done;
+      orVector(job->buf + dst, scratch + done, run);
+      done += run;
+    }
+    pthread_mutex_unlock(&job->fold_lock);
+  }
+
+  free(scratch);
+  return NULL;
+}
+
+/**
+ * Run `fn` over every chunk of `job` with `threads` threads (the calling
+ * thread is one of them).
+ */
+static void runChunkJob(ChunkJob *job, int threads, void *(*fn)(void *)) {
+  pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+  int started = 0;
+  if (tids != NULL) {
+    for (; started < threads - 1; started++) {
+      if (pthread_create(&tids[started], NULL, fn, job) != 0) {
+        break; // Fewer threads is still correct, just slower
+      }
+    }
+  }
+  fn(job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+}
+
+/**
+ * fsync the directory holding `filename`, so a rename into it is durable.
+ */
+static int syncParentDir(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  char *dir;
+  if (slash == NULL) {
+    dir = strdup(".");
+  } else if (slash == filename) {
+    dir = strdup("/");
+  } else {
+    dir = strndup(filename, (size_t)(slash - filename));
+  }
+  if (dir == NULL) {
+    return -1;
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  free(dir);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+int WriteChunkedFile(const char *filename, uint32_t kind, const void *meta,
+                     size_t meta_len, const void *payload, uint64_t len,
+                     uint64_t chunk_size, int threads) {
+  if (chunk_size == 0) {
+    chunk_size = CHUNKED_FILE_CHUNK_SIZE;
+  }
+  uint64_t nchunks = chunkCount(len, chunk_size);
+
+  ChunkedFileHeader hdr = {.magic = CHUNKED_FILE_MAGIC,
+                           .version = CHUNKED_FILE_VERSION,
+                           .kind = kind,
+                           .meta_len = meta_len,
+                           .payload_len = len,
+                           .chunk_size = chunk_size};
+  if (dataOffset(meta_len, nchunks, &hdr.data_offset) != 0) {
+    fprintf(stderr, "%s: too many chunks\n", filename);
+    return -1;
+  }
+
+  uint32_t *crcs = calloc(nchunks ? nchunks : 1, sizeof(uint32_t));
+  if (crcs == NULL) {
+    perror("Failed to allocate checksum table.");
+    return -1;
+  }
+
+  // Write next to the target and rename over it once everything is on disk,
+  // so a crash or a full disk part way through leaves the old file intact.
+  size_t tmp_len = strlen(filename) + 32;
+  char *tmp = malloc(tmp_len);
+  if (tmp == NULL) {
+    perror("Failed to allocate file name.");
+    free(crcs);
+    return -1;
+  }
+  snprintf(tmp, tmp_len, "%s.tmp.%d", filename, (int)getpid());
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("Failed to open file for writing");
+    free(tmp);
+    free(crcs);
+    return -1;
+  }
+
+  ChunkJob job = {.fd = fd,
+                  .buf = (uint8_t *)payload,
+                  .len = len,
+                  .chunk_size = chunk_size,
+                  .nchunks = nchunks,
+                  .data_offset = hdr.data_offset,
+                  .crcs = crcs,
+                  .filename = filename};
+  runChunkJob(&job, pickThreads(threads, nchunks), writeChunks);
+
+  // The header goes last, so a write that dies half way leaves a file that
+  // fails verification rather than one that looks complete.
+  hdr.table_crc = Crc32c(0, crcs, nchunks * sizeof(uint32_t));
+  hdr.header_crc = headerCrc(&hdr, meta, meta_len);
+  int rc = job.failed ? -1 : 0;
+  if (rc == 0 &&
+      (pwriteFull(fd, (const uint8_t *)crcs, nchunks * sizeof(uint32_t),
+                  (off_t)(sizeof(hdr) + meta_len)) != 0 ||
+       pwriteFull(fd, meta, meta_len, sizeof(hdr)) != 0 ||
+       pwriteFull(fd, (const uint8_t *)&hdr, sizeof(hdr), 0) != 0)) {
+    perror("Failed to write file header");
+    rc = -1;
+  }
+
+  if (rc == 0 && fsync(fd) != 0) {
+    perror("Failed to sync file");
+    rc = -1;
+  }
+  if (close(fd) != 0 && rc == 0) {
+    perror("Failed to close file");
+    rc = -1;
+  }
+  if (rc == 0 && rename(tmp, filename) != 0) {
+    perror("Failed to replace file");
+    rc = -1;
+  }
+  if (rc != 0) {
+    unlink(tmp);
+  } else if (syncParentDir(filename) != 0) {
+    perror("Failed to sync directory");
+    rc = -1;
+  }
+  free(tmp);
+  free(crcs);
+  return rc;
+}
+
+ChunkedFile *OpenChunkedFile(const char *filename, uint32_t kind, void *meta,
+                             size_t meta_len) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("Failed to open file for reading");
+    return NULL;
+  }
+
+  ChunkedFileHeader hdr;
+  if (preadFull(fd, (uint8_t *)&hdr, sizeof(hdr), 0) != 0 ||
+      hdr.magic != CHUNKED_FILE_MAGIC) {
+    close(fd);
+    errno = EILSEQ; // Not a chunked file; the caller may try another format
+    return NULL;
+  }
+
+  struct stat st;
+  if (hdr.version != CHUNKED_FILE_VERSION ||
+      (kind != CHUNKED_KIND_ANY && hdr.kind != kind) ||
+      hdr.meta_len != meta_len || hdr.chunk_size == 0) {
+    fprintf(stderr, "%s: unsupported file (version %u, kind %u)\n", filename,
+            hdr.version, hdr.kind);
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  if (preadFull(fd, meta, meta_len, sizeof(hdr)) != 0 ||
+      headerCrc(&hdr, meta, meta_len) != hdr.header_crc) {
+    fprintf(stderr, "%s: corrupt file header\n", filename);
+    close(fd);
+    errno = EBADMSG;
+    return NULL;
+  }
+  // Every size below comes from the file, so check the arithmetic before
+  // trusting it against the file's length.
+  uint64_t nchunks = chunkCount(hdr.payload_len, hdr.chunk_size);
+  uint64_t offset, end;
+  if (dataOffset(meta_len, nchunks, &offset) != 0 ||
+      hdr.data_offset != offset ||
+      __builtin_add_overflow(hdr.data_offset, hdr.payload_len, &end) ||
+      fstat(fd, &st) != 0 || (uint64_t)st.st_size < end) {
+    fprintf(stderr, "%s: truncated file\n", filename);
+    close(fd);
+    errno = EBADMSG;
+    return NULL;
+  }
+
+  ChunkedFile *cf = calloc(1, sizeof(ChunkedFile));
+  uint32_t *crcs = malloc((nchunks ? nchunks : 1) * sizeof(uint32_t));
+  if (cf == NULL || crcs == NULL) {
+    perror("Failed to allocate checksum table.");
+    free(cf);
+    free(crcs);
+    close(fd);
+    return NULL;
+  }
+  if (preadFull(fd, (uint8_t *)crcs, nchunks * sizeof(uint32_t),
+                (off_t)(sizeof(hdr) + meta_len)) != 0 ||
+      Crc32c(0, crcs, nchunks * sizeof(uint32_t)) != hdr.table_crc) {
+    fprintf(stderr, "%s: corrupt chunk table\n", filename);
+    free(cf);
+    free(crcs);
+    close(fd);
+    errno = EBADMSG;
+    return NULL;
+  }
+
+  cf->fd = fd;
+  cf->filename = filename;
+  cf->hdr = hdr;
+  cf->crcs = crcs;
+  cf->nchunks = nchunks;
+  return cf;
+}
+
+int64_t ReadChunkedPayload(ChunkedFile *cf, void *buf, int threads) {
+  ChunkJob job = {.fd = cf->fd,
+                  .buf = buf,
+                  .len = cf->hdr.payload_len,
+                  .chunk_size = cf->hdr.chunk_size,
+                  .nchunks = cf->nchunks,
+                  .data_offset = cf->hdr.data_offset,
+                  .crcs = cf->crcs,
+                  .filename = cf->filename};
+  runChunkJob(&job, pickThreads(threads, cf->nchunks), readChunks);
+  return job.failed ? -1 : job.corrupt;
+}
+
+int64_t ReadChunkedPayloadFolded(ChunkedFile *cf, void *buf, uint64_t len,
+                                 int threads) {
+  if (len == 0 || cf->hdr.payload_len % len != 0) {
+    fprintf(stderr, "%s: can't fold %llu bytes to %llu\n", cf->filename,
+            (unsigned long long)cf->hdr.payload_len, (unsigned long long)len);
+    return -1;
+  }
+
+  ChunkJob job = {.fd = cf->fd,
+                  .buf = buf,
+                  .len = cf->hdr.payload_len,
+                  .chunk_size = cf->hdr.chunk_size,
+                  .nchunks = cf->nchunks,
+                  .data_offset = cf->hdr.data_offset,
+                  .crcs = cf->crcs,
+                  .filename = cf->filename,
+                  .fold_len = len};
+  memset(buf, 0, len);
+  pthread_mutex_init(&job.fold_lock, NULL);
+  runChunkJob(&job, pickThreads(threads, cf->nchunks), readFoldedChunks);
+  pthread_mutex_destroy(&job.fold_lock);
+  return job.failed ? -1 : job.corrupt;
+}
+
+void CloseChunkedFile(ChunkedFile *cf) {
+  if (cf) {
+    close(cf->fd);
+    free(cf->crcs);
+    free(cf);
+  }
+}
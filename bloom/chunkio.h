@@ -0,0 +1,132 @@
+#ifndef CHUNKIO_H
+#define CHUNKIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * Chunked, checksummed filter files.
+ *
+ * A filter's payload (its bit or byte vector) is split into fixed size chunks,
+ * each protected by its own CRC32C. Chunks are written and read with
+ * pwrite/pread from several threads at once, and each reader thread verifies a
+ * chunk as soon as it has read it while the other threads keep the device
+ * busy, so verification overlaps with I/O. A flipped bit on disk is reported
+ * with the chunk (and byte range) it landed in instead of silently corrupting
+ * lookups.
+ *
+ * File layout:
+ *
+ *   ChunkedFileHeader | metadata | u32 CRC32C per chunk | padding | payload
+ *
+ * The payload starts on a CHUNKED_FILE_ALIGN boundary. The header checksum
+ * covers the header and the metadata, and the header stores the checksum of
+ * the chunk table.
+ */
+
+#define CHUNKED_FILE_MAGIC 0x314B4E5548434248ULL // "HBCHUNK1"
+#define CHUNKED_FILE_VERSION 1
+#define CHUNKED_FILE_ALIGN 4096
+
+/**
+ * Default bytes per checksummed chunk.
+ */
+#define CHUNKED_FILE_CHUNK_SIZE (4u << 20)
+
+/**
+ * What a chunked file holds. Loaders refuse files of the wrong kind.
+ */
+#define CHUNKED_KIND_ANY 0       // OpenChunkedFile only: accept any kind
+#define CHUNKED_KIND_BLOOM 1     // bloom/bloom.h BloomFilter bit vector
+#define CHUNKED_KIND_NAIVE 2     // naive-bloom/naive.h NaiveBloomFilter bytes
+#define CHUNKED_KIND_BLOCKED 3   // blocked-bloom/blocked.h cache line blocks
+#define CHUNKED_KIND_COUNT_MIN 4 // count-min/cms.h CountMinSketch counters
+
+/**
+ * Metadata stored with every filter file.
+ */
+typedef struct BloomFileMeta {
+  uint64_t size; // Size of the filter in bits
+  uint64_t hf;   // Number of hash functions
+} BloomFileMeta;
+
+typedef struct ChunkedFileHeader {
+  uint64_t magic;       // CHUNKED_FILE_MAGIC
+  uint32_t version;     // CHUNKED_FILE_VERSION
+  uint32_t kind;        // CHUNKED_KIND_*
+  uint64_t meta_len;    // Bytes of metadata following the header
+  uint64_t payload_len; // Bytes of payload
+  uint64_t chunk_size;  // Bytes per checksummed chunk
+  uint64_t data_offset; // Offset of the payload in the file
+  uint32_t table_crc;   // CRC32C of the chunk checksum table
+  uint32_t header_crc;  // CRC32C of header and metadata, with this field 0
+} ChunkedFileHeader;
+
+/**
+ * An open chunked file whose header, metadata and checksum table have been
+ * read and verified, ready for its payload to be read.
+ */
+typedef struct ChunkedFile {
+  int fd;
+  const char *filename;
+  ChunkedFileHeader hdr;
+  uint32_t *crcs; // One per chunk
+  uint64_t nchunks;
+} ChunkedFile;
+
+/**
+ * CRC32C (Castagnoli) of `len` bytes, continuing from `crc` (0 to start).
+ * Uses the SSE4.2 crc32 instruction when the CPU has it.
+ */
+uint32_t Crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Table-driven CRC32C, always available. Exposed for testing.
+ */
+uint32_t Crc32cSoftware(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Write `payload` to `filename` in the chunked layout, `threads` chunks at a
+ * time (0 picks one thread per online CPU, capped by the number of chunks).
+ * `meta` is stored verbatim after the header. The file is written as
+ * `filename`.tmp.<pid>, synced and renamed over `filename`, so an existing
+ * file is only ever replaced by a complete one.
+ */
+int WriteChunkedFile(const char *filename, uint32_t kind, const void *meta,
+                     size_t meta_len, const void *payload, uint64_t len,
+                     uint64_t chunk_size, int threads);
+
+/**
+ * Open a chunked file of the given kind (or of any kind, with
+ * CHUNKED_KIND_ANY; the caller then checks cf->hdr.kind) and read its
+ * metadata into `meta`, which must be exactly `meta_len` bytes. Fails with
+ * errno set to EILSEQ, without printing, if the file isn't a chunked file at
+ * all, so callers can fall back to an older format.
+ */
+ChunkedFile *OpenChunkedFile(const char *filename, uint32_t kind, void *meta,
+                             size_t meta_len);
+
+/**
+ * Read and verify the payload into `buf` (cf->hdr.payload_len bytes) with
+ * `threads` threads. Returns the number of chunks that failed verification
+ * (each is reported on stderr), or -1 on an I/O error.
+ */
+int64_t ReadChunkedPayload(ChunkedFile *cf, void *buf, int threads);
+
+/**
+ * Like ReadChunkedPayload, but folds the payload down to `len` bytes as it is
+ * read: each chunk is read into a scratch buffer, verified, and OR-ed into
+ * `buf` at its offset modulo `len`. `len` must divide payload_len. The full
+ * payload is never held in memory.
+ */
+int64_t ReadChunkedPayloadFolded(ChunkedFile *cf, void *buf, uint64_t len,
+                                 int threads);
+
+/**
+ * Close a chunked file opened with OpenChunkedFile.
+ */
+void CloseChunkedFile(ChunkedFile *cf);
+
+#endif // CHUNKIO_H
@@ -1,32 +1,340 @@
+#ifndef HASHING_H
+#define HASHING_H
+
 #include "xxhash.h"
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define HB_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HB_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HB_PRIME64_3 0x165667B19E3779F9ULL
+#define HB_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define HB_PRIME64_5 0x27D4EB2F165667C5ULL
+
+/**
+ * Expand a single 64 bit entry hash into the `n` per-function hashes used to
+ * pick filter positions, by double hashing: hash i is h + i * h2, where h2 is
+ * a remix of h forced odd so that an entry's positions modulo a power of 2 are
+ * all distinct. The first hash is the entry hash itself, and since positions
+ * are taken modulo the power of 2 filter size, folding a filter keeps every
+ * entry's positions. Batch paths that hash keys up front go through this too,
+ * so they set and test exactly the same positions as Insert and Lookup.
+ */
+static inline void expandHash(uint64_t h, int n, uint64_t *out) {
+  uint64_t h2 = (((h << 32) | (h >> 32)) * HB_PRIME64_2) | 1;
+  for (int i = 0; i < n; i++) {
+    out[i] = h + (uint64_t)i * h2;
+  }
+}
+
+/**
+ * `hf` for a bit or byte filter saved in the unchunked layout, from before
+ * double hashing, whose hash functions all probed the entry hash itself: a
+ * single function probes exactly that position.
+ */
+static inline int singleHashHf(int hf) { return hf < 1 ? hf : 1; }
+
 /**
  * Hash an entry "n" number of times with a 64 bit hash
  */
-uint64_t *hashEntry(const uint8_t *entry, size_t entry_len, int n) {
+static inline uint64_t *hashEntry(const uint8_t *entry, size_t entry_len,
+                                  int n) {
   uint64_t *out = malloc(n * sizeof(uint64_t));
   if (out == NULL) {
     perror("Failed to allocate memory for output array.");
     return NULL;
   }
 
-  uint8_t *cpy = malloc(entry_len);
-  if (cpy == NULL) {
-    free(out);
-    return NULL;
+  expandHash(XXH64(entry, entry_len, 0), n, out); // 0 is kept as the seed
+  return out;
+}
+
+/**
+ * Fixed-width key hashing.
+ *
+ * Most keys we see are fixed width (UUIDs, hex digests), so the batch paths
+ * hash whole runs of keys at once. The kernels below compute exactly
+ * XXH64(key, width, 0) for every key, one key per SIMD lane, which keeps them
+ * interchangeable with hashEntry. Widths of 8, 16, 32 and 64 bytes get
+ * vectorized kernels; any other width falls back to scalar XXH64.
+ *
+ * `keys` holds `n` keys laid out back to back, `width` bytes each.
+ */
+typedef void (*hashFixedFn)(const uint8_t *keys, size_t width, size_t n,
+                            uint64_t *out);
+
+static inline int hashFixedVectorWidth(size_t width) {
+  return width == 8 || width == 16 || width == 32 || width == 64;
+}
+
+static void hashFixedScalar(const uint8_t *keys, size_t width, size_t n,
+                            uint64_t *out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = XXH64(keys + i * width, width, 0);
   }
-  memcpy(cpy, entry, entry_len);
+}
 
-  for (int i = 0; i < n; i++) {
-    // Modify the last byte of cpy
-    cpy[entry_len - 1] = cpy[entry_len - 1] & 0xFF;
+/*
+ * AVX2 kernel: 4 keys per iteration. AVX2 has no 64 bit multiply, so it is
+ * assembled from three 32x32->64 multiplies.
+ */
+__attribute__((target("avx2"))) static inline __m256i
+hbMul64AVX2(__m256i a, __m256i b) {
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i cross = _mm256_add_epi64(
+      _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+      _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+#define HB_ROTL_AVX2(v, r)                                                     \
+  _mm256_or_si256(_mm256_slli_epi64((v), (r)), _mm256_srli_epi64((v), 64 - (r)))
+
+__attribute__((target("avx2"))) static inline __m256i
+hbRoundAVX2(__m256i acc, __m256i input) {
+  acc = _mm256_add_epi64(
+      acc, hbMul64AVX2(input, _mm256_set1_epi64x((long long)HB_PRIME64_2)));
+  acc = HB_ROTL_AVX2(acc, 31);
+  return hbMul64AVX2(acc, _mm256_set1_epi64x((long long)HB_PRIME64_1));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hbMergeRoundAVX2(__m256i acc, __m256i val) {
+  acc = _mm256_xor_si256(acc, hbRoundAVX2(_mm256_setzero_si256(), val));
+  acc = hbMul64AVX2(acc, _mm256_set1_epi64x((long long)HB_PRIME64_1));
+  return _mm256_add_epi64(acc, _mm256_set1_epi64x((long long)HB_PRIME64_4));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hbLoadAVX2(const uint8_t *base, __m256i offsets) {
+  return _mm256_i64gather_epi64((const long long *)base, offsets, 1);
+}
 
-    // Hash the modified entry
-    out[i] = XXH64(cpy, entry_len, 0); // 0 is kept as the seed
+__attribute__((target("avx2"), always_inline)) static inline void
+hbHash4AVX2(const uint8_t *keys, size_t width, uint64_t *out) {
+  __m256i offsets =
+      _mm256_set_epi64x(3 * (long long)width, 2 * (long long)width,
+                        (long long)width, 0);
+  __m256i h;
+  size_t w = 0;
+
+  if (width >= 32) {
+    __m256i v1 = _mm256_set1_epi64x((long long)(HB_PRIME64_1 + HB_PRIME64_2));
+    __m256i v2 = _mm256_set1_epi64x((long long)HB_PRIME64_2);
+    __m256i v3 = _mm256_setzero_si256();
+    __m256i v4 = _mm256_set1_epi64x((long long)(0 - HB_PRIME64_1));
+    for (; w + 32 <= width; w += 32) {
+      v1 = hbRoundAVX2(v1, hbLoadAVX2(keys + w, offsets));
+      v2 = hbRoundAVX2(v2, hbLoadAVX2(keys + w + 8, offsets));
+      v3 = hbRoundAVX2(v3, hbLoadAVX2(keys + w + 16, offsets));
+      v4 = hbRoundAVX2(v4, hbLoadAVX2(keys + w + 24, offsets));
+    }
+    h = _mm256_add_epi64(
+        _mm256_add_epi64(HB_ROTL_AVX2(v1, 1), HB_ROTL_AVX2(v2, 7)),
+        _mm256_add_epi64(HB_ROTL_AVX2(v3, 12), HB_ROTL_AVX2(v4, 18)));
+    h = hbMergeRoundAVX2(h, v1);
+    h = hbMergeRoundAVX2(h, v2);
+    h = hbMergeRoundAVX2(h, v3);
+    h = hbMergeRoundAVX2(h, v4);
+  } else {
+    h = _mm256_set1_epi64x((long long)HB_PRIME64_5);
   }
+  h = _mm256_add_epi64(h, _mm256_set1_epi64x((long long)width));
 
-  free(cpy);
-  return out;
-}
\ No newline at end of file
+  for (; w + 8 <= width; w += 8) {
+    __m256i k1 =
+        hbRoundAVX2(_mm256_setzero_si256(), hbLoadAVX2(keys + w, offsets));
+    h = _mm256_xor_si256(h, k1);
+    h = hbMul64AVX2(HB_ROTL_AVX2(h, 27),
+                    _mm256_set1_epi64x((long long)HB_PRIME64_1));
+    h = _mm256_add_epi64(h, _mm256_set1_epi64x((long long)HB_PRIME64_4));
+  }
+
+  h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+  h = hbMul64AVX2(h, _mm256_set1_epi64x((long long)HB_PRIME64_2));
+  h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 29));
+  h = hbMul64AVX2(h, _mm256_set1_epi64x((long long)HB_PRIME64_3));
+  h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 32));
+  _mm256_storeu_si256((__m256i *)out, h);
+}
+
+__attribute__((target("avx2"))) static void
+hashFixedAVX2(const uint8_t *keys, size_t width, size_t n, uint64_t *out) {
+  if (!hashFixedVectorWidth(width)) {
+    hashFixedScalar(keys, width, n, out);
+    return;
+  }
+
+  size_t i = 0;
+  // Constant widths let the compiler unroll each kernel completely.
+  switch (width) {
+  case 8:
+    for (; i + 4 <= n; i += 4)
+      hbHash4AVX2(keys + i * 8, 8, out + i);
+    break;
+  case 16:
+    for (; i + 4 <= n; i += 4)
+      hbHash4AVX2(keys + i * 16, 16, out + i);
+    break;
+  case 32:
+    for (; i + 4 <= n; i += 4)
+      hbHash4AVX2(keys + i * 32, 32, out + i);
+    break;
+  case 64:
+    for (; i + 4 <= n; i += 4)
+      hbHash4AVX2(keys + i * 64, 64, out + i);
+    break;
+  }
+  hashFixedScalar(keys + i * width, width, n - i, out + i);
+}
+
+/*
+ * AVX-512 kernel: 8 keys per iteration, using the native 64 bit multiply
+ * (AVX512DQ) and rotate (AVX512F).
+ */
+#define HB_MUL64_AVX512(a, b) _mm512_mullo_epi64((a), _mm512_set1_epi64((b)))
+
+__attribute__((target("avx512f,avx512dq"))) static inline __m512i
+hbRoundAVX512(__m512i acc, __m512i input) {
+  acc = _mm512_add_epi64(acc,
+                         HB_MUL64_AVX512(input, (long long)HB_PRIME64_2));
+  acc = _mm512_rol_epi64(acc, 31);
+  return HB_MUL64_AVX512(acc, (long long)HB_PRIME64_1);
+}
+
+__attribute__((target("avx512f,avx512dq"))) static inline __m512i
+hbMergeRoundAVX512(__m512i acc, __m512i val) {
+  acc = _mm512_xor_si512(acc, hbRoundAVX512(_mm512_setzero_si512(), val));
+  acc = HB_MUL64_AVX512(acc, (long long)HB_PRIME64_1);
+  return _mm512_add_epi64(acc, _mm512_set1_epi64((long long)HB_PRIME64_4));
+}
+
+__attribute__((target("avx512f,avx512dq"))) static inline __m512i
+hbLoadAVX512(const uint8_t *base, __m512i offsets) {
+  return _mm512_i64gather_epi64(offsets, (const void *)base, 1);
+}
+
+__attribute__((target("avx512f,avx512dq"), always_inline)) static inline void
+hbHash8AVX512(const uint8_t *keys, size_t width, uint64_t *out) {
+  __m512i offsets = _mm512_mullo_epi64(
+      _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0),
+      _mm512_set1_epi64((long long)width));
+  __m512i h;
+  size_t w = 0;
+
+  if (width >= 32) {
+    __m512i v1 = _mm512_set1_epi64((long long)(HB_PRIME64_1 + HB_PRIME64_2));
+    __m512i v2 = _mm512_set1_epi64((long long)HB_PRIME64_2);
+    __m512i v3 = _mm512_setzero_si512();
+    __m512i v4 = _mm512_set1_epi64((long long)(0 - HB_PRIME64_1));
+    for (; w + 32 <= width; w += 32) {
+      v1 = hbRoundAVX512(v1, hbLoadAVX512(keys + w, offsets));
+      v2 = hbRoundAVX512(v2, hbLoadAVX512(keys + w + 8, offsets));
+      v3 = hbRoundAVX512(v3, hbLoadAVX512(keys + w + 16, offsets));
+      v4 = hbRoundAVX512(v4, hbLoadAVX512(keys + w + 24, offsets));
+    }
+    h = _mm512_add_epi64(
+        _mm512_add_epi64(_mm512_rol_epi64(v1, 1), _mm512_rol_epi64(v2, 7)),
+        _mm512_add_epi64(_mm512_rol_epi64(v3, 12), _mm512_rol_epi64(v4, 18)));
+    h = hbMergeRoundAVX512(h, v1);
+    h = hbMergeRoundAVX512(h, v2);
+    h = hbMergeRoundAVX512(h, v3);
+    h = hbMergeRoundAVX512(h, v4);
+  } else {
+    h = _mm512_set1_epi64((long long)HB_PRIME64_5);
+  }
+  h = _mm512_add_epi64(h, _mm512_set1_epi64((long long)width));
+
+  for (; w + 8 <= width; w += 8) {
+    __m512i k1 =
+        hbRoundAVX512(_mm512_setzero_si512(), hbLoadAVX512(keys + w, offsets));
+    h = _mm512_xor_si512(h, k1);
+    h = HB_MUL64_AVX512(_mm512_rol_epi64(h, 27), (long long)HB_PRIME64_1);
+    h = _mm512_add_epi64(h, _mm512_set1_epi64((long long)HB_PRIME64_4));
+  }
+
+  h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 33));
+  h = HB_MUL64_AVX512(h, (long long)HB_PRIME64_2);
+  h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 29));
+  h = HB_MUL64_AVX512(h, (long long)HB_PRIME64_3);
+  h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 32));
+  _mm512_storeu_si512((void *)out, h);
+}
+
+__attribute__((target("avx512f,avx512dq"))) static void
+hashFixedAVX512(const uint8_t *keys, size_t width, size_t n, uint64_t *out) {
+  if (!hashFixedVectorWidth(width)) {
+    hashFixedScalar(keys, width, n, out);
+    return;
+  }
+
+  size_t i = 0;
+  switch (width) {
+  case 8:
+    for (; i + 8 <= n; i += 8)
+      hbHash8AVX512(keys + i * 8, 8, out + i);
+    break;
+  case 16:
+    for (; i + 8 <= n; i += 8)
+      hbHash8AVX512(keys + i * 16, 16, out + i);
+    break;
+  case 32:
+    for (; i + 8 <= n; i += 8)
+      hbHash8AVX512(keys + i * 32, 32, out + i);
+    break;
+  case 64:
+    for (; i + 8 <= n; i += 8)
+      hbHash8AVX512(keys + i * 64, 64, out + i);
+    break;
+  }
+  hashFixedScalar(keys + i * width, width, n - i, out + i);
+}
+
+/*
+ * Runtime dispatch: the best kernel the CPU supports is picked once, the
+ * first time hashFixedBatch is called.
+ */
+static hashFixedFn hashFixedImpl = hashFixedScalar;
+static const char *hashFixedImplName = "scalar";
+static pthread_once_t hashFixedOnce = PTHREAD_ONCE_INIT;
+
+static void hashFixedResolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+    hashFixedImpl = hashFixedAVX512;
+    hashFixedImplName = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    hashFixedImpl = hashFixedAVX2;
+    hashFixedImplName = "avx2";
+  }
+}
+
+/**
+ * Number of keys hashed per kernel call in the batch paths. Small enough that
+ * the hashes stay in L1 between the hashing and probing passes.
+ */
+#define BATCH_BLOCK 64
+
+/**
+ * Hash `n` fixed-width keys with the best kernel available on this CPU.
+ * `out[i]` receives XXH64 of the i-th key.
+ */
+static inline void hashFixedBatch(const uint8_t *keys, size_t width, size_t n,
+                                  uint64_t *out) {
+  pthread_once(&hashFixedOnce, hashFixedResolve);
+  hashFixedImpl(keys, width, n, out);
+}
+
+/**
+ * Name of the kernel hashFixedBatch dispatches to ("scalar", "avx2" or
+ * "avx512").
+ */
+static inline const char *hashFixedKernel(void) {
+  pthread_once(&hashFixedOnce, hashFixedResolve);
+  return hashFixedImplName;
+}
+
+#endif // HASHING_H
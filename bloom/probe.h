@@ -0,0 +1,203 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Branch-free membership probes for the unlocked lookup paths.
+ *
+ * A probe takes an entry's expanded hashes, masks them into filter positions,
+ * fetches every position with one gather per vector of lanes and decides
+ * membership with a single compare and movemask, so there is no early exit
+ * for the branch predictor to get wrong. The AVX2 kernels probe 4 positions
+ * per gather and the AVX-512 ones 8; hash counts that don't fill the last
+ * vector pad the unused lanes with the first position, which doesn't change
+ * the answer. Kernels are picked at runtime like the ones in hashing.h.
+ *
+ * Byte filters are gathered 4 bytes at a time and only the low byte is kept,
+ * so their vector needs PROBE_BYTE_PAD readable bytes past the end.
+ */
+#define PROBE_BYTE_PAD 3
+
+/**
+ * Hash counts up to this expand into a buffer on the stack in the unlocked
+ * paths; larger ones allocate.
+ */
+#define PROBE_STACK_HASHES 64
+
+typedef bool (*probeBitsFn)(const uint64_t *bv, uint64_t mask,
+                            const uint64_t *hashes, int n);
+typedef bool (*probeBytesFn)(const uint8_t *bv, uint64_t mask,
+                             const uint64_t *hashes, int n);
+
+static bool probeBitsScalar(const uint64_t *bv, uint64_t mask,
+                            const uint64_t *hashes, int n) {
+  uint64_t miss = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t idx = hashes[i] & mask;
+    miss |= ~bv[idx / 64] & (1ULL << (idx & 63));
+  }
+  return miss == 0;
+}
+
+static bool probeBytesScalar(const uint8_t *bv, uint64_t mask,
+                             const uint64_t *hashes, int n) {
+  uint8_t all = 1;
+  for (int i = 0; i < n; i++) {
+    all &= bv[hashes[i] & mask];
+  }
+  return all == 1;
+}
+
+/**
+ * Load up to `lanes` hashes starting at `i`, repeating hashes[0] in the lanes
+ * past `n`.
+ */
+static inline void probeLanes(const uint64_t *hashes, int i, int n,
+                              int lanes, uint64_t *out) {
+  for (int j = 0; j < lanes; j++) {
+    out[j] = i + j < n ? hashes[i + j] : hashes[0];
+  }
+}
+
+__attribute__((target("avx2"))) static bool
+probeBitsAVX2(const uint64_t *bv, uint64_t mask, const uint64_t *hashes,
+              int n) {
+  const __m256i vmask = _mm256_set1_epi64x((long long)mask);
+  const __m256i low6 = _mm256_set1_epi64x(63);
+  const __m256i one = _mm256_set1_epi64x(1);
+  __m256i ok = _mm256_set1_epi64x(-1);
+
+  for (int i = 0; i < n; i += 4) {
+    __m256i h;
+    if (i + 4 <= n) {
+      h = _mm256_loadu_si256((const __m256i *)(hashes + i));
+    } else {
+      uint64_t lanes[4];
+      probeLanes(hashes, i, n, 4, lanes);
+      h = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+    __m256i idx = _mm256_and_si256(h, vmask);
+    __m256i words = _mm256_i64gather_epi64((const long long *)bv,
+                                           _mm256_srli_epi64(idx, 6), 8);
+    __m256i bit = _mm256_sllv_epi64(one, _mm256_and_si256(idx, low6));
+    ok = _mm256_and_si256(
+        ok, _mm256_cmpeq_epi64(_mm256_and_si256(words, bit), bit));
+  }
+  return _mm256_movemask_epi8(ok) == -1;
+}
+
+__attribute__((target("avx512f"))) static bool
+probeBitsAVX512(const uint64_t *bv, uint64_t mask, const uint64_t *hashes,
+                int n) {
+  const __m512i vmask = _mm512_set1_epi64((long long)mask);
+  const __m512i low6 = _mm512_set1_epi64(63);
+  const __m512i one = _mm512_set1_epi64(1);
+  __mmask8 ok = 0xFF;
+
+  for (int i = 0; i < n; i += 8) {
+    __m512i h;
+    if (i + 8 <= n) {
+      h = _mm512_loadu_si512(hashes + i);
+    } else {
+      uint64_t lanes[8];
+      probeLanes(hashes, i, n, 8, lanes);
+      h = _mm512_loadu_si512(lanes);
+    }
+    __m512i idx = _mm512_and_si512(h, vmask);
+    __m512i words = _mm512_i64gather_epi64(_mm512_srli_epi64(idx, 6), bv, 8);
+    __m512i bit = _mm512_sllv_epi64(one, _mm512_and_si512(idx, low6));
+    ok &= _mm512_test_epi64_mask(words, bit);
+  }
+  return ok == 0xFF;
+}
+
+__attribute__((target("avx2"))) static bool
+probeBytesAVX2(const uint8_t *bv, uint64_t mask, const uint64_t *hashes,
+               int n) {
+  const __m256i vmask = _mm256_set1_epi64x((long long)mask);
+  const __m128i low8 = _mm_set1_epi32(0xFF);
+  const __m128i one = _mm_set1_epi32(1);
+  __m128i ok = _mm_set1_epi32(-1);
+
+  for (int i = 0; i < n; i += 4) {
+    __m256i h;
+    if (i + 4 <= n) {
+      h = _mm256_loadu_si256((const __m256i *)(hashes + i));
+    } else {
+      uint64_t lanes[4];
+      probeLanes(hashes, i, n, 4, lanes);
+      h = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+    __m128i bytes = _mm256_i64gather_epi32((const int *)bv,
+                                           _mm256_and_si256(h, vmask), 1);
+    ok = _mm_and_si128(ok,
+                       _mm_cmpeq_epi32(_mm_and_si128(bytes, low8), one));
+  }
+  return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+
+__attribute__((target("avx512f,avx512vl"))) static bool
+probeBytesAVX512(const uint8_t *bv, uint64_t mask, const uint64_t *hashes,
+                 int n) {
+  const __m512i vmask = _mm512_set1_epi64((long long)mask);
+  const __m256i low8 = _mm256_set1_epi32(0xFF);
+  const __m256i one = _mm256_set1_epi32(1);
+  __mmask8 ok = 0xFF;
+
+  for (int i = 0; i < n; i += 8) {
+    __m512i h;
+    if (i + 8 <= n) {
+      h = _mm512_loadu_si512(hashes + i);
+    } else {
+      uint64_t lanes[8];
+      probeLanes(hashes, i, n, 8, lanes);
+      h = _mm512_loadu_si512(lanes);
+    }
+    __m256i bytes = _mm512_i64gather_epi32(_mm512_and_si512(h, vmask), bv, 1);
+    ok &= _mm256_cmpeq_epi32_mask(_mm256_and_si256(bytes, low8), one);
+  }
+  return ok == 0xFF;
+}
+
+static probeBitsFn probeBitsImpl = probeBitsScalar;
+static probeBytesFn probeBytesImpl = probeBytesScalar;
+static pthread_once_t probeOnce = PTHREAD_ONCE_INIT;
+
+static void probeResolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512vl")) {
+    probeBitsImpl = probeBitsAVX512;
+    probeBytesImpl = probeBytesAVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    probeBitsImpl = probeBitsAVX2;
+    probeBytesImpl = probeBytesAVX2;
+  }
+}
+
+/**
+ * True if every one of the `n` positions `hashes[i] & mask` is set in the bit
+ * vector `bv`.
+ */
+static inline bool probeBits(const uint64_t *bv, uint64_t mask,
+                             const uint64_t *hashes, int n) {
+  pthread_once(&probeOnce, probeResolve);
+  return n <= 0 || probeBitsImpl(bv, mask, hashes, n);
+}
+
+/**
+ * True if every one of the `n` positions `hashes[i] & mask` is set in the
+ * byte vector `bv`, which must have PROBE_BYTE_PAD bytes of padding.
+ */
+static inline bool probeBytes(const uint8_t *bv, uint64_t mask,
+                              const uint64_t *hashes, int n) {
+  pthread_once(&probeOnce, probeResolve);
+  return n <= 0 || probeBytesImpl(bv, mask, hashes, n);
+}
+
+#endif // PROBE_H
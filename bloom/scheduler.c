@@ -0,0 +1,144 @@
+#include "scheduler.h"
+#include "hashing.h"
+#include "xxhash.h"
+
+LookupScheduler *NewLookupScheduler(BloomFilter *bf, int inflight) {
+  if (inflight < 1) {
+    fprintf(stderr, "Scheduler needs at least one slot\n");
+    return NULL;
+  }
+
+  LookupScheduler *s = calloc(1, sizeof(LookupScheduler));
+  if (!s) {
+    perror("Failed to allocate scheduler.");
+    return NULL;
+  }
+  s->bf = bf;
+  s->nslots = inflight;
+  s->slots = calloc((size_t)inflight, sizeof(LookupSlot));
+  s->free = malloc((size_t)inflight * sizeof(int));
+  s->hashes = malloc((size_t)inflight * (size_t)bf->hf * sizeof(uint64_t));
+  if (!s->slots || !s->free || !s->hashes) {
+    perror("Failed to allocate scheduler slots.");
+    DestroyLookupScheduler(s);
+    return NULL;
+  }
+
+  for (int i = 0; i < inflight; i++) {
+    s->slots[i].hashes = s->hashes + (size_t)i * (size_t)bf->hf;
+    s->free[i] = inflight - 1 - i;
+  }
+  return s;
+}
+
+void DestroyLookupScheduler(LookupScheduler *s) {
+  if (s) {
+    free(s->slots);
+    free(s->free);
+    free(s->hashes);
+    free(s);
+  }
+}
+
+/**
+ * Word of the filter holding the bit a hash probes.
+ */
+static inline const uint64_t *wordOf(const BloomFilter *bf, uint64_t h) {
+  return &bf->bv[(h & (bf->size - 1)) / 64];
+}
+
+int SubmitLookup(LookupScheduler *s, const char *entry, LookupCallback cb,
+                 void *ctx) {
+  // Make room by moving the lookups in flight along.
+  while (s->active == s->nslots) {
+    PollLookups(s);
+  }
+
+  LookupSlot *slot = &s->slots[s->free[s->nslots - s->active - 1]];
+  expandHash(XXH64(entry, strlen(entry), 0), s->bf->hf, slot->hashes);
+  slot->next = 0;
+  slot->cb = cb;
+  slot->ctx = ctx;
+  slot->active = true;
+  s->active++;
+  // Only a hint, so it goes without the lock: a fold never moves the vector,
+  // so even a stale size points into it. The probes happen under the lock.
+  if (s->bf->hf > 0) {
+    __builtin_prefetch(wordOf(s->bf, slot->hashes[0]), 0);
+  }
+  return 0;
+}
+
+/**
+ * Check the slot's next probe, plus any after it in the same cache line.
+ * Returns true once the lookup is decided, with the answer in `found`.
+ */
+static bool step(const BloomFilter *bf, LookupSlot *slot, bool *found) {
+  uintptr_t line = (uintptr_t)wordOf(bf, slot->hashes[slot->next]) / 64;
+  do {
+    uint64_t idx = slot->hashes[slot->next] & (bf->size - 1);
+    if ((bf->bv[idx / 64] & (1ULL << (idx & 63))) == 0) {
+      *found = false;
+      return true;
+    }
+    slot->next++;
+  } while (slot->next < bf->hf &&
+           (uintptr_t)wordOf(bf, slot->hashes[slot->next]) / 64 == line);
+
+  if (slot->next == bf->hf) {
+    *found = true;
+    return true;
+  }
+  __builtin_prefetch(wordOf(bf, slot->hashes[slot->next]), 0);
+  return false;
+}
+
+int PollLookups(LookupScheduler *s) {
+  // Finished lookups are copied out before their slots are freed, since a
+  // callback may submit into a freed slot (or poll again, if none is free).
+  struct {
+    LookupCallback cb;
+    void *ctx;
+    bool found;
+  } done[POLL_CHUNK];
+  int total = 0;
+
+  for (int start = 0; start < s->nslots; start += POLL_CHUNK) {
+    int end = s->nslots - start < POLL_CHUNK ? s->nslots
+                                             : start + POLL_CHUNK;
+    int ndone = 0;
+
+    pthread_rwlock_rdlock(&s->bf->rwlock);
+    for (int i = start; i < end; i++) {
+      LookupSlot *slot = &s->slots[i];
+      if (!slot->active) {
+        continue;
+      }
+      bool found = true;
+      if (s->bf->hf == 0 || step(s->bf, slot, &found)) {
+        done[ndone].cb = slot->cb;
+        done[ndone].ctx = slot->ctx;
+        done[ndone].found = found;
+        ndone++;
+        slot->active = false;
+        s->free[s->nslots - s->active] = i;
+        s->active--;
+      }
+    }
+    pthread_rwlock_unlock(&s->bf->rwlock);
+
+    for (int j = 0; j < ndone; j++) {
+      if (done[j].cb) {
+        done[j].cb(done[j].ctx, done[j].found);
+      }
+    }
+    total += ndone;
+  }
+  return total;
+}
+
+void DrainLookups(LookupScheduler *s) {
+  while (s->active > 0) {
+    PollLookups(s);
+  }
+}
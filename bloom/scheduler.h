@@ -0,0 +1,91 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "bloom.h"
+
+/**
+ * LookupScheduler interleaves many in-flight lookups on one thread so their
+ * cache misses overlap (asynchronous memory access chaining, AMAC). It is
+ * meant for filters far larger than the last level cache, where a plain
+ * Lookup stalls on one DRAM miss per probe, at call sites that get keys one
+ * at a time and so can't use LookupBatch.
+ *
+ * Each submitted lookup occupies a slot holding its hashes and how far it
+ * has got. A slot never waits on memory: it prefetches the word its next
+ * probe needs and yields, and PollLookups moves every slot one probe forward
+ * per pass. By the time a pass comes back to a slot its word has usually
+ * arrived. With enough slots in flight, a single thread's lookup rate is
+ * bound by memory bandwidth rather than latency. Probes that fall in the
+ * cache line just checked are taken in the same step.
+ *
+ * C has no coroutines, so a lookup's "suspension point" is its slot state
+ * and results come back through a callback. A scheduler belongs to one
+ * thread. A pass takes the filter's reader lock once per POLL_CHUNK slots and
+ * releases it before running their callbacks, so callbacks may insert into
+ * the filter or submit more lookups.
+ */
+
+/**
+ * Slots stepped per reader lock in PollLookups.
+ */
+#define POLL_CHUNK 64
+
+/**
+ * Called once per lookup with the `ctx` given to SubmitLookup.
+ */
+typedef void (*LookupCallback)(void *ctx, bool found);
+
+typedef struct LookupSlot {
+  uint64_t *hashes; // hf expanded hashes of the entry
+  int next;         // Next probe to check
+  bool active;
+  LookupCallback cb;
+  void *ctx;
+} LookupSlot;
+
+typedef struct LookupScheduler {
+  BloomFilter *bf;
+  LookupSlot *slots;
+  int nslots;
+  int active;       // Lookups in flight
+  int *free;        // Stack of free slot indices, nslots - active of them
+  uint64_t *hashes; // nslots * hf, backing the slots' hashes
+} LookupScheduler;
+
+/**
+ * Create a scheduler for `bf` with up to `inflight` concurrent lookups. A
+ * few dozen hide DRAM latency on most machines.
+ */
+LookupScheduler *NewLookupScheduler(BloomFilter *bf, int inflight);
+
+/**
+ * Free a scheduler. Lookups still in flight are dropped without their
+ * callbacks; call DrainLookups first to finish them.
+ */
+void DestroyLookupScheduler(LookupScheduler *s);
+
+/**
+ * Starts a lookup of `entry`, which is hashed right away and needn't outlive
+ * the call. `cb(ctx, found)` runs from a later PollLookups (or from this
+ * call, if every slot was busy and polling was needed to free one).
+ */
+int SubmitLookup(LookupScheduler *s, const char *entry, LookupCallback cb,
+                 void *ctx);
+
+/**
+ * Moves every in-flight lookup one step forward and runs the callbacks of
+ * those that finished. Returns the number that finished.
+ */
+int PollLookups(LookupScheduler *s);
+
+/**
+ * Polls until no lookup is in flight.
+ */
+void DrainLookups(LookupScheduler *s);
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestLookupScheduler();
+
+#endif // SCHEDULER_H
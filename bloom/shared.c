@@ -0,0 +1,377 @@
+#include "shared.h"
+#include "hashing.h"
+#include "xxhash.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+_Static_assert(sizeof(SharedBloomHeader) == 64,
+               "SharedBloomHeader must stay one cache line");
+
+/**
+ * POSIX shared memory names are "/name" with no further slashes; everything
+ * else is treated as a file path.
+ */
+static bool isShmName(const char *name) {
+  return name[0] == '/' && strchr(name + 1, '/') == NULL;
+}
+
+static int openBacking(const char *name, int flags, mode_t mode) {
+  if (isShmName(name)) {
+    return shm_open(name, flags, mode);
+  }
+  return open(name, flags, mode);
+}
+
+static int unlinkBacking(const char *name) {
+  if (isShmName(name)) {
+    return shm_unlink(name);
+  }
+  return unlink(name);
+}
+
+static size_t mappingLength(uint64_t size) {
+  return sizeof(SharedBloomHeader) + (size / 64) * sizeof(uint64_t);
+}
+
+/**
+ * Map `map_len` bytes of `fd` and wrap them in a handle. Bumps the advisory
+ * attachment count.
+ */
+static SharedBloomFilter *mapBacking(int fd, size_t map_len) {
+  SharedBloomFilter *sbf = malloc(sizeof(SharedBloomFilter));
+  if (sbf == NULL) {
+    return NULL;
+  }
+
+  void *base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    free(sbf);
+    return NULL;
+  }
+
+  sbf->hdr = (SharedBloomHeader *)base;
+  sbf->bv = (uint64_t *)((uint8_t *)base + sizeof(SharedBloomHeader));
+  sbf->size = sbf->hdr->size;
+  sbf->hf = (int)sbf->hdr->hf;
+  sbf->map_len = map_len;
+  __atomic_fetch_add(&sbf->hdr->attached, 1, __ATOMIC_RELAXED);
+  return sbf;
+}
+
+/**
+ * Create and initialize the backing object. The exclusive flock is held from
+ * just after creation until the magic has been published, so attachers never
+ * observe a half initialized filter. The first thing written is a header
+ * carrying SHARED_BLOOM_PENDING, so that a creator dying part way leaves
+ * evidence that the object is an unfinished filter. `init`, if given, is
+ * copied into the bit vector before publishing. Returns NULL with errno set
+ * on failure, without printing, so callers can decide whether the failure is
+ * expected.
+ */
+static SharedBloomFilter *createBacking(const char *name, uint64_t size,
+                                        int hf, const uint64_t *init) {
+  if (size < 64 || (size & (size - 1)) != 0 || hf <= 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  int fd = openBacking(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  SharedBloomHeader pending = {.magic = SHARED_BLOOM_PENDING,
+                               .version = SHARED_BLOOM_VERSION,
+                               .size = size,
+                               .hf = (uint64_t)hf,
+                               .creator = (uint64_t)getpid()};
+  size_t map_len = mappingLength(size);
+  if (flock(fd, LOCK_EX) != 0 ||
+      pwrite(fd, &pending, sizeof(pending), 0) != (ssize_t)sizeof(pending) ||
+      ftruncate(fd, (off_t)map_len) != 0) {
+    int err = errno;
+    unlinkBacking(name);
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+
+  void *base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    int err = errno;
+    unlinkBacking(name);
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+
+  // ftruncate zero-fills, so the bit vector starts out empty.
+  SharedBloomHeader *hdr = (SharedBloomHeader *)base;
+  if (init != NULL) {
+    memcpy((uint8_t *)base + sizeof(SharedBloomHeader), init,
+           (size / 64) * sizeof(uint64_t));
+  }
+  __atomic_store_n(&hdr->magic, SHARED_BLOOM_MAGIC, __ATOMIC_RELEASE);
+  munmap(base, map_len);
+
+  // The mapping keeps the open file alive, so the lock has to be dropped
+  // explicitly rather than by close.
+  SharedBloomFilter *sbf = mapBacking(fd, map_len);
+  int err = errno;
+  flock(fd, LOCK_UN);
+  close(fd);
+  errno = err;
+  return sbf;
+}
+
+static void sleepMillis(long ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+/**
+ * Attach to an existing backing object. Returns NULL with errno set to ESTALE
+ * if the creator died before publishing the filter: the object carries
+ * SHARED_BLOOM_PENDING, or it is a shared memory object that stayed empty.
+ * On ESTALE, `stale_fd` (if given) receives the still-open descriptor so the
+ * caller can recover. Anything else that isn't a filter fails with EINVAL and
+ * is left alone.
+ */
+static SharedBloomFilter *attachBacking(const char *name, int *stale_fd) {
+  int fd = openBacking(name, O_RDWR, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  for (long waited = 0;; waited++) {
+    // Blocks while the creator is still initializing.
+    if (flock(fd, LOCK_SH) != 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return NULL;
+    }
+
+    if (st.st_size > 0 && (size_t)st.st_size < sizeof(SharedBloomHeader)) {
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+    }
+    if (st.st_size > 0) {
+      SharedBloomHeader hdr;
+      if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+      }
+      if (hdr.magic == SHARED_BLOOM_MAGIC &&
+          (hdr.version != SHARED_BLOOM_VERSION ||
+           (size_t)st.st_size < mappingLength(hdr.size))) {
+        // A published filter we can't use; not stale, so don't recover it.
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+      }
+      if (hdr.magic == SHARED_BLOOM_MAGIC) {
+        SharedBloomFilter *sbf = mapBacking(fd, mappingLength(hdr.size));
+        int err = errno;
+        flock(fd, LOCK_UN);
+        close(fd);
+        errno = err;
+        return sbf;
+      }
+      if (hdr.magic == SHARED_BLOOM_PENDING) {
+        // Started but never published: the creator died holding the lock.
+        break;
+      }
+      // Not something this code wrote.
+      close(fd);
+      errno = EINVAL;
+      return NULL;
+    }
+
+    // Empty: the creator may not have taken its lock yet.
+    flock(fd, LOCK_UN);
+    if (waited >= SHARED_BLOOM_ATTACH_TIMEOUT_MS) {
+      // A creator that died this early leaves nothing to go on. A shared
+      // memory object under our name is taken to be ours; an empty file at
+      // an arbitrary path may well not be, so it is left alone.
+      if (!isShmName(name)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+      }
+      break;
+    }
+    sleepMillis(1);
+  }
+
+  flock(fd, LOCK_UN);
+  if (stale_fd != NULL) {
+    *stale_fd = fd;
+  } else {
+    close(fd);
+  }
+  errno = ESTALE;
+  return NULL;
+}
+
+/**
+ * Unlink a stale object, but only if `name` still refers to the same object
+ * as `stale_fd`. The exclusive lock on the stale object serializes concurrent
+ * recoverers, so a freshly recreated filter is never unlinked by mistake.
+ */
+static void unlinkStale(const char *name, int stale_fd) {
+  if (flock(stale_fd, LOCK_EX) == 0) {
+    struct stat stale, current;
+    int fd = openBacking(name, O_RDONLY, 0);
+    if (fd >= 0) {
+      if (fstat(stale_fd, &stale) == 0 && fstat(fd, &current) == 0 &&
+          stale.st_dev == current.st_dev && stale.st_ino == current.st_ino) {
+        unlinkBacking(name);
+      }
+      close(fd);
+    }
+  }
+  close(stale_fd);
+}
+
+SharedBloomFilter *CreateSharedBloomFilter(const char *name, uint64_t size,
+                                           int hf) {
+  SharedBloomFilter *sbf = createBacking(name, size, hf, NULL);
+  if (sbf == NULL) {
+    perror("Failed to create shared bloom filter");
+  }
+  return sbf;
+}
+
+SharedBloomFilter *AttachSharedBloomFilter(const char *name) {
+  SharedBloomFilter *sbf = attachBacking(name, NULL);
+  if (sbf == NULL) {
+    perror("Failed to attach to shared bloom filter");
+  }
+  return sbf;
+}
+
+SharedBloomFilter *OpenSharedBloomFilter(const char *name, uint64_t size,
+                                         int hf) {
+  // Bounded so that a pathological create/crash loop can't spin forever.
+  for (int attempt = 0; attempt < 8; attempt++) {
+    SharedBloomFilter *sbf = createBacking(name, size, hf, NULL);
+    if (sbf != NULL) {
+      return sbf;
+    }
+    if (errno != EEXIST) {
+      perror("Failed to create shared bloom filter");
+      return NULL;
+    }
+
+    int stale_fd = -1;
+    sbf = attachBacking(name, &stale_fd);
+    if (sbf != NULL) {
+      if (sbf->size != size || sbf->hf != hf) {
+        fprintf(stderr, "Mismatch in SharedBloomFilter parameters\n");
+        DetachSharedBloomFilter(sbf);
+        errno = EINVAL;
+        return NULL;
+      }
+      return sbf;
+    }
+    if (errno == ESTALE) {
+      fprintf(stderr, "Recovering stale shared bloom filter %s\n", name);
+      unlinkStale(name, stale_fd);
+      continue;
+    }
+    if (errno != ENOENT) { // ENOENT: unlinked under us, just retry
+      perror(errno == EINVAL ? "Not a shared bloom filter"
+                             : "Failed to attach to shared bloom filter");
+      return NULL;
+    }
+  }
+
+  fprintf(stderr, "Gave up opening shared bloom filter %s\n", name);
+  return NULL;
+}
+
+SharedBloomFilter *LoadSharedBloomFilter(const char *name,
+                                         const char *filename) {
+  BloomFilter *bf = Load(filename);
+  if (bf == NULL) {
+    return NULL;
+  }
+
+  SharedBloomFilter *sbf = createBacking(name, bf->size, bf->hf, bf->bv);
+  if (sbf == NULL) {
+    perror("Failed to create shared bloom filter");
+  }
+  DestroyBloomFilter(bf);
+  return sbf;
+}
+
+void DetachSharedBloomFilter(SharedBloomFilter *sbf) {
+  if (sbf) {
+    __atomic_fetch_sub(&sbf->hdr->attached, 1, __ATOMIC_RELAXED);
+    munmap(sbf->hdr, sbf->map_len);
+    free(sbf);
+  }
+}
+
+int UnlinkSharedBloomFilter(const char *name) {
+  if (unlinkBacking(name) != 0) {
+    perror("Failed to unlink shared bloom filter");
+    return -1;
+  }
+  return 0;
+}
+
+int SharedInsert(SharedBloomFilter *sbf, const char *entry) {
+  uint64_t *hashes = hashEntry((const uint8_t *)entry, strlen(entry), sbf->hf);
+  if (hashes == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < sbf->hf; i++) {
+    uint64_t idx = hashes[i] & (sbf->size - 1);
+    uint64_t *word = &sbf->bv[idx / 64];
+    uint64_t bit = 1ULL << (idx & 63);
+
+    // Skip the locked RMW (and the cache line invalidation it causes in every
+    // other process) when the bit is already set.
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0) {
+      __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    }
+  }
+
+  free(hashes);
+  return 0;
+}
+
+bool SharedLookup(SharedBloomFilter *sbf, const char *entry) {
+  uint64_t *hashes = hashEntry((const uint8_t *)entry, strlen(entry), sbf->hf);
+  if (hashes == NULL) {
+    return false;
+  }
+
+  bool found = true;
+  for (int i = 0; i < sbf->hf && found; i++) {
+    uint64_t idx = hashes[i] & (sbf->size - 1);
+    found = (__atomic_load_n(&sbf->bv[idx / 64], __ATOMIC_RELAXED) &
+             (1ULL << (idx & 63))) != 0;
+  }
+
+  free(hashes);
+  return found;
+}
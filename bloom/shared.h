@@ -0,0 +1,139 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include "bloom.h"
+
+/**
+ * SharedBloomFilter is a bit-vector bloomfilter that lives in a POSIX shared
+ * memory segment (or a shared file mapping) so that several processes can
+ * insert into and look up in the same filter without each holding its own
+ * copy. Memory use is the size of one filter regardless of how many processes
+ * attach to it.
+ *
+ * The mapping starts with a SharedBloomHeader, followed directly by the bit
+ * vector. There is no rwlock: a pthread_rwlock_t is process-local unless it is
+ * set up as process-shared, and a lock left held by a crashed process would
+ * wedge every other worker. Instead, inserts set bits with an atomic fetch-or
+ * and lookups use atomic loads, which is all a bloom filter needs since bits
+ * are only ever set, never cleared.
+ *
+ * Naming: a name that starts with '/' and contains no other '/' (e.g.
+ * "/users") is a POSIX shared memory object opened with shm_open. Anything
+ * else is a path to a regular file that is mapped MAP_SHARED, which also makes
+ * the filter persistent across reboots.
+ *
+ * Creation is crash safe: the creator holds an exclusive flock on the object
+ * while it sizes and initializes it, and only publishes the header magic once
+ * the filter is fully set up. Before anything else it writes a header with
+ * SHARED_BLOOM_PENDING in place of the magic. Attachers take a shared flock
+ * before looking at the header, so they either see a complete filter or (if
+ * the creator died half way) a pending one, which is reported as stale
+ * (ESTALE). OpenSharedBloomFilter recovers from stale segments by unlinking
+ * and recreating them. An object that holds neither marker isn't a filter
+ * and is never unlinked: attaching to it fails with EINVAL.
+ */
+
+#define SHARED_BLOOM_MAGIC 0x314D524853424848ULL   // "HHBSHRM1"
+#define SHARED_BLOOM_PENDING 0x304D524853424848ULL // "HHBSHRM0"
+#define SHARED_BLOOM_VERSION 1
+
+/**
+ * How long an attacher waits for a creator that has created the object but
+ * not yet taken its initialization lock, before treating it as stale.
+ */
+#define SHARED_BLOOM_ATTACH_TIMEOUT_MS 1000
+
+/**
+ * Layout header at the start of the shared mapping. Fixed size, 64 bytes, so
+ * the bit vector that follows is cache line aligned.
+ */
+typedef struct SharedBloomHeader {
+  uint64_t magic;    // SHARED_BLOOM_MAGIC once ready, else _PENDING
+  uint64_t version;  // SHARED_BLOOM_VERSION
+  uint64_t size;     // Size of bit vector. Must be a power of 2.
+  uint64_t hf;       // Number of hash functions
+  uint64_t creator;  // pid of the creating process
+  uint64_t attached; // Number of live attachments (advisory)
+  uint64_t reserved[2];
+} SharedBloomHeader;
+
+/**
+ * A process-local handle to a shared filter.
+ */
+typedef struct SharedBloomFilter {
+  SharedBloomHeader *hdr; // Start of the shared mapping
+  uint64_t *bv;           // Bit vector, directly after the header
+  uint64_t size;          // Size of bit vector. Must be a power of 2.
+  int hf;                 // Number of hash functions
+  size_t map_len;         // Length of the mapping in bytes
+} SharedBloomFilter;
+
+/**
+ * Create a new shared filter called `name` and attach to it. Fails with
+ * EEXIST if a segment with that name already exists.
+ *
+ * Parameters:
+ * - `name`: shared memory name ("/name") or file path
+ * - `size`: the size (in bits) of the filter
+ * - `hf`: number of hash functions to apply in the filter.
+ */
+SharedBloomFilter *CreateSharedBloomFilter(const char *name, uint64_t size,
+                                           int hf);
+
+/**
+ * Attach to an existing shared filter. Fails with ENOENT if there is none,
+ * with ESTALE if its creator died before finishing initialization and with
+ * EINVAL if `name` is not a shared filter.
+ */
+SharedBloomFilter *AttachSharedBloomFilter(const char *name);
+
+/**
+ * Attach to the shared filter `name`, creating it if it doesn't exist yet or
+ * if a previous creator crashed half way. This is what pre-forked workers
+ * should call: whichever gets there first creates it, the rest attach.
+ *
+ * Fails with EINVAL if the existing filter has a different size or number of
+ * hash functions, or if `name` exists and is not a shared filter. Only
+ * objects with positive evidence of an unfinished filter are recreated.
+ */
+SharedBloomFilter *OpenSharedBloomFilter(const char *name, uint64_t size,
+                                         int hf);
+
+/**
+ * Create a shared filter called `name` holding the contents of a filter saved
+ * with Write. Attachers never see it half loaded.
+ */
+SharedBloomFilter *LoadSharedBloomFilter(const char *name,
+                                         const char *filename);
+
+/**
+ * Detach from a shared filter and free the handle. The filter itself stays
+ * alive until it is unlinked and every process has detached.
+ */
+void DetachSharedBloomFilter(SharedBloomFilter *sbf);
+
+/**
+ * Remove the name of a shared filter. Processes that are still attached keep
+ * working on it; new attachers will no longer find it.
+ */
+int UnlinkSharedBloomFilter(const char *name);
+
+/**
+ * Inserts an entry into the shared filter using atomic fetch-or, so any
+ * number of processes and threads may insert concurrently.
+ */
+int SharedInsert(SharedBloomFilter *sbf, const char *entry);
+
+/**
+ * Looks up an entry in the shared filter. Returns true if a match is found,
+ * false otherwise. Never blocks, even while other processes insert.
+ */
+bool SharedLookup(SharedBloomFilter *sbf, const char *entry);
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestSharedBloomFilter();
+void TestSharedBloomFilterStale();
+
+#endif // SHARED_H
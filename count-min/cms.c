@@ -0,0 +1,556 @@
+#include "cms.h"
+#include "chunkio.h"
+#include "hashing.h"
+#include "xxhash.h"
+
+#include <immintrin.h>
+#include <string.h>
+
+/**
+ * Metadata stored with every sketch file.
+ */
+typedef struct CountMinFileMeta {
+  uint64_t width;
+  uint64_t depth;
+  uint64_t counter_bytes;
+  uint64_t conservative;
+} CountMinFileMeta;
+
+CountMinSketch *NewCountMinSketch(uint64_t width, int depth, int counter_bytes,
+                                  bool conservative) {
+  if (width < 64 || (width & (width - 1)) != 0) {
+    fprintf(stderr, "Sketch width must be a power of 2 of at least 64\n");
+    return NULL;
+  }
+  if (depth < 1 || depth > CMS_MAX_DEPTH) {
+    fprintf(stderr, "Sketch depth must be between 1 and %d\n", CMS_MAX_DEPTH);
+    return NULL;
+  }
+  if (counter_bytes != 1 && counter_bytes != 2 && counter_bytes != 4) {
+    fprintf(stderr, "Counters must be 1, 2 or 4 bytes wide\n");
+    return NULL;
+  }
+  // Widths come from files too, so keep the size of the counters (rounded
+  // up to whole cache lines) from overflowing.
+  if (width > (SIZE_MAX / 64) / (uint64_t)counter_bytes / (uint64_t)depth) {
+    fprintf(stderr, "Sketch is too large\n");
+    return NULL;
+  }
+
+  CountMinSketch *cms = malloc(sizeof(CountMinSketch));
+  if (!cms) {
+    perror("Failed to allocate sketch.");
+    return NULL;
+  }
+
+  cms->width = width;
+  cms->row_bytes = width * (uint64_t)counter_bytes;
+  cms->depth = depth;
+  cms->counter_bytes = counter_bytes;
+  cms->conservative = conservative;
+  cms->counters = aligned_alloc(64, cms->row_bytes * (uint64_t)depth);
+
+  if (!cms->counters) {
+    perror("Failed to allocate counters.");
+    free(cms);
+    return NULL;
+  }
+  memset(cms->counters, 0, cms->row_bytes * (uint64_t)depth);
+
+  if (pthread_rwlock_init(&cms->rwlock, NULL) != 0) {
+    perror("Failed to initialize rwlock");
+    free(cms->counters);
+    free(cms);
+    return NULL;
+  }
+
+  return cms;
+}
+
+void DestroyCountMinSketch(CountMinSketch *cms) {
+  if (cms) {
+    pthread_rwlock_destroy(&cms->rwlock);
+    free(cms->counters);
+    free(cms);
+  }
+}
+
+uint64_t CountMinMax(const CountMinSketch *cms) {
+  return (1ULL << (8 * cms->counter_bytes)) - 1;
+}
+
+/**
+ * The column of every row for an entry hash, from the same double hashing as
+ * the filters' positions (see expandHash), so that two keys sharing a column
+ * in one row rarely share one in the next. Masking keeps columns consistent
+ * under folding.
+ */
+static inline void columnsOf(const CountMinSketch *cms, uint64_t h,
+                             uint64_t *cols) {
+  expandHash(h, cms->depth, cols);
+  for (int r = 0; r < cms->depth; r++) {
+    cols[r] &= cms->width - 1;
+  }
+}
+
+static inline uint8_t *counterAt(const CountMinSketch *cms, int row,
+                                 uint64_t col) {
+  return cms->counters + (uint64_t)row * cms->row_bytes +
+         col * (uint64_t)cms->counter_bytes;
+}
+
+static inline uint64_t getCounter(const CountMinSketch *cms, int row,
+                                  uint64_t col) {
+  const uint8_t *p = counterAt(cms, row, col);
+  switch (cms->counter_bytes) {
+  case 1:
+    return *p;
+  case 2:
+    return *(const uint16_t *)p;
+  default:
+    return *(const uint32_t *)p;
+  }
+}
+
+static inline void setCounter(const CountMinSketch *cms, int row,
+                              uint64_t col, uint64_t v) {
+  uint8_t *p = counterAt(cms, row, col);
+  switch (cms->counter_bytes) {
+  case 1:
+    *p = (uint8_t)v;
+    break;
+  case 2:
+    *(uint16_t *)p = (uint16_t)v;
+    break;
+  default:
+    *(uint32_t *)p = (uint32_t)v;
+    break;
+  }
+}
+
+static uint64_t estimateHash(const CountMinSketch *cms, uint64_t h) {
+  uint64_t cols[CMS_MAX_DEPTH];
+  columnsOf(cms, h, cols);
+  uint64_t est = UINT64_MAX;
+  for (int r = 0; r < cms->depth; r++) {
+    uint64_t c = getCounter(cms, r, cols[r]);
+    est = c < est ? c : est;
+  }
+  return est;
+}
+
+static void addHash(CountMinSketch *cms, uint64_t h, uint64_t count) {
+  uint64_t cols[CMS_MAX_DEPTH];
+  uint64_t max = CountMinMax(cms);
+  columnsOf(cms, h, cols);
+
+  if (cms->conservative) {
+    // Raise every counter to the new estimate, never past it.
+    uint64_t est = UINT64_MAX;
+    for (int r = 0; r < cms->depth; r++) {
+      uint64_t c = getCounter(cms, r, cols[r]);
+      est = c < est ? c : est;
+    }
+    uint64_t target = count > max - est ? max : est + count;
+    for (int r = 0; r < cms->depth; r++) {
+      if (getCounter(cms, r, cols[r]) < target) {
+        setCounter(cms, r, cols[r], target);
+      }
+    }
+    return;
+  }
+
+  for (int r = 0; r < cms->depth; r++) {
+    uint64_t c = getCounter(cms, r, cols[r]);
+    setCounter(cms, r, cols[r], count > max - c ? max : c + count);
+  }
+}
+
+int CountMinAdd(CountMinSketch *cms, const char *entry, uint64_t count) {
+  uint64_t h = XXH64(entry, strlen(entry), 0);
+  pthread_rwlock_wrlock(&cms->rwlock);
+  addHash(cms, h, count);
+  pthread_rwlock_unlock(&cms->rwlock);
+  return 0;
+}
+
+uint64_t CountMinEstimate(CountMinSketch *cms, const char *entry) {
+  uint64_t h = XXH64(entry, strlen(entry), 0);
+  pthread_rwlock_rdlock(&cms->rwlock);
+  uint64_t est = estimateHash(cms, h);
+  pthread_rwlock_unlock(&cms->rwlock);
+  return est;
+}
+
+/**
+ * Prefetch every counter the block of hashes is about to touch.
+ */
+static void prefetchBlock(const CountMinSketch *cms, const uint64_t *hashes,
+                          size_t count, int rw) {
+  uint64_t cols[CMS_MAX_DEPTH];
+  for (size_t j = 0; j < count; j++) {
+    columnsOf(cms, hashes[j], cols);
+    for (int r = 0; r < cms->depth; r++) {
+      if (rw) {
+        __builtin_prefetch(counterAt(cms, r, cols[r]), 1);
+      } else {
+        __builtin_prefetch(counterAt(cms, r, cols[r]), 0);
+      }
+    }
+  }
+}
+
+int CountMinAddBatch(CountMinSketch *cms, const uint8_t *keys, size_t width,
+                     size_t n, const uint64_t *counts) {
+  uint64_t hashes[BATCH_BLOCK];
+
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    // Keys are applied in order, so repeats within a block see each other's
+    // conservative updates.
+    pthread_rwlock_wrlock(&cms->rwlock);
+    prefetchBlock(cms, hashes, count, 1);
+    for (size_t j = 0; j < count; j++) {
+      addHash(cms, hashes[j], counts ? counts[start + j] : 1);
+    }
+    pthread_rwlock_unlock(&cms->rwlock);
+  }
+  return 0;
+}
+
+int CountMinEstimateBatch(CountMinSketch *cms, const uint8_t *keys,
+                          size_t width, size_t n, uint64_t *out) {
+  uint64_t hashes[BATCH_BLOCK];
+
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_rdlock(&cms->rwlock);
+    prefetchBlock(cms, hashes, count, 0);
+    for (size_t j = 0; j < count; j++) {
+      out[start + j] = estimateHash(cms, hashes[j]);
+    }
+    pthread_rwlock_unlock(&cms->rwlock);
+  }
+  return 0;
+}
+
+/**
+ * Saturating adds of whole runs of counters, for merging and folding.
+ * `len` is in bytes. AVX2 has unsigned saturating adds for 8 and 16 bit
+ * lanes; 32 bit lanes saturate where the sum wrapped below an addend.
+ */
+typedef void (*addCountersFn)(uint8_t *dst, const uint8_t *src, size_t len,
+                              int counter_bytes);
+
+static void addCountersScalar(uint8_t *dst, const uint8_t *src, size_t len,
+                              int counter_bytes) {
+  switch (counter_bytes) {
+  case 1:
+    for (size_t i = 0; i < len; i++) {
+      unsigned s = (unsigned)dst[i] + src[i];
+      dst[i] = s > UINT8_MAX ? UINT8_MAX : (uint8_t)s;
+    }
+    break;
+  case 2: {
+    uint16_t *d = (uint16_t *)dst;
+    const uint16_t *s = (const uint16_t *)src;
+    for (size_t i = 0; i < len / 2; i++) {
+      uint32_t v = (uint32_t)d[i] + s[i];
+      d[i] = v > UINT16_MAX ? UINT16_MAX : (uint16_t)v;
+    }
+    break;
+  }
+  default: {
+    uint32_t *d = (uint32_t *)dst;
+    const uint32_t *s = (const uint32_t *)src;
+    for (size_t i = 0; i < len / 4; i++) {
+      uint64_t v = (uint64_t)d[i] + s[i];
+      d[i] = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+    }
+    break;
+  }
+  }
+}
+
+__attribute__((target("avx2"))) static void
+addCountersAVX2(uint8_t *dst, const uint8_t *src, size_t len,
+                int counter_bytes) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i s;
+    if (counter_bytes == 1) {
+      s = _mm256_adds_epu8(a, b);
+    } else if (counter_bytes == 2) {
+      s = _mm256_adds_epu16(a, b);
+    } else {
+      s = _mm256_add_epi32(a, b);
+      __m256i ok = _mm256_cmpeq_epi32(_mm256_max_epu32(s, a), s);
+      s = _mm256_or_si256(s, _mm256_xor_si256(ok, _mm256_set1_epi32(-1)));
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), s);
+  }
+  addCountersScalar(dst + i, src + i, len - i, counter_bytes);
+}
+
+static addCountersFn addCountersImpl = addCountersScalar;
+static pthread_once_t addCountersOnce = PTHREAD_ONCE_INIT;
+
+static void addCountersResolve(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    addCountersImpl = addCountersAVX2;
+  }
+}
+
+static void addCounters(uint8_t *dst, const uint8_t *src, size_t len,
+                        int counter_bytes) {
+  pthread_once(&addCountersOnce, addCountersResolve);
+  addCountersImpl(dst, src, len, counter_bytes);
+}
+
+int CountMinWrite(CountMinSketch *cms, const char *filename) {
+  printf("Writing counters to file...\n");
+
+  // The width is read under the lock, so a concurrent fold can't leave it
+  // out of step with the counters written.
+  pthread_rwlock_rdlock(&cms->rwlock);
+  CountMinFileMeta meta = {.width = cms->width,
+                           .depth = (uint64_t)cms->depth,
+                           .counter_bytes = (uint64_t)cms->counter_bytes,
+                           .conservative = cms->conservative};
+  int rc = WriteChunkedFile(filename, CHUNKED_KIND_COUNT_MIN, &meta,
+                            sizeof(meta), cms->counters,
+                            cms->row_bytes * (uint64_t)cms->depth,
+                            CHUNKED_FILE_CHUNK_SIZE, 0);
+  pthread_rwlock_unlock(&cms->rwlock);
+  if (rc != 0) {
+    return -1;
+  }
+
+  printf("Successfully wrote counters to file: %s\n", filename);
+  return 0;
+}
+
+CountMinSketch *CountMinLoad(const char *filename) {
+  CountMinFileMeta meta;
+  ChunkedFile *cf =
+      OpenChunkedFile(filename, CHUNKED_KIND_COUNT_MIN, &meta, sizeof(meta));
+  if (cf == NULL) {
+    if (errno == EILSEQ) {
+      fprintf(stderr, "%s: not a count-min sketch file\n", filename);
+    }
+    return NULL;
+  }
+
+  CountMinSketch *cms =
+      meta.depth <= CMS_MAX_DEPTH && meta.counter_bytes <= 4
+          ? NewCountMinSketch(meta.width, (int)meta.depth,
+                              (int)meta.counter_bytes, meta.conservative != 0)
+          : NULL;
+  if (cms == NULL ||
+      cf->hdr.payload_len != cms->row_bytes * (uint64_t)cms->depth) {
+    fprintf(stderr, "%s: bad sketch metadata\n", filename);
+    DestroyCountMinSketch(cms);
+    CloseChunkedFile(cf);
+    return NULL;
+  }
+
+  int64_t corrupt = ReadChunkedPayload(cf, cms->counters, 0);
+  CloseChunkedFile(cf);
+  if (corrupt != 0) {
+    if (corrupt > 0) {
+      fprintf(stderr, "%s: %lld corrupt chunk(s), refusing to load\n",
+              filename, (long long)corrupt);
+    }
+    DestroyCountMinSketch(cms);
+    return NULL;
+  }
+
+  printf("Loaded counters from file: %s\n", filename);
+  return cms;
+}
+
+/**
+ * Folds every row of `cms` by `factor`. The caller holds the write lock.
+ */
+static void foldCounters(CountMinSketch *cms, uint64_t factor) {
+  if (factor <= 1) {
+    return;
+  }
+  uint64_t part = cms->row_bytes / factor;
+  for (int r = 0; r < cms->depth; r++) {
+    uint8_t *row = cms->counters + (uint64_t)r * cms->row_bytes;
+    for (uint64_t j = 1; j < factor; j++) {
+      addCounters(row, row + j * part, part, cms->counter_bytes);
+    }
+    // Pack the folded rows together. Row r lands below where row r + 1
+    // starts, so later rows are still intact when their turn comes.
+    memmove(cms->counters + (uint64_t)r * part, row, part);
+  }
+  // The counters stay where they are; the space after the packed rows is
+  // unused until the sketch is destroyed.
+  cms->width /= factor;
+  cms->row_bytes = part;
+}
+
+int FoldCountMinSketch(CountMinSketch *cms, uint64_t factor) {
+  if (factor == 0 || (factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&cms->rwlock);
+  if (cms->width / factor < 64) {
+    pthread_rwlock_unlock(&cms->rwlock);
+    fprintf(stderr, "Folded sketch width must be at least 64\n");
+    return -1;
+  }
+  foldCounters(cms, factor);
+  pthread_rwlock_unlock(&cms->rwlock);
+  return 0;
+}
+
+/**
+ * Adds the sketch saved in `filename` to `cms`, folding `cms` down to the
+ * width of a narrower file if `fold` is set.
+ */
+static int mergeFile(CountMinSketch *cms, const char *filename, bool fold) {
+  CountMinSketch *loaded = CountMinLoad(filename);
+  if (loaded == NULL) {
+    return -1;
+  }
+
+  if (cms->depth != loaded->depth ||
+      cms->counter_bytes != loaded->counter_bytes) {
+    fprintf(stderr, "Mismatch in CountMinSketch parameters\n");
+    DestroyCountMinSketch(loaded);
+    return -1;
+  }
+
+  // A wider sketch in the file is folded down to match. A narrower one means
+  // folding `cms`, which only happens if the caller asked for it. The widths
+  // are checked again under the lock in case `cms` was folded in the
+  // meantime.
+  pthread_rwlock_rdlock(&cms->rwlock);
+  uint64_t width = cms->width;
+  pthread_rwlock_unlock(&cms->rwlock);
+  if (loaded->width > width &&
+      FoldCountMinSketch(loaded, loaded->width / width) != 0) {
+    DestroyCountMinSketch(loaded);
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&cms->rwlock);
+  int rc = 0;
+  if (cms->width > loaded->width && fold) {
+    foldCounters(cms, cms->width / loaded->width);
+  }
+  if (loaded->width != cms->width) {
+    fprintf(stderr, "Sketch in file is narrower; fold the sketch first\n");
+    rc = -1;
+  } else {
+    addCounters(cms->counters, loaded->counters,
+                cms->row_bytes * (uint64_t)cms->depth, cms->counter_bytes);
+  }
+  pthread_rwlock_unlock(&cms->rwlock);
+
+  DestroyCountMinSketch(loaded);
+  return rc;
+}
+
+int MergeCountMinSketch(CountMinSketch *cms, const char *filename) {
+  return mergeFile(cms, filename, false);
+}
+
+int MergeCountMinSketchFolding(CountMinSketch *cms, const char *filename) {
+  return mergeFile(cms, filename, true);
+}
+
+CountMinShards *NewCountMinShards(int n, uint64_t width, int depth,
+                                  int counter_bytes, bool conservative) {
+  if (n < 1) {
+    fprintf(stderr, "Need at least one shard\n");
+    return NULL;
+  }
+
+  CountMinShards *s = malloc(sizeof(CountMinShards));
+  if (!s) {
+    perror("Failed to allocate shards.");
+    return NULL;
+  }
+  s->n = n;
+  s->shards = calloc((size_t)n, sizeof(CountMinSketch *));
+  if (!s->shards) {
+    perror("Failed to allocate shards.");
+    free(s);
+    return NULL;
+  }
+
+  for (int i = 0; i < n; i++) {
+    s->shards[i] = NewCountMinSketch(width, depth, counter_bytes, conservative);
+    if (s->shards[i] == NULL) {
+      DestroyCountMinShards(s);
+      return NULL;
+    }
+  }
+  return s;
+}
+
+void DestroyCountMinShards(CountMinShards *s) {
+  if (s) {
+    for (int i = 0; i < s->n; i++) {
+      DestroyCountMinSketch(s->shards[i]);
+    }
+    free(s->shards);
+    free(s);
+  }
+}
+
+CountMinSketch *CountMinShard(CountMinShards *s, int i) {
+  return s->shards[(unsigned)i % (unsigned)s->n];
+}
+
+uint64_t CountMinShardsEstimate(CountMinShards *s, const char *entry) {
+  uint64_t h = XXH64(entry, strlen(entry), 0);
+  uint64_t total = 0;
+  // Every shard's estimate bounds its own share of the count, so their sum
+  // bounds the total.
+  for (int i = 0; i < s->n; i++) {
+    CountMinSketch *cms = s->shards[i];
+    pthread_rwlock_rdlock(&cms->rwlock);
+    total += estimateHash(cms, h);
+    pthread_rwlock_unlock(&cms->rwlock);
+  }
+  return total;
+}
+
+CountMinSketch *CollapseCountMinShards(CountMinShards *s) {
+  CountMinSketch *first = s->shards[0];
+  CountMinSketch *out = NewCountMinSketch(first->width, first->depth,
+                                          first->counter_bytes,
+                                          first->conservative);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < s->n; i++) {
+    CountMinSketch *cms = s->shards[i];
+    pthread_rwlock_rdlock(&cms->rwlock);
+    if (cms->width != out->width) {
+      pthread_rwlock_unlock(&cms->rwlock);
+      fprintf(stderr, "Shards have been folded to different widths\n");
+      DestroyCountMinSketch(out);
+      return NULL;
+    }
+    addCounters(out->counters, cms->counters,
+                out->row_bytes * (uint64_t)out->depth, out->counter_bytes);
+    pthread_rwlock_unlock(&cms->rwlock);
+  }
+  return out;
+}
@@ -0,0 +1,187 @@
+#ifndef CMS_H
+#define CMS_H
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Macro to perform assertions.
+ */
+#define assert(condition, message)                                             \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "Assertion failed: %s\n", message);                      \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Most rows a sketch can have. Each row halves the chance of a bad estimate,
+ * so a handful is plenty.
+ */
+#define CMS_MAX_DEPTH 32
+
+/**
+ * CountMinSketch estimates how often each key was added, for hot-key
+ * detection. It is a `depth` x `width` table of saturating counters; a key
+ * adds to one counter in every row and its estimate is the smallest of them.
+ * Estimates never undercount. They overcount by at most 2N / `width` with
+ * probability 1 - 2^-depth, where N is the total of all counts added.
+ *
+ * Counters are 8, 16 or 32 bits wide and stop at their maximum instead of
+ * wrapping. Every row is a power of 2 counters of at least 64 bytes and starts
+ * on a cache line, so merges and folds add whole rows with SIMD saturating
+ * adds. Keys are hashed with XXH64 like the filters; the column of each row
+ * comes from the one hash by double hashing.
+ *
+ * With `conservative` set, an add only raises the counters that are below the
+ * key's new estimate. This gives much tighter estimates for skewed streams,
+ * but the counters no longer support subtracting.
+ *
+ * Like the filters it uses central locking via a RWMutex, taken once per key
+ * or once per block of keys in the batch calls. See CountMinShards for
+ * ingesting from several threads.
+ */
+typedef struct CountMinSketch {
+  uint8_t *counters;  // depth rows of row_bytes each, 64 byte aligned
+  uint64_t width;     // Counters per row. Power of 2, at least 64.
+  uint64_t row_bytes; // width * counter_bytes
+  int depth;          // Number of rows (hash functions)
+  int counter_bytes;  // 1, 2 or 4
+  bool conservative;  // Conservative update
+
+  pthread_rwlock_t rwlock;
+} CountMinSketch;
+
+/**
+ * Create and return a pointer to a new Count-Min sketch.
+ *
+ * Parameters:
+ * - `width`: counters per row, a power of 2 of at least 64
+ * - `depth`: number of rows, 1 to CMS_MAX_DEPTH
+ * - `counter_bytes`: counter width in bytes, 1, 2 or 4
+ * - `conservative`: use conservative update
+ */
+CountMinSketch *NewCountMinSketch(uint64_t width, int depth, int counter_bytes,
+                                  bool conservative);
+
+/**
+ * Manually free a sketch after use in order to avoid memory leaks.
+ */
+void DestroyCountMinSketch(CountMinSketch *cms);
+
+/**
+ * Largest value a counter of the sketch can hold.
+ */
+uint64_t CountMinMax(const CountMinSketch *cms);
+
+/**
+ * Adds `count` occurrences of an entry. Takes the writer lock once.
+ */
+int CountMinAdd(CountMinSketch *cms, const char *entry, uint64_t count);
+
+/**
+ * Estimated number of occurrences of an entry. Takes the reader lock once.
+ */
+uint64_t CountMinEstimate(CountMinSketch *cms, const char *entry);
+
+/**
+ * Adds `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each, hashing them with the vectorized kernels in hashing.h. `counts[i]` is
+ * added for the i-th key, or 1 for every key if `counts` is NULL. A key added
+ * here is counted by CountMinEstimate on the same bytes and vice versa.
+ */
+int CountMinAddBatch(CountMinSketch *cms, const uint8_t *keys, size_t width,
+                     size_t n, const uint64_t *counts);
+
+/**
+ * Estimates for `n` fixed-width keys laid out back to back in `keys`.
+ */
+int CountMinEstimateBatch(CountMinSketch *cms, const uint8_t *keys,
+                          size_t width, size_t n, uint64_t *out);
+
+/**
+ * Flushes the sketch to a file in checksummed chunks (see chunkio.h).
+ */
+int CountMinWrite(CountMinSketch *cms, const char *filename);
+
+/**
+ * Reads a sketch written by CountMinWrite.
+ */
+CountMinSketch *CountMinLoad(const char *filename);
+
+/**
+ * Shrinks every row to `width / factor` counters, for a power of 2 `factor`,
+ * by adding the upper parts of the row into the lowest one. Estimates stay
+ * upper bounds but get looser. The folded rows must keep at least 64
+ * counters. The rows are packed together in place, and the memory they no
+ * longer use is only given back when the sketch is destroyed.
+ */
+int FoldCountMinSketch(CountMinSketch *cms, uint64_t factor);
+
+/**
+ * Adds the counters of the sketch in `filename` to `cms`. Both must have the
+ * same depth and counter width. A wider sketch in the file is folded down to
+ * the width of `cms` as it is merged. A narrower one is refused; to merge it,
+ * fold `cms` down to its width first or use MergeCountMinSketchFolding.
+ */
+int MergeCountMinSketch(CountMinSketch *cms, const char *filename);
+
+/**
+ * Like MergeCountMinSketch, but a narrower sketch in the file is merged by
+ * first folding `cms` down to its width (see FoldCountMinSketch).
+ */
+int MergeCountMinSketchFolding(CountMinSketch *cms, const char *filename);
+
+/**
+ * CountMinShards spreads ingestion over one sketch per writer thread, so
+ * writers never contend for a lock. Thread `i` adds to CountMinShard(s, i);
+ * reads sum the shards' estimates, which is at least as tight as the
+ * estimate of one sketch holding every count.
+ */
+typedef struct CountMinShards {
+  CountMinSketch **shards;
+  int n;
+} CountMinShards;
+
+/**
+ * Create `n` shards of identical sketches (see NewCountMinSketch).
+ */
+CountMinShards *NewCountMinShards(int n, uint64_t width, int depth,
+                                  int counter_bytes, bool conservative);
+
+void DestroyCountMinShards(CountMinShards *s);
+
+/**
+ * The sketch that writer `i` should add to.
+ */
+CountMinSketch *CountMinShard(CountMinShards *s, int i);
+
+/**
+ * Estimated number of occurrences of an entry across all shards.
+ */
+uint64_t CountMinShardsEstimate(CountMinShards *s, const char *entry);
+
+/**
+ * A new sketch holding the sum of all shards, e.g. to write to a file.
+ */
+CountMinSketch *CollapseCountMinShards(CountMinShards *s);
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestNewCountMinSketch();
+void TestCountMinSketch();
+void TestCountMinSaturation();
+void TestCountMinConservative();
+void TestCountMinBatch();
+void TestCountMinWriteLoad();
+void TestCountMinShards();
+
+#endif // CMS_H
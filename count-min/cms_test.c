@@ -0,0 +1,308 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cms.h"
+
+int main() {
+  printf("Running tests...\n");
+  TestNewCountMinSketch();
+  TestCountMinSketch();
+  TestCountMinSaturation();
+  TestCountMinConservative();
+  TestCountMinBatch();
+  TestCountMinWriteLoad();
+  TestCountMinShards();
+  printf("All tests passed!\n");
+  return 0;
+}
+
+/**
+ * Keys with a Zipf-like skew: key i is added 1000 / (i + 1) times.
+ */
+#define SKEW_KEYS 1000
+
+static uint64_t skewCount(int i) { return 1000 / (uint64_t)(i + 1); }
+
+static void addSkewed(CountMinSketch *cms) {
+  char key[32];
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    for (uint64_t c = 0; c < skewCount(i); c++) {
+      CountMinAdd(cms, key, 1);
+    }
+  }
+}
+
+void TestNewCountMinSketch() {
+  assert(NewCountMinSketch(1000, 4, 4, false) == NULL,
+         "NewCountMinSketch should return NULL for bad width");
+  assert(NewCountMinSketch(32, 4, 4, false) == NULL,
+         "NewCountMinSketch should need 64 counters per row");
+  assert(NewCountMinSketch(1024, 0, 4, false) == NULL,
+         "NewCountMinSketch should need a row");
+  assert(NewCountMinSketch(1024, CMS_MAX_DEPTH + 1, 4, false) == NULL,
+         "NewCountMinSketch should cap the depth");
+  assert(NewCountMinSketch(1024, 4, 3, false) == NULL,
+         "NewCountMinSketch should reject odd counter widths");
+  assert(NewCountMinSketch(1ULL << 62, CMS_MAX_DEPTH, 4, false) == NULL,
+         "NewCountMinSketch should reject sizes that overflow");
+
+  int widths[] = {1, 2, 4};
+  for (int i = 0; i < 3; i++) {
+    CountMinSketch *cms = NewCountMinSketch(1024, 4, widths[i], false);
+    assert(cms != NULL, "NewCountMinSketch should not return NULL");
+    assert(((uintptr_t)cms->counters & 63) == 0,
+           "Rows should be cache line aligned");
+    assert(cms->row_bytes % 64 == 0, "Rows should be whole cache lines");
+    DestroyCountMinSketch(cms);
+  }
+  printf("TestNewCountMinSketch passed\n");
+}
+
+void TestCountMinSketch() {
+  CountMinSketch *cms = NewCountMinSketch(4096, 4, 4, false);
+  assert(cms != NULL, "NewCountMinSketch should not return NULL");
+  addSkewed(cms);
+
+  uint64_t total = 0;
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    total += skewCount(i);
+  }
+
+  char key[32];
+  int tight = 0;
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    uint64_t est = CountMinEstimate(cms, key);
+    assert(est >= skewCount(i), "Estimates should never undercount");
+    assert(est <= skewCount(i) + 2 * total / 4096 * 4,
+           "Estimates should be close to the true count");
+    tight += est == skewCount(i);
+  }
+  assert(tight > SKEW_KEYS * 9 / 10, "Most estimates should be exact");
+  assert(CountMinEstimate(cms, "never-added") <= 2 * total / 4096 * 4,
+         "Keys never added should estimate near zero");
+
+  assert(CountMinAdd(cms, "key-0", 500) == 0, "CountMinAdd should not fail");
+  assert(CountMinEstimate(cms, "key-0") >= 1500, "Counts should add up");
+
+  DestroyCountMinSketch(cms);
+  printf("TestCountMinSketch passed\n");
+}
+
+void TestCountMinSaturation() {
+  int widths[] = {1, 2, 4};
+  for (int i = 0; i < 3; i++) {
+    CountMinSketch *cms = NewCountMinSketch(64, 2, widths[i], false);
+    uint64_t max = CountMinMax(cms);
+    assert(max == (1ULL << (8 * widths[i])) - 1, "CountMinMax");
+
+    CountMinAdd(cms, "hot", max - 1);
+    CountMinAdd(cms, "hot", 10);
+    assert(CountMinEstimate(cms, "hot") == max,
+           "Counters should saturate instead of wrapping");
+    CountMinAdd(cms, "hot", 1);
+    assert(CountMinEstimate(cms, "hot") == max, "Saturated counters stay");
+    DestroyCountMinSketch(cms);
+  }
+  printf("TestCountMinSaturation passed\n");
+}
+
+void TestCountMinConservative() {
+  // A small sketch, so that keys collide a lot.
+  CountMinSketch *plain = NewCountMinSketch(64, 3, 4, false);
+  CountMinSketch *cons = NewCountMinSketch(64, 3, 4, true);
+  addSkewed(plain);
+  addSkewed(cons);
+
+  char key[32];
+  uint64_t plain_err = 0, cons_err = 0;
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    uint64_t p = CountMinEstimate(plain, key);
+    uint64_t c = CountMinEstimate(cons, key);
+    assert(c >= skewCount(i), "Conservative update should never undercount");
+    assert(c <= p, "Conservative update should never be looser");
+    plain_err += p - skewCount(i);
+    cons_err += c - skewCount(i);
+  }
+  printf("Total overcount: %" PRIu64 " plain, %" PRIu64 " conservative\n",
+         plain_err, cons_err);
+  assert(cons_err < plain_err, "Conservative update should be tighter");
+
+  DestroyCountMinSketch(plain);
+  DestroyCountMinSketch(cons);
+  printf("TestCountMinConservative passed\n");
+}
+
+void TestCountMinBatch() {
+  enum { N = 1000, WIDTH = 16 };
+  uint8_t *keys = malloc(N * WIDTH);
+  uint64_t *counts = malloc(N * sizeof(uint64_t));
+  uint64_t *est = malloc(N * sizeof(uint64_t));
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (int i = 0; i < N * WIDTH / 8; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    memcpy(keys + i * 8, &x, 8);
+  }
+  for (int i = 0; i < N; i++) {
+    counts[i] = (uint64_t)(i % 7) + 1;
+  }
+
+  for (int conservative = 0; conservative < 2; conservative++) {
+    CountMinSketch *batch = NewCountMinSketch(1024, 4, 2, conservative);
+    CountMinSketch *single = NewCountMinSketch(1024, 4, 2, conservative);
+    assert(CountMinAddBatch(batch, keys, WIDTH, N, counts) == 0,
+           "CountMinAddBatch should not fail");
+    assert(CountMinAddBatch(batch, keys, WIDTH, N, NULL) == 0,
+           "CountMinAddBatch should not fail");
+    for (int i = 0; i < N; i++) {
+      CountMinAddBatch(single, keys + i * WIDTH, WIDTH, 1, &counts[i]);
+    }
+    for (int i = 0; i < N; i++) {
+      CountMinAddBatch(single, keys + i * WIDTH, WIDTH, 1, NULL);
+    }
+
+    assert(CountMinEstimateBatch(batch, keys, WIDTH, N, est) == 0,
+           "CountMinEstimateBatch should not fail");
+    for (int i = 0; i < N; i++) {
+      assert(est[i] >= counts[i] + 1, "Batch estimates should not undercount");
+    }
+    assert(memcmp(batch->counters, single->counters,
+                  batch->row_bytes * batch->depth) == 0,
+           "Batched and one-by-one adds should give the same counters");
+
+    DestroyCountMinSketch(batch);
+    DestroyCountMinSketch(single);
+  }
+
+  free(keys);
+  free(counts);
+  free(est);
+  printf("TestCountMinBatch passed\n");
+}
+
+void TestCountMinWriteLoad() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-cms-%d.cms", (int)getpid());
+
+  CountMinSketch *cms = NewCountMinSketch(4096, 4, 2, true);
+  addSkewed(cms);
+  assert(CountMinWrite(cms, path) == 0, "CountMinWrite should not fail");
+
+  CountMinSketch *loaded = CountMinLoad(path);
+  assert(loaded != NULL, "CountMinLoad should not return NULL");
+  assert(loaded->width == 4096 && loaded->depth == 4 &&
+             loaded->counter_bytes == 2 && loaded->conservative,
+         "Sketch parameters should round trip");
+  assert(memcmp(loaded->counters, cms->counters, 4096 * 2 * 4) == 0,
+         "Counters should round trip");
+
+  // Merging the same counts twice doubles every estimate.
+  assert(MergeCountMinSketch(loaded, path) == 0,
+         "MergeCountMinSketch should not fail");
+  assert(CountMinEstimate(loaded, "key-0") ==
+             2 * CountMinEstimate(cms, "key-0"),
+         "Merged counters should add");
+
+  // A narrower sketch folds the file down to its width.
+  CountMinSketch *narrow = NewCountMinSketch(1024, 4, 2, true);
+  assert(MergeCountMinSketch(narrow, path) == 0,
+         "MergeCountMinSketch of different widths should not fail");
+  assert(narrow->width == 1024, "Narrower sketch should keep its width");
+  char key[32];
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(CountMinEstimate(narrow, key) >= skewCount(i),
+           "Folded estimates should never undercount");
+  }
+
+  // A wider one has to be folded to match first.
+  CountMinSketch *wide = NewCountMinSketch(16384, 4, 2, true);
+  CountMinAdd(wide, "key-0", 7);
+  assert(MergeCountMinSketch(wide, path) != 0,
+         "MergeCountMinSketch should not fold the sketch merged into");
+  assert(wide->width == 16384, "A refused merge should keep the width");
+  assert(FoldCountMinSketch(wide, 4) == 0,
+         "FoldCountMinSketch should not fail");
+  assert(MergeCountMinSketch(wide, path) == 0,
+         "MergeCountMinSketch of equal widths should not fail");
+  assert(CountMinEstimate(wide, "key-0") >= 1007,
+         "Both sketches' counts should survive");
+
+  // Or merged with the folding variant, which does both under one lock.
+  CountMinSketch *folding = NewCountMinSketch(16384, 4, 2, true);
+  CountMinAdd(folding, "key-0", 7);
+  assert(MergeCountMinSketchFolding(folding, path) == 0,
+         "MergeCountMinSketchFolding should not fail");
+  assert(folding->width == 4096, "Sketch should be folded to the file's");
+  assert(CountMinEstimate(folding, "key-0") >= 1007,
+         "Both sketches' counts should survive");
+  DestroyCountMinSketch(folding);
+
+  CountMinSketch *other = NewCountMinSketch(4096, 3, 2, true);
+  assert(MergeCountMinSketch(other, path) != 0,
+         "MergeCountMinSketch of different depths should fail");
+
+  DestroyCountMinSketch(other);
+  DestroyCountMinSketch(wide);
+  DestroyCountMinSketch(narrow);
+  DestroyCountMinSketch(loaded);
+  DestroyCountMinSketch(cms);
+  unlink(path);
+  printf("TestCountMinWriteLoad passed\n");
+}
+
+typedef struct ShardWorker {
+  CountMinShards *shards;
+  int id;
+  pthread_t thread;
+} ShardWorker;
+
+static void *runShardWorker(void *arg) {
+  ShardWorker *w = arg;
+  CountMinSketch *cms = CountMinShard(w->shards, w->id);
+  char key[32];
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    for (uint64_t c = 0; c < skewCount(i); c++) {
+      CountMinAdd(cms, key, 1);
+    }
+  }
+  return NULL;
+}
+
+void TestCountMinShards() {
+  enum { THREADS = 4 };
+  CountMinShards *shards = NewCountMinShards(THREADS, 4096, 4, 4, false);
+  assert(shards != NULL, "NewCountMinShards should not return NULL");
+
+  ShardWorker workers[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    workers[i].shards = shards;
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, runShardWorker, &workers[i]);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  CountMinSketch *all = CollapseCountMinShards(shards);
+  assert(all != NULL, "CollapseCountMinShards should not return NULL");
+  char key[32];
+  for (int i = 0; i < SKEW_KEYS; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    uint64_t est = CountMinShardsEstimate(shards, key);
+    assert(est >= THREADS * skewCount(i),
+           "Shard estimates should never undercount");
+    assert(est <= CountMinEstimate(all, key),
+           "Summed shard estimates should be at least as tight");
+  }
+
+  DestroyCountMinSketch(all);
+  DestroyCountMinShards(shards);
+  printf("TestCountMinShards passed\n");
+}
@@ -0,0 +1,508 @@
+#include "hyperbloom.h"
+#include "chunkio.h"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/**
+ * Generates the operations table for a backend: thin wrappers that cast the
+ * filter back to the backend's type and call its functions. `div` turns the
+ * filter size in bits into the length of its vector in bytes.
+ */
+#define HYPERBLOOM_BACKEND(id, lay, nm, knd, T, New, Destroy, Insert, Lookup, \
+                           InsertBatch, LookupBatch, Write, Load, LoadFolded,  \
+                           Merge, MergeFolding, Fold, FillRatio, FoldFactor,   \
+                           div)                                                \
+  static void *id##Create(uint64_t size, int hf) { return New(size, hf); }     \
+  static void id##Destroy(void *f) { Destroy((T *)f); }                        \
+  static int id##Insert(void *f, const char *e) { return Insert((T *)f, e); }  \
+  static bool id##Lookup(void *f, const char *e) { return Lookup((T *)f, e); } \
+  static int id##InsertBatch(void *f, const uint8_t *k, size_t w, size_t n) {  \
+    return InsertBatch((T *)f, k, w, n);                                       \
+  }                                                                            \
+  static int id##LookupBatch(void *f, const uint8_t *k, size_t w, size_t n,    \
+                             bool *out) {                                      \
+    return LookupBatch((T *)f, k, w, n, out);                                  \
+  }                                                                            \
+  static int id##Write(void *f, const char *fn) { return Write((T *)f, fn); }  \
+  static void *id##Load(const char *fn) { return Load(fn); }                   \
+  static void *id##LoadFolded(const char *fn, uint64_t factor, double fpr) {   \
+    return LoadFolded(fn, factor, fpr);                                        \
+  }                                                                            \
+  static int id##Merge(void *f, const char *fn) { return Merge((T *)f, fn); }  \
+  static int id##MergeFolding(void *f, const char *fn) {                       \
+    return MergeFolding((T *)f, fn);                                           \
+  }                                                                            \
+  static int id##Fold(void *f, uint64_t factor) {                             \
+    return Fold((T *)f, factor);                                               \
+  }                                                                            \
+  static double id##FillRatio(void *f) { return FillRatio((T *)f); }          \
+  static uint64_t id##FoldFactor(void *f, double fpr) {                        \
+    return FoldFactor((T *)f, fpr);                                            \
+  }                                                                            \
+  static void id##Params(void *f, uint64_t *size, int *hf) {                   \
+    *size = ((T *)f)->size;                                                    \
+    *hf = ((T *)f)->hf;                                                        \
+  }                                                                            \
+  static void *id##Vector(void *f, uint64_t *len) {                            \
+    *len = ((T *)f)->size / (div);                                             \
+    return ((T *)f)->bv;                                                       \
+  }                                                                            \
+  static const HyperBloomOps id##Ops = {                                       \
+      .layout = lay,                                                           \
+      .name = nm,                                                              \
+      .kind = knd,                                                             \
+      .create = id##Create,                                                    \
+      .destroy = id##Destroy,                                                  \
+      .insert = id##Insert,                                                    \
+      .lookup = id##Lookup,                                                    \
+      .insertBatch = id##InsertBatch,                                          \
+      .lookupBatch = id##LookupBatch,                                          \
+      .write = id##Write,                                                      \
+      .load = id##Load,                                                        \
+      .loadFolded = id##LoadFolded,                                            \
+      .merge = id##Merge,                                                      \
+      .mergeFolding = id##MergeFolding,                                        \
+      .fold = id##Fold,                                                        \
+      .fillRatio = id##FillRatio,                                              \
+      .foldFactor = id##FoldFactor,                                            \
+      .params = id##Params,                                                    \
+      .vector = id##Vector,                                                    \
+  };
+
+HYPERBLOOM_BACKEND(bit, HB_LAYOUT_BIT, "bit", CHUNKED_KIND_BLOOM, BloomFilter,
+                   NewBloomFilter, DestroyBloomFilter, Insert, Lookup,
+                   InsertBatch, LookupBatch, Write, Load, LoadFolded,
+                   MergeBloomFilter, MergeBloomFilterFolding, FoldBloomFilter,
+                   BloomFillRatio, BloomFoldFactor, 8)
+
+HYPERBLOOM_BACKEND(byte, HB_LAYOUT_BYTE, "byte", CHUNKED_KIND_NAIVE,
+                   NaiveBloomFilter, NewNaiveBloomFilter,
+                   DestroyNaiveBloomFilter, NaiveInsert, NaiveLookup,
+                   NaiveInsertBatch, NaiveLookupBatch, NaiveWrite, NaiveLoad,
+                   NaiveLoadFolded, MergeNaiveBloomFilter,
+                   MergeNaiveBloomFilterFolding, FoldNaiveBloomFilter,
+                   NaiveFillRatio, NaiveFoldFactor, 1)
+
+HYPERBLOOM_BACKEND(blocked, HB_LAYOUT_BLOCKED, "blocked", CHUNKED_KIND_BLOCKED,
+                   BlockedBloomFilter, NewBlockedBloomFilter,
+                   DestroyBlockedBloomFilter, BlockedInsert, BlockedLookup,
+                   BlockedInsertBatch, BlockedLookupBatch, BlockedWrite,
+                   BlockedLoad, BlockedLoadFolded, MergeBlockedBloomFilter,
+                   MergeBlockedBloomFilterFolding, FoldBlockedBloomFilter,
+                   BlockedFillRatio, BlockedFoldFactor, 8)
+
+static const HyperBloomOps *backends[] = {&bitOps, &byteOps, &blockedOps};
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static const HyperBloomOps *opsForLayout(HyperBloomLayout layout) {
+  for (size_t i = 0; i < NBACKENDS; i++) {
+    if (backends[i]->layout == layout) {
+      return backends[i];
+    }
+  }
+  return NULL;
+}
+
+static const HyperBloomOps *opsForKind(uint32_t kind) {
+  for (size_t i = 0; i < NBACKENDS; i++) {
+    if (backends[i]->kind == kind) {
+      return backends[i];
+    }
+  }
+  return NULL;
+}
+
+const char *HyperBloomLayoutName(HyperBloomLayout layout) {
+  switch (layout) {
+  case HB_LAYOUT_AUTO:
+    return "auto";
+  case HB_LAYOUT_CALIBRATE:
+    return "calibrate";
+  default: {
+    const HyperBloomOps *ops = opsForLayout(layout);
+    return ops ? ops->name : "unknown";
+  }
+  }
+}
+
+/**
+ * Size of a cache from its sysfs description, e.g. "48K" or "32M".
+ */
+static uint64_t parseCacheSize(const char *s) {
+  char *end;
+  uint64_t n = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'K':
+    return n << 10;
+  case 'M':
+    return n << 20;
+  case 'G':
+    return n << 30;
+  default:
+    return n;
+  }
+}
+
+static int readSysfs(int index, const char *name, char *buf, size_t len) {
+  char path[96];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/%s",
+           index, name);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int rc = fgets(buf, len, f) != NULL ? 0 : -1;
+  fclose(f);
+  return rc;
+}
+
+/**
+ * Fill in the levels sysconf didn't report from sysfs. Instruction caches
+ * are skipped; the highest level found is the last level cache.
+ */
+static void detectSysfs(HyperBloomCaches *c) {
+  uint64_t levels[5] = {0};
+  int highest = 0;
+  char buf[32];
+
+  for (int index = 0; index < 16; index++) {
+    if (readSysfs(index, "level", buf, sizeof(buf)) != 0) {
+      break;
+    }
+    int level = atoi(buf);
+    if (readSysfs(index, "type", buf, sizeof(buf)) != 0 ||
+        strncmp(buf, "Instruction", 11) == 0 || level < 1 || level > 4 ||
+        readSysfs(index, "size", buf, sizeof(buf)) != 0) {
+      continue;
+    }
+    levels[level] = parseCacheSize(buf);
+    if (level > highest) {
+      highest = level;
+    }
+  }
+
+  if (c->l1 == 0) {
+    c->l1 = levels[1];
+  }
+  if (c->l2 == 0) {
+    c->l2 = levels[2];
+  }
+  if (c->llc == 0 && highest > 0) {
+    c->llc = levels[highest];
+  }
+}
+
+static HyperBloomCaches detectedCaches;
+static pthread_once_t cachesOnce = PTHREAD_ONCE_INIT;
+
+static void detectCaches(void) {
+  HyperBloomCaches c = {0};
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+  long v = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  c.l1 = v > 0 ? (uint64_t)v : 0;
+  v = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  c.l2 = v > 0 ? (uint64_t)v : 0;
+  v = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  c.llc = v > 0 ? (uint64_t)v : 0;
+#endif
+  if (c.l1 == 0 || c.l2 == 0 || c.llc == 0) {
+    detectSysfs(&c);
+  }
+
+  // Conservative defaults for whatever is still unknown.
+  if (c.l1 == 0) {
+    c.l1 = 32 << 10;
+  }
+  if (c.l2 == 0) {
+    c.l2 = 256 << 10;
+  }
+  if (c.llc == 0) {
+    c.llc = c.l2 > (8 << 20) ? c.l2 : 8 << 20;
+  }
+  detectedCaches = c;
+}
+
+void DetectHyperBloomCaches(HyperBloomCaches *caches) {
+  pthread_once(&cachesOnce, detectCaches);
+  *caches = detectedCaches;
+}
+
+HyperBloomLayout ChooseHyperBloomLayout(uint64_t size, int hf) {
+  HyperBloomCaches c;
+  DetectHyperBloomCaches(&c);
+
+  if (size <= c.l2) {
+    return HB_LAYOUT_BYTE;
+  }
+  if (size / 8 <= c.llc || hf <= 1 || size < BLOCKED_BLOCK_BITS) {
+    return HB_LAYOUT_BIT;
+  }
+  return HB_LAYOUT_BLOCKED;
+}
+
+/**
+ * Calibration run: keys inserted, then twice as many looked up (half of them
+ * present), best of a few rounds.
+ */
+#define CALIBRATE_KEYS 4096
+#define CALIBRATE_WIDTH 16
+#define CALIBRATE_ROUNDS 3
+
+static uint64_t nowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Time lookups against a fresh filter in one layout. Returns UINT64_MAX if
+ * the filter can't be created.
+ */
+static uint64_t timeLayout(const HyperBloomOps *ops, uint64_t size, int hf,
+                           const uint8_t *keys, bool *found) {
+  void *filter = ops->create(size, hf);
+  if (filter == NULL) {
+    return UINT64_MAX;
+  }
+
+  // Fault every page in, so lookups hit real memory rather than the shared
+  // zero page an untouched allocation maps to.
+  uint64_t len;
+  void *vector = ops->vector(filter, &len);
+  memset(vector, 0, len);
+
+  ops->insertBatch(filter, keys, CALIBRATE_WIDTH, CALIBRATE_KEYS);
+  uint64_t best = UINT64_MAX;
+  for (int round = 0; round < CALIBRATE_ROUNDS; round++) {
+    uint64_t start = nowNanos();
+    ops->lookupBatch(filter, keys, CALIBRATE_WIDTH, 2 * CALIBRATE_KEYS, found);
+    uint64_t elapsed = nowNanos() - start;
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+
+  ops->destroy(filter);
+  return best;
+}
+
+HyperBloomLayout CalibrateHyperBloomLayout(uint64_t size, int hf) {
+  HyperBloomCaches c;
+  DetectHyperBloomCaches(&c);
+  if (size / 8 > 4 * c.llc) {
+    return ChooseHyperBloomLayout(size, hf);
+  }
+
+  uint8_t *keys = malloc(2 * CALIBRATE_KEYS * CALIBRATE_WIDTH);
+  bool *found = malloc(2 * CALIBRATE_KEYS * sizeof(bool));
+  if (keys == NULL || found == NULL) {
+    perror("Failed to allocate calibration keys");
+    free(keys);
+    free(found);
+    return ChooseHyperBloomLayout(size, hf);
+  }
+
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < 2 * CALIBRATE_KEYS * CALIBRATE_WIDTH / 8; i++) {
+    x ^= x << 13; // xorshift64
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(keys + i * 8, &x, 8);
+  }
+
+  HyperBloomLayout best = ChooseHyperBloomLayout(size, hf);
+  uint64_t best_ns = UINT64_MAX;
+  for (size_t i = 0; i < NBACKENDS; i++) {
+    const HyperBloomOps *ops = backends[i];
+    // The byte vector is `size` bytes, 8x the bit vector. Past four times
+    // the LLC nearly every probe misses, the same bound that skips timing
+    // altogether for the bit vector above, so it isn't worth allocating.
+    // Below that enough of it stays cached that only timing can tell.
+    if ((ops->layout == HB_LAYOUT_BYTE && size > 4 * c.llc) ||
+        (ops->layout == HB_LAYOUT_BLOCKED && size < BLOCKED_BLOCK_BITS)) {
+      continue;
+    }
+    uint64_t ns = timeLayout(ops, size, hf, keys, found);
+    if (ns < best_ns) {
+      best_ns = ns;
+      best = ops->layout;
+    }
+  }
+
+  free(found);
+  free(keys);
+  return best;
+}
+
+/**
+ * Wrap a backend filter in a handle.
+ */
+static HyperBloom *wrap(const HyperBloomOps *ops, void *filter) {
+  HyperBloom *hb = malloc(sizeof(HyperBloom));
+  if (hb == NULL) {
+    perror("Failed to allocate hyperbloom.");
+    ops->destroy(filter);
+    return NULL;
+  }
+
+  hb->ops = ops;
+  hb->filter = filter;
+  ops->params(filter, &hb->size, &hb->hf);
+  return hb;
+}
+
+HyperBloom *NewHyperBloom(uint64_t size, int hf, HyperBloomLayout layout) {
+  if (layout == HB_LAYOUT_AUTO) {
+    layout = ChooseHyperBloomLayout(size, hf);
+  } else if (layout == HB_LAYOUT_CALIBRATE) {
+    layout = CalibrateHyperBloomLayout(size, hf);
+  }
+
+  const HyperBloomOps *ops = opsForLayout(layout);
+  if (ops == NULL) {
+    fprintf(stderr, "Unknown filter layout %d\n", (int)layout);
+    return NULL;
+  }
+
+  void *filter = ops->create(size, hf);
+  if (filter == NULL) {
+    return NULL;
+  }
+  return wrap(ops, filter);
+}
+
+void DestroyHyperBloom(HyperBloom *hb) {
+  if (hb) {
+    hb->ops->destroy(hb->filter);
+    free(hb);
+  }
+}
+
+int HyperInsert(HyperBloom *hb, const char *entry) {
+  return hb->ops->insert(hb->filter, entry);
+}
+
+bool HyperLookup(HyperBloom *hb, const char *entry) {
+  return hb->ops->lookup(hb->filter, entry);
+}
+
+int HyperInsertBatch(HyperBloom *hb, const uint8_t *keys, size_t width,
+                     size_t n) {
+  return hb->ops->insertBatch(hb->filter, keys, width, n);
+}
+
+int HyperLookupBatch(HyperBloom *hb, const uint8_t *keys, size_t width,
+                     size_t n, bool *out) {
+  return hb->ops->lookupBatch(hb->filter, keys, width, n, out);
+}
+
+int HyperWrite(HyperBloom *hb, const char *filename) {
+  return hb->ops->write(hb->filter, filename);
+}
+
+/**
+ * The backend an unchunked file was written by. Both BloomFilter and
+ * NaiveBloomFilter used to write the size, the number of hash functions and
+ * then the raw vector, so only the file's length tells a bit vector from a
+ * byte vector.
+ */
+static const HyperBloomOps *opsForLegacyFile(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror("Failed to open file for reading");
+    return NULL;
+  }
+  uint64_t size;
+  struct stat st;
+  int ok = fread(&size, sizeof(size), 1, f) == 1 && fstat(fileno(f), &st) == 0;
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "%s: not a bloom filter file\n", filename);
+    return NULL;
+  }
+
+  uint64_t header = sizeof(uint64_t) + sizeof(int);
+  if (size > 0 && (uint64_t)st.st_size == header + size / 8) {
+    return &bitOps;
+  }
+  if (size > 0 && (uint64_t)st.st_size == header + size) {
+    return &byteOps;
+  }
+  fprintf(stderr, "%s: not a bloom filter file (%llu bytes for %llu bits)\n",
+          filename, (unsigned long long)st.st_size, (unsigned long long)size);
+  return NULL;
+}
+
+/**
+ * The backend a filter file was written by, from its chunked file kind, or
+ * from its length for unchunked files, which predate layouts.
+ */
+static const HyperBloomOps *opsForFile(const char *filename) {
+  BloomFileMeta meta;
+  ChunkedFile *cf =
+      OpenChunkedFile(filename, CHUNKED_KIND_ANY, &meta, sizeof(meta));
+  if (cf == NULL) {
+    return errno == EILSEQ ? opsForLegacyFile(filename) : NULL;
+  }
+
+  uint32_t kind = cf->hdr.kind;
+  CloseChunkedFile(cf);
+  const HyperBloomOps *ops = opsForKind(kind);
+  if (ops == NULL) {
+    fprintf(stderr, "%s: not a bloom filter file (kind %u)\n", filename, kind);
+  }
+  return ops;
+}
+
+HyperBloom *HyperLoad(const char *filename) {
+  const HyperBloomOps *ops = opsForFile(filename);
+  if (ops == NULL) {
+    return NULL;
+  }
+
+  void *filter = ops->load(filename);
+  if (filter == NULL) {
+    return NULL;
+  }
+  return wrap(ops, filter);
+}
+
+HyperBloom *HyperLoadFolded(const char *filename, uint64_t factor,
+                            double target_fpr) {
+  const HyperBloomOps *ops = opsForFile(filename);
+  if (ops == NULL) {
+    return NULL;
+  }
+
+  void *filter = ops->loadFolded(filename, factor, target_fpr);
+  if (filter == NULL) {
+    return NULL;
+  }
+  return wrap(ops, filter);
+}
+
+int MergeHyperBloom(HyperBloom *hb, const char *filename) {
+  return hb->ops->merge(hb->filter, filename);
+}
+
+int MergeHyperBloomFolding(HyperBloom *hb, const char *filename) {
+  int rc = hb->ops->mergeFolding(hb->filter, filename);
+  hb->ops->params(hb->filter, &hb->size, &hb->hf);
+  return rc;
+}
+
+int HyperFold(HyperBloom *hb, uint64_t factor) {
+  int rc = hb->ops->fold(hb->filter, factor);
+  hb->ops->params(hb->filter, &hb->size, &hb->hf);
+  return rc;
+}
+
+double HyperFillRatio(HyperBloom *hb) {
+  return hb->ops->fillRatio(hb->filter);
+}
+
+uint64_t HyperFoldFactor(HyperBloom *hb, double target_fpr) {
+  return hb->ops->foldFactor(hb->filter, target_fpr);
+}
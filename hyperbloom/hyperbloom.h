@@ -0,0 +1,206 @@
+#ifndef HYPERBLOOM_H
+#define HYPERBLOOM_H
+
+#include "blocked.h"
+#include "bloom.h"
+#include "naive.h"
+
+/**
+ * HyperBloom is a single handle over the filter layouts in this repository,
+ * so one process can keep small hot filters in the byte layout and large ones
+ * in a bit or blocked layout. Each layout is a backend behind a table of
+ * operations; the handle forwards every call to its backend's table.
+ *
+ * Files written through a HyperBloom record the layout in the file header
+ * (as the chunked file kind, see chunkio.h), and HyperLoad picks the backend
+ * from it. Each backend's own Write/Load produce and accept the same files.
+ */
+
+/**
+ * Filter layouts a HyperBloom can use.
+ */
+typedef enum HyperBloomLayout {
+  HB_LAYOUT_AUTO = 0,  // Pick from the filter size and the CPU cache sizes
+  HB_LAYOUT_BIT,       // bloom/bloom.h BloomFilter
+  HB_LAYOUT_BYTE,      // naive-bloom/naive.h NaiveBloomFilter
+  HB_LAYOUT_BLOCKED,   // blocked-bloom/blocked.h BlockedBloomFilter
+  HB_LAYOUT_CALIBRATE, // Time the candidate layouts briefly, keep the fastest
+} HyperBloomLayout;
+
+/**
+ * Operations a backend provides. `filter` is the backend's own filter type.
+ */
+typedef struct HyperBloomOps {
+  HyperBloomLayout layout;
+  const char *name;
+  uint32_t kind; // CHUNKED_KIND_* of the backend's files
+
+  void *(*create)(uint64_t size, int hf);
+  void (*destroy)(void *filter);
+  int (*insert)(void *filter, const char *entry);
+  bool (*lookup)(void *filter, const char *entry);
+  int (*insertBatch)(void *filter, const uint8_t *keys, size_t width,
+                     size_t n);
+  int (*lookupBatch)(void *filter, const uint8_t *keys, size_t width,
+                     size_t n, bool *out);
+  int (*write)(void *filter, const char *filename);
+  void *(*load)(const char *filename);
+  void *(*loadFolded)(const char *filename, uint64_t factor,
+                      double target_fpr);
+  int (*merge)(void *filter, const char *filename);
+  int (*mergeFolding)(void *filter, const char *filename);
+  int (*fold)(void *filter, uint64_t factor);
+  double (*fillRatio)(void *filter);
+  uint64_t (*foldFactor)(void *filter, double target_fpr);
+
+  /**
+   * The backend's size in bits and number of hash functions.
+   */
+  void (*params)(void *filter, uint64_t *size, int *hf);
+
+  /**
+   * The backend's bit or byte vector and its length in bytes.
+   */
+  void *(*vector)(void *filter, uint64_t *len);
+} HyperBloomOps;
+
+typedef struct HyperBloom {
+  const HyperBloomOps *ops;
+  void *filter;  // Backend filter
+  uint64_t size; // Size of the filter in bits
+  int hf;        // Number of hash functions
+} HyperBloom;
+
+/**
+ * Cache sizes in bytes. Zero when a level couldn't be detected.
+ */
+typedef struct HyperBloomCaches {
+  uint64_t l1;  // L1 data cache, per core
+  uint64_t l2;  // L2 cache, per core
+  uint64_t llc; // Last level cache
+} HyperBloomCaches;
+
+/**
+ * Detect the cache sizes of the CPU this process runs on, from sysconf with a
+ * fallback to /sys/devices/system/cpu/cpu0/cache. Levels that can't be
+ * detected are filled in with conservative defaults (32K, 256K, 8M).
+ */
+void DetectHyperBloomCaches(HyperBloomCaches *caches);
+
+/**
+ * The layout HB_LAYOUT_AUTO picks for a filter of `size` bits:
+ *
+ * - byte, while the byte vector (`size` bytes) fits in L2;
+ * - bit, while the bit vector fits in the last level cache;
+ * - blocked beyond that, since every lookup would otherwise miss the cache
+ *   once per hash function, unless there is only one hash function.
+ */
+HyperBloomLayout ChooseHyperBloomLayout(uint64_t size, int hf);
+
+/**
+ * Time each candidate layout for a filter of `size` bits on a short run of
+ * inserts and lookups and return the fastest. Filters whose bit vector is
+ * larger than four times the last level cache aren't timed (every layout
+ * misses the cache there); ChooseHyperBloomLayout decides instead.
+ */
+HyperBloomLayout CalibrateHyperBloomLayout(uint64_t size, int hf);
+
+/**
+ * Name of a layout ("auto", "bit", "byte", "blocked", "calibrate").
+ */
+const char *HyperBloomLayoutName(HyperBloomLayout layout);
+
+/**
+ * Create a filter of `size` bits with `hf` hash functions in the given
+ * layout. HB_LAYOUT_AUTO and HB_LAYOUT_CALIBRATE resolve to a concrete layout
+ * first; the handle's ops->layout says which one was picked.
+ */
+HyperBloom *NewHyperBloom(uint64_t size, int hf, HyperBloomLayout layout);
+
+/**
+ * Free a filter and its backend.
+ */
+void DestroyHyperBloom(HyperBloom *hb);
+
+/**
+ * Inserts an entry into the filter.
+ */
+int HyperInsert(HyperBloom *hb, const char *entry);
+
+/**
+ * Looks up an entry in the filter.
+ */
+bool HyperLookup(HyperBloom *hb, const char *entry);
+
+/**
+ * Inserts `n` fixed-width keys laid out back to back in `keys`.
+ */
+int HyperInsertBatch(HyperBloom *hb, const uint8_t *keys, size_t width,
+                     size_t n);
+
+/**
+ * Looks up `n` fixed-width keys laid out back to back in `keys`.
+ */
+int HyperLookupBatch(HyperBloom *hb, const uint8_t *keys, size_t width,
+                     size_t n, bool *out);
+
+/**
+ * Flushes the filter to a file through its backend.
+ */
+int HyperWrite(HyperBloom *hb, const char *filename);
+
+/**
+ * Reads a filter written by HyperWrite or by any backend's own Write, in the
+ * layout recorded in the file. Files in the original unchunked layout predate
+ * layouts; their length tells whether they hold a bit or a byte vector, and a
+ * file matching neither is refused.
+ */
+HyperBloom *HyperLoad(const char *filename);
+
+/**
+ * Like HyperLoad, folding the filter by `factor` (see LoadFolded in bloom.h).
+ */
+HyperBloom *HyperLoadFolded(const char *filename, uint64_t factor,
+                            double target_fpr);
+
+/**
+ * Merge a filter file of the same layout and hash functions into `hb`. A
+ * larger filter in the file is folded down to the size of `hb`. A smaller one
+ * is refused; HyperFold `hb` down to its size first, or use
+ * MergeHyperBloomFolding, to merge it.
+ */
+int MergeHyperBloom(HyperBloom *hb, const char *filename);
+
+/**
+ * Like MergeHyperBloom, but a smaller filter in the file is merged by first
+ * folding `hb` down to its size (see HyperFold).
+ */
+int MergeHyperBloomFolding(HyperBloom *hb, const char *filename);
+
+/**
+ * Shrink the filter by a power of 2 `factor` (see FoldBloomFilter in
+ * bloom.h).
+ */
+int HyperFold(HyperBloom *hb, uint64_t factor);
+
+/**
+ * Fraction of the filter's bits (or bytes) that are set.
+ */
+double HyperFillRatio(HyperBloom *hb);
+
+/**
+ * The largest fold factor that keeps the estimated false positive rate at or
+ * under `target_fpr`.
+ */
+uint64_t HyperFoldFactor(HyperBloom *hb, double target_fpr);
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestHyperBloomCaches();
+void TestHyperBloomLayouts();
+void TestHyperBloomChoose();
+void TestHyperBloomWriteLoad();
+void TestHyperBloomFold();
+
+#endif // HYPERBLOOM_H
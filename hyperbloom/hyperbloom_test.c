@@ -0,0 +1,266 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunkio.h"
+#include "hyperbloom.h"
+
+int main() {
+  printf("Running tests...\n");
+  TestHyperBloomCaches();
+  TestHyperBloomLayouts();
+  TestHyperBloomChoose();
+  TestHyperBloomWriteLoad();
+  TestHyperBloomFold();
+  printf("All tests passed!\n");
+  return 0;
+}
+
+void TestHyperBloomCaches() {
+  HyperBloomCaches c;
+  DetectHyperBloomCaches(&c);
+  assert(c.l1 > 0 && c.l2 > 0 && c.llc > 0, "Cache sizes should be known");
+  assert(c.l1 <= c.l2 && c.l2 <= c.llc, "Caches should grow with level");
+  printf("Caches: L1 %" PRIu64 "K, L2 %" PRIu64 "K, LLC %" PRIu64 "K\n",
+         c.l1 >> 10, c.l2 >> 10, c.llc >> 10);
+  printf("TestHyperBloomCaches passed\n");
+}
+
+void TestHyperBloomLayouts() {
+  const char *entries[] = {"b99afb65c9f97b2e0feea844eea55f69",
+                           "f530e3093a1617d64f400c5578005b7c",
+                           "b29317ac342ceafc79e59996678efeb3",
+                           "00421829519ccc2834eedc2bac21df68"};
+  const char *fakes[] = {"hahaidontexist", "foobar", "turnips", "lavacakes"};
+  HyperBloomLayout layouts[] = {HB_LAYOUT_BIT, HB_LAYOUT_BYTE,
+                                HB_LAYOUT_BLOCKED};
+
+  // One binary, every layout side by side.
+  HyperBloom *hbs[3];
+  for (int l = 0; l < 3; l++) {
+    hbs[l] = NewHyperBloom(1048576, 4, layouts[l]);
+    assert(hbs[l] != NULL, "NewHyperBloom should not return NULL");
+    assert(hbs[l]->ops->layout == layouts[l], "Layout should be the one asked");
+    assert(hbs[l]->size == 1048576 && hbs[l]->hf == 4,
+           "Filter parameters should match");
+  }
+
+  for (int l = 0; l < 3; l++) {
+    HyperBloom *hb = hbs[l];
+    for (int i = 0; i < 2; i++) {
+      assert(HyperInsert(hb, entries[i]) == 0,
+             "HyperInsert should not return an error");
+    }
+    assert(HyperInsertBatch(hb, (const uint8_t *)entries[2], 32, 1) == 0,
+           "HyperInsertBatch should not return an error");
+    assert(HyperInsertBatch(hb, (const uint8_t *)entries[3], 32, 1) == 0,
+           "HyperInsertBatch should not return an error");
+
+    for (int i = 0; i < 4; i++) {
+      bool found;
+      assert(HyperLookup(hb, entries[i]), "Entry should exist in the filter");
+      assert(HyperLookupBatch(hb, (const uint8_t *)entries[i], 32, 1,
+                              &found) == 0,
+             "HyperLookupBatch should not return an error");
+      assert(found, "Entry should be found by HyperLookupBatch");
+      assert(!HyperLookup(hb, fakes[i]), "Fake should not exist in the filter");
+    }
+    printf("Layout %s ok\n", HyperBloomLayoutName(hb->ops->layout));
+  }
+
+  for (int l = 0; l < 3; l++) {
+    DestroyHyperBloom(hbs[l]);
+  }
+  assert(NewHyperBloom(1048576, 4, (HyperBloomLayout)42) == NULL,
+         "NewHyperBloom should reject unknown layouts");
+  printf("TestHyperBloomLayouts passed\n");
+}
+
+void TestHyperBloomChoose() {
+  HyperBloomCaches c;
+  DetectHyperBloomCaches(&c);
+
+  // Byte vector fits in L2.
+  assert(ChooseHyperBloomLayout(4096, 4) == HB_LAYOUT_BYTE,
+         "Tiny filters should use the byte layout");
+  // Bit vector fits in the LLC, byte vector doesn't fit in L2.
+  assert(ChooseHyperBloomLayout(c.l2 * 2, 4) == HB_LAYOUT_BIT,
+         "Cache sized filters should use the bit layout");
+  // Bit vector far past the LLC.
+  uint64_t huge = 1ULL << 40;
+  assert(ChooseHyperBloomLayout(huge, 4) == HB_LAYOUT_BLOCKED,
+         "Huge filters should use the blocked layout");
+  assert(ChooseHyperBloomLayout(huge, 1) == HB_LAYOUT_BIT,
+         "Blocking doesn't help a single hash function");
+
+  HyperBloom *hb = NewHyperBloom(4096, 4, HB_LAYOUT_AUTO);
+  assert(hb != NULL && hb->ops->layout == HB_LAYOUT_BYTE,
+         "HB_LAYOUT_AUTO should resolve to the chosen layout");
+  DestroyHyperBloom(hb);
+
+  hb = NewHyperBloom(1048576, 4, HB_LAYOUT_CALIBRATE);
+  assert(hb != NULL, "HB_LAYOUT_CALIBRATE should create a filter");
+  assert(hb->ops->layout != HB_LAYOUT_AUTO &&
+             hb->ops->layout != HB_LAYOUT_CALIBRATE,
+         "HB_LAYOUT_CALIBRATE should resolve to a concrete layout");
+  printf("Calibrated layout for 1048576 bits: %s\n",
+         HyperBloomLayoutName(hb->ops->layout));
+  DestroyHyperBloom(hb);
+
+  printf("TestHyperBloomChoose passed\n");
+}
+
+void TestHyperBloomWriteLoad() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-hb-%d.bf", (int)getpid());
+  HyperBloomLayout layouts[] = {HB_LAYOUT_BIT, HB_LAYOUT_BYTE,
+                                HB_LAYOUT_BLOCKED};
+
+  for (int l = 0; l < 3; l++) {
+    HyperBloom *hb = NewHyperBloom(65536, 3, layouts[l]);
+    assert(hb != NULL, "NewHyperBloom should not return NULL");
+    assert(HyperInsert(hb, "b99afb65c9f97b2e0feea844eea55f69") == 0,
+           "HyperInsert should not return an error");
+    assert(HyperWrite(hb, path) == 0, "HyperWrite should not fail");
+
+    // The layout comes back from the file header.
+    HyperBloom *loaded = HyperLoad(path);
+    assert(loaded != NULL, "HyperLoad should not return NULL");
+    assert(loaded->ops->layout == layouts[l], "Layout should round trip");
+    assert(loaded->size == 65536 && loaded->hf == 3,
+           "Filter parameters should round trip");
+    assert(HyperLookup(loaded, "b99afb65c9f97b2e0feea844eea55f69"),
+           "Inserted key should exist in the loaded filter");
+
+    assert(HyperInsert(loaded, "f530e3093a1617d64f400c5578005b7c") == 0,
+           "HyperInsert should not return an error");
+    assert(HyperWrite(loaded, path) == 0, "HyperWrite should not fail");
+    assert(MergeHyperBloom(hb, path) == 0, "MergeHyperBloom should not fail");
+    assert(HyperLookup(hb, "f530e3093a1617d64f400c5578005b7c"),
+           "Merged key should exist in the filter");
+
+    DestroyHyperBloom(loaded);
+    DestroyHyperBloom(hb);
+  }
+
+  // A file of one layout can't be merged into another.
+  HyperBloom *bit = NewHyperBloom(65536, 3, HB_LAYOUT_BIT);
+  HyperBloom *byte = NewHyperBloom(65536, 3, HB_LAYOUT_BYTE);
+  assert(HyperWrite(byte, path) == 0, "HyperWrite should not fail");
+  assert(MergeHyperBloom(bit, path) != 0,
+         "MergeHyperBloom across layouts should fail");
+  DestroyHyperBloom(byte);
+
+  // Unchunked files predate layouts. Their length tells a bit-vector filter
+  // from a byte-vector one.
+  FILE *f = fopen(path, "wb");
+  assert(f != NULL, "fopen should not fail");
+  int hf = bit->hf;
+  BloomFilter *bf = bit->filter;
+  Insert(bf, "b29317ac342ceafc79e59996678efeb3");
+  fwrite(&bf->size, sizeof(uint64_t), 1, f);
+  fwrite(&hf, sizeof(int), 1, f);
+  fwrite(bf->bv, sizeof(uint64_t), bf->size / 64, f);
+  fclose(f);
+
+  HyperBloom *legacy = HyperLoad(path);
+  assert(legacy != NULL && legacy->ops->layout == HB_LAYOUT_BIT,
+         "Legacy files should load as bit-vector filters");
+  assert(HyperLookup(legacy, "b29317ac342ceafc79e59996678efeb3"),
+         "Legacy filter should keep its entries");
+  DestroyHyperBloom(legacy);
+  DestroyHyperBloom(bit);
+
+  byte = NewHyperBloom(65536, 3, HB_LAYOUT_BYTE);
+  NaiveBloomFilter *nf = byte->filter;
+  NaiveInsert(nf, "b29317ac342ceafc79e59996678efeb3");
+  f = fopen(path, "wb");
+  assert(f != NULL, "fopen should not fail");
+  fwrite(&nf->size, sizeof(uint64_t), 1, f);
+  fwrite(&hf, sizeof(int), 1, f);
+  fwrite(nf->bv, 1, nf->size, f);
+  fclose(f);
+
+  legacy = HyperLoad(path);
+  assert(legacy != NULL && legacy->ops->layout == HB_LAYOUT_BYTE,
+         "Legacy byte-vector files should load as byte-vector filters");
+  assert(HyperLookup(legacy, "b29317ac342ceafc79e59996678efeb3"),
+         "Legacy filter should keep its entries");
+  DestroyHyperBloom(legacy);
+  DestroyHyperBloom(byte);
+
+  // An unchunked file of neither length is refused.
+  f = fopen(path, "ab");
+  assert(f != NULL, "fopen should not fail");
+  fputc(0, f);
+  fclose(f);
+  assert(HyperLoad(path) == NULL,
+         "A legacy file of the wrong length should not load");
+
+  unlink(path);
+  printf("TestHyperBloomWriteLoad passed\n");
+}
+
+void TestHyperBloomFold() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-hbfold-%d.bf", (int)getpid());
+  HyperBloomLayout layouts[] = {HB_LAYOUT_BIT, HB_LAYOUT_BYTE,
+                                HB_LAYOUT_BLOCKED};
+  char key[32];
+
+  for (int l = 0; l < 3; l++) {
+    HyperBloom *hb = NewHyperBloom(262144, 4, layouts[l]);
+    assert(hb != NULL, "NewHyperBloom should not return NULL");
+    for (int i = 0; i < 200; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      HyperInsert(hb, key);
+    }
+    assert(HyperWrite(hb, path) == 0, "HyperWrite should not fail");
+
+    uint64_t factor = HyperFoldFactor(hb, 0.01);
+    assert(factor > 1, "A sparse filter should fold");
+    assert(HyperFold(hb, factor) == 0, "HyperFold should not fail");
+    assert(hb->size == 262144 / factor, "Handle size should follow the fold");
+    assert(HyperFillRatio(hb) > 0, "Folded filter should not be empty");
+
+    HyperBloom *loaded = HyperLoadFolded(path, 0, 0.01);
+    assert(loaded != NULL, "HyperLoadFolded should not return NULL");
+    assert(loaded->ops->layout == layouts[l], "Layout should round trip");
+    assert(loaded->size == hb->size, "Automatic fold should pick the same");
+    for (int i = 0; i < 200; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      assert(HyperLookup(hb, key) && HyperLookup(loaded, key),
+             "Keys should survive folding");
+    }
+    DestroyHyperBloom(loaded);
+
+    // Merging the unfolded file into the folded filter folds the file.
+    HyperInsert(hb, "extra-key");
+    assert(MergeHyperBloom(hb, path) == 0, "MergeHyperBloom should not fail");
+    assert(hb->size == 262144 / factor, "Smaller filter should keep its size");
+    assert(HyperLookup(hb, "extra-key") && HyperLookup(hb, "key-7"),
+           "Merged filter should have both filters' keys");
+
+    // The other way round is refused rather than folding the destination.
+    HyperBloom *large = NewHyperBloom(262144, 4, layouts[l]);
+    assert(HyperWrite(hb, path) == 0, "HyperWrite should not fail");
+    assert(MergeHyperBloom(large, path) != 0,
+           "MergeHyperBloom of a smaller file should fail");
+    assert(large->size == 262144 && !HyperLookup(large, "extra-key"),
+           "A refused merge should leave the filter alone");
+    HyperInsert(large, "large-key");
+    assert(MergeHyperBloomFolding(large, path) == 0,
+           "MergeHyperBloomFolding of a smaller file should not fail");
+    assert(large->size == 262144 / factor,
+           "MergeHyperBloomFolding should fold the filter to the file's size");
+    assert(HyperLookup(large, "large-key") && HyperLookup(large, "extra-key"),
+           "Merged filter should have both filters' keys");
+    DestroyHyperBloom(large);
+    DestroyHyperBloom(hb);
+  }
+
+  unlink(path);
+  printf("TestHyperBloomFold passed\n");
+}
@@ -0,0 +1,349 @@
+#include "client.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+HBClient *HBConnect(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return NULL;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  HBClient *c = calloc(1, sizeof(HBClient));
+  if (c == NULL) {
+    perror("Failed to allocate client.");
+    return NULL;
+  }
+
+  c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (c->fd < 0 ||
+      connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("Failed to connect to hyperbloomd");
+    if (c->fd >= 0) {
+      close(c->fd);
+    }
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+void HBDisconnect(HBClient *c) {
+  if (c) {
+    close(c->fd);
+    free(c->out);
+    free(c->in);
+    free(c);
+  }
+}
+
+static int grow(uint8_t **buf, size_t *cap, size_t need) {
+  if (need <= *cap) {
+    return 0;
+  }
+  size_t ncap = *cap ? *cap : 4096;
+  while (ncap < need) {
+    ncap *= 2;
+  }
+  uint8_t *nbuf = realloc(*buf, ncap);
+  if (nbuf == NULL) {
+    perror("Failed to allocate client buffer.");
+    return -1;
+  }
+  *buf = nbuf;
+  *cap = ncap;
+  return 0;
+}
+
+static void put(HBClient *c, const void *data, size_t n) {
+  memcpy(c->out + c->out_len, data, n);
+  c->out_len += n;
+}
+
+static void putName(HBClient *c, const char *name) {
+  uint8_t len = (uint8_t)strlen(name);
+  put(c, &len, 1);
+  put(c, name, len);
+}
+
+/**
+ * Reserve room for a frame with `payload_len` bytes of payload, write its
+ * header and return its id, or -1 if it can't be sent.
+ */
+static int64_t beginFrame(HBClient *c, uint8_t op, uint8_t flags, size_t count,
+                          size_t payload_len) {
+  if (count > UINT16_MAX || payload_len > HB_MAX_FRAME) {
+    fprintf(stderr, "Frame too large: %zu keys, %zu bytes\n", count,
+            payload_len);
+    return -1;
+  }
+  if (grow(&c->out, &c->out_cap,
+           c->out_len + sizeof(HBFrameHeader) + payload_len) != 0) {
+    return -1;
+  }
+  HBFrameHeader hdr = {.len = (uint32_t)payload_len,
+                       .id = c->next_id++,
+                       .op = op,
+                       .flags = flags,
+                       .count = (uint16_t)count};
+  put(c, &hdr, sizeof(hdr));
+  return hdr.id;
+}
+
+static bool validName(const char *name) {
+  if (strlen(name) > 255) {
+    fprintf(stderr, "Filter name too long: %s\n", name);
+    return false;
+  }
+  return true;
+}
+
+int64_t HBSendKeys(HBClient *c, uint8_t op, const char *name,
+                   const char **keys, size_t n) {
+  if (!validName(name)) {
+    return -1;
+  }
+  size_t payload_len = 1 + strlen(name);
+  for (size_t i = 0; i < n; i++) {
+    size_t len = strlen(keys[i]);
+    if (len > UINT16_MAX) {
+      fprintf(stderr, "Key too long: %zu bytes\n", len);
+      return -1;
+    }
+    payload_len += sizeof(uint16_t) + len;
+    if (payload_len > HB_MAX_FRAME) {
+      break; // Refused by beginFrame; no need to measure the rest
+    }
+  }
+
+  int64_t id = beginFrame(c, op, 0, n, payload_len);
+  if (id < 0) {
+    return -1;
+  }
+  putName(c, name);
+  for (size_t i = 0; i < n; i++) {
+    uint16_t len = (uint16_t)strlen(keys[i]);
+    put(c, &len, sizeof(len));
+    put(c, keys[i], len);
+  }
+  return id;
+}
+
+int64_t HBSendFixed(HBClient *c, uint8_t op, const char *name,
+                    const uint8_t *keys, size_t width, size_t n) {
+  if (!validName(name)) {
+    return -1;
+  }
+  if (width == 0 || width > UINT16_MAX) {
+    fprintf(stderr, "Invalid key width: %zu\n", width);
+    return -1;
+  }
+
+  // Checked before multiplying, so a huge `n` can't wrap around.
+  size_t prefix_len = 1 + strlen(name) + sizeof(uint16_t);
+  if (n > (HB_MAX_FRAME - prefix_len) / width) {
+    fprintf(stderr, "Frame too large: %zu keys of %zu bytes\n", n, width);
+    return -1;
+  }
+  size_t payload_len = prefix_len + width * n;
+  int64_t id = beginFrame(c, op, HB_FLAG_FIXED, n, payload_len);
+  if (id < 0) {
+    return -1;
+  }
+  uint16_t w = (uint16_t)width;
+  putName(c, name);
+  put(c, &w, sizeof(w));
+  put(c, keys, width * n);
+  return id;
+}
+
+/**
+ * Appends what the socket has to the receive buffer, first dropping the
+ * responses HBRecv has already returned. Blocks for at least one byte if
+ * `wait` is set.
+ */
+static int fill(HBClient *c, bool wait) {
+  if (c->in_off > 0) {
+    memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+    c->in_len -= c->in_off;
+    c->in_off = 0;
+  }
+  if (grow(&c->in, &c->in_cap, c->in_len + 65536) != 0) {
+    return -1;
+  }
+
+  for (;;) {
+    ssize_t r = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len,
+                     wait ? 0 : MSG_DONTWAIT);
+    if (r > 0) {
+      c->in_len += (size_t)r;
+      return 0;
+    }
+    if (r == 0) {
+      fprintf(stderr, "hyperbloomd closed the connection\n");
+      return -1;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    perror("Failed to receive from hyperbloomd");
+    return -1;
+  }
+}
+
+int HBFlush(HBClient *c) {
+  size_t off = 0;
+  while (off < c->out_len) {
+    // The daemon stops reading a connection while its responses are still
+    // unsent, so take them in as they come rather than only once every frame
+    // is out; otherwise both sides can end up waiting on full sockets.
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN | POLLOUT};
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to wait for hyperbloomd");
+      return -1;
+    }
+    if ((pfd.revents & POLLIN) && fill(c, false) != 0) {
+      return -1;
+    }
+    if (pfd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+      ssize_t n = send(c->fd, c->out + off, c->out_len - off,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n >= 0) {
+        off += (size_t)n;
+      } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Failed to send to hyperbloomd");
+        return -1;
+      }
+    }
+  }
+  c->out_len = 0;
+  return 0;
+}
+
+int HBRecv(HBClient *c, HBResponse *rsp) {
+  HBFrameHeader hdr;
+  for (;;) {
+    size_t avail = c->in_len - c->in_off;
+    if (avail >= sizeof(hdr)) {
+      memcpy(&hdr, c->in + c->in_off, sizeof(hdr));
+      if (hdr.len > HB_MAX_FRAME) {
+        fprintf(stderr, "Response too large: %u bytes\n", hdr.len);
+        return -1;
+      }
+      if (avail - sizeof(hdr) >= hdr.len) {
+        break;
+      }
+    }
+    if (fill(c, true) != 0) {
+      return -1;
+    }
+  }
+
+  rsp->id = hdr.id;
+  rsp->op = hdr.op;
+  rsp->status = hdr.flags;
+  rsp->count = hdr.count;
+  rsp->len = hdr.len;
+  rsp->payload = c->in + c->in_off + sizeof(hdr);
+  c->in_off += sizeof(hdr) + hdr.len;
+  return 0;
+}
+
+/**
+ * Flush and wait for the single outstanding response.
+ */
+static int roundTrip(HBClient *c, int64_t id, HBResponse *rsp) {
+  if (id < 0 || HBFlush(c) != 0 || HBRecv(c, rsp) != 0) {
+    return -1;
+  }
+  if (rsp->id != (uint32_t)id) {
+    fprintf(stderr, "Out of order response %u, expected %u\n", rsp->id,
+            (uint32_t)id);
+    return -1;
+  }
+  return rsp->status;
+}
+
+int HBCreate(HBClient *c, const char *name, uint64_t size, int hf) {
+  if (!validName(name)) {
+    return -1;
+  }
+  uint32_t h = (uint32_t)hf;
+  int64_t id = beginFrame(c, HB_OP_CREATE, 0, 0,
+                          1 + strlen(name) + sizeof(size) + sizeof(h));
+  if (id >= 0) {
+    putName(c, name);
+    put(c, &size, sizeof(size));
+    put(c, &h, sizeof(h));
+  }
+  HBResponse rsp;
+  return roundTrip(c, id, &rsp);
+}
+
+int HBInsert(HBClient *c, const char *name, const char **keys, size_t n) {
+  HBResponse rsp;
+  return roundTrip(c, HBSendKeys(c, HB_OP_INSERT, name, keys, n), &rsp);
+}
+
+int HBLookup(HBClient *c, const char *name, const char **keys, size_t n,
+             bool *out) {
+  HBResponse rsp;
+  int status = roundTrip(c, HBSendKeys(c, HB_OP_LOOKUP, name, keys, n), &rsp);
+  if (status == HB_STATUS_OK) {
+    if (rsp.len < (n + 7) / 8) {
+      fprintf(stderr, "Short lookup response\n");
+      return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+      out[i] = HBFound(&rsp, i);
+    }
+  }
+  return status;
+}
+
+int HBMerge(HBClient *c, const char *dst, const char *src, bool fold) {
+  if (!validName(dst) || !validName(src)) {
+    return -1;
+  }
+  int64_t id = beginFrame(c, HB_OP_MERGE, fold ? HB_FLAG_FOLD : 0, 0,
+                          2 + strlen(dst) + strlen(src));
+  if (id >= 0) {
+    putName(c, dst);
+    putName(c, src);
+  }
+  HBResponse rsp;
+  return roundTrip(c, id, &rsp);
+}
+
+int HBStats(HBClient *c, const char *name, HBFilterStats *out) {
+  if (!validName(name)) {
+    return -1;
+  }
+  int64_t id = beginFrame(c, HB_OP_STATS, 0, 0, 1 + strlen(name));
+  if (id >= 0) {
+    putName(c, name);
+  }
+  HBResponse rsp;
+  int status = roundTrip(c, id, &rsp);
+  if (status == HB_STATUS_OK) {
+    if (rsp.len != sizeof(*out)) {
+      fprintf(stderr, "Malformed stats response\n");
+      return -1;
+    }
+    memcpy(out, rsp.payload, sizeof(*out));
+  }
+  return status;
+}
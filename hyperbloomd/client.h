@@ -0,0 +1,106 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/**
+ * HBClient is a connection to hyperbloomd. A client is not thread safe; use
+ * one per thread.
+ *
+ * The synchronous calls (HBCreate, HBInsert, ...) send one frame and wait for
+ * its response. For throughput, queue frames with the HBSend* calls, push them
+ * out with HBFlush and collect the responses, in order, with HBRecv. Any
+ * number of frames may be in flight at once: HBFlush reads responses into the
+ * client while it sends, so the daemon never waits on a full socket.
+ */
+typedef struct HBClient {
+  int fd;
+  uint32_t next_id;
+  uint8_t *out; // Frames queued by HBSend* and not yet flushed
+  size_t out_len;
+  size_t out_cap;
+  uint8_t *in;   // Responses received and not yet returned by HBRecv
+  size_t in_off; // Start of the first response not yet returned
+  size_t in_len;
+  size_t in_cap;
+} HBClient;
+
+/**
+ * A response received with HBRecv. `payload` points into the client and is
+ * only valid until the next call on it.
+ */
+typedef struct HBResponse {
+  uint32_t id;
+  uint8_t op;
+  uint8_t status;
+  uint16_t count;
+  uint32_t len;
+  const uint8_t *payload;
+} HBResponse;
+
+/**
+ * Connect to the daemon listening on the Unix socket at `path`.
+ */
+HBClient *HBConnect(const char *path);
+
+/**
+ * Close the connection and free the client.
+ */
+void HBDisconnect(HBClient *c);
+
+/**
+ * Queue a frame carrying string keys (HB_OP_INSERT or HB_OP_LOOKUP). Returns
+ * the request id, or -1 on error.
+ */
+int64_t HBSendKeys(HBClient *c, uint8_t op, const char *name,
+                   const char **keys, size_t n);
+
+/**
+ * Queue a frame carrying `n` fixed-width keys laid out back to back in `keys`,
+ * `width` bytes each. Returns the request id, or -1 on error.
+ */
+int64_t HBSendFixed(HBClient *c, uint8_t op, const char *name,
+                    const uint8_t *keys, size_t width, size_t n);
+
+/**
+ * Write every queued frame to the daemon.
+ */
+int HBFlush(HBClient *c);
+
+/**
+ * Wait for the next response. Returns 0 on success, -1 if the connection
+ * failed.
+ */
+int HBRecv(HBClient *c, HBResponse *rsp);
+
+/**
+ * Synchronous calls. Each returns an HB_STATUS_* code, or -1 if the
+ * connection failed. HBMerge with `fold` set sends HB_FLAG_FOLD, allowing
+ * `dst` to be folded down to the size of a smaller `src`.
+ */
+int HBCreate(HBClient *c, const char *name, uint64_t size, int hf);
+int HBInsert(HBClient *c, const char *name, const char **keys, size_t n);
+int HBLookup(HBClient *c, const char *name, const char **keys, size_t n,
+             bool *out);
+int HBMerge(HBClient *c, const char *dst, const char *src, bool fold);
+int HBStats(HBClient *c, const char *name, HBFilterStats *out);
+
+/**
+ * Whether bit `i` of a lookup response bitmap is set.
+ */
+static inline bool HBFound(const HBResponse *rsp, size_t i) {
+  return (rsp->payload[i / 8] >> (i % 8)) & 1;
+}
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestHyperbloomd();
+void TestHyperbloomdPipelining();
+void TestHyperbloomdSlowReader();
+
+#endif // CLIENT_H
@@ -0,0 +1,95 @@
+#include <signal.h>
+#include <string.h>
+
+#include "server.h"
+
+/**
+ * hyperbloomd: hosts named filters in memory and serves them over a Unix
+ * domain socket (see protocol.h).
+ *
+ * Usage: hyperbloomd [-s socket] [-w workers] [-m bits] [-l name=file]...
+ *
+ * - `-s`: socket path (default /tmp/hyperbloomd.sock)
+ * - `-w`: number of worker threads (default: number of online CPUs)
+ * - `-m`: largest filter, in bits, clients may create (default
+ *   HB_DEFAULT_MAX_SIZE)
+ * - `-l`: preload a filter saved with Write under `name`; may be repeated
+ */
+
+static HBServer *server;
+
+static void onSignal(int sig) {
+  (void)sig;
+  StopHBServer(server);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-s socket] [-w workers] [-m bits] [-l name=file]...\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  const char *path = "/tmp/hyperbloomd.sock";
+  int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 1) {
+    workers = 1;
+  }
+  uint64_t max_size = HB_DEFAULT_MAX_SIZE;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:w:m:l:")) != -1) {
+    switch (opt) {
+    case 's':
+      path = optarg;
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'm':
+      max_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      break; // Handled once the server exists
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  server = NewHBServer(path, workers);
+  if (server == NULL) {
+    return 1;
+  }
+  SetHBServerMaxSize(server, max_size);
+
+  optind = 1;
+  while ((opt = getopt(argc, argv, "s:w:m:l:")) != -1) {
+    if (opt != 'l') {
+      continue;
+    }
+    char *eq = strchr(optarg, '=');
+    if (eq == NULL) {
+      usage(argv[0]);
+      DestroyHBServer(server);
+      return 1;
+    }
+    *eq = '\0';
+    BloomFilter *bf = Load(eq + 1);
+    if (bf == NULL || AddHBServerFilter(server, optarg, bf) != 0) {
+      DestroyBloomFilter(bf);
+      DestroyHBServer(server);
+      return 1;
+    }
+  }
+
+  struct sigaction sa = {.sa_handler = onSignal};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("hyperbloomd listening on %s with %d workers\n", path, workers);
+  int rc = RunHBServer(server);
+  DestroyHBServer(server);
+  return rc == 0 ? 0 : 1;
+}
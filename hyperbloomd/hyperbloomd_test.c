@@ -0,0 +1,335 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "client.h"
+#include "server.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static char socketPath[64];
+static HBServer *server;
+static pthread_t serverThread;
+
+static void *serve(void *arg) {
+  (void)arg;
+  RunHBServer(server);
+  return NULL;
+}
+
+int main() {
+  printf("Running tests...\n");
+  snprintf(socketPath, sizeof(socketPath), "/tmp/hyperbloomd-test-%d.sock",
+           (int)getpid());
+  server = NewHBServer(socketPath, 2);
+  assert(server != NULL, "NewHBServer should not return NULL");
+  SetHBServerMaxSize(server, 1 << 24);
+  pthread_create(&serverThread, NULL, serve, NULL);
+
+  TestHyperbloomd();
+  TestHyperbloomdPipelining();
+  TestHyperbloomdSlowReader();
+
+  StopHBServer(server);
+  pthread_join(serverThread, NULL);
+  DestroyHBServer(server);
+  printf("All tests passed!\n");
+  return 0;
+}
+
+void TestHyperbloomd() {
+  HBClient *c = HBConnect(socketPath);
+  assert(c != NULL, "HBConnect should not return NULL");
+
+  const char *keys[] = {"b99afb65c9f97b2e0feea844eea55f69",
+                        "f530e3093a1617d64f400c5578005b7c",
+                        "b29317ac342ceafc79e59996678efeb3",
+                        "00421829519ccc2834eedc2bac21df68"};
+  const char *fakes[] = {"hahaidontexist", "foobar", "turnips", "lavacakes"};
+  bool found[4];
+
+  assert(HBCreate(c, "users", 1048576, 4) == HB_STATUS_OK,
+         "HBCreate should succeed");
+  assert(HBCreate(c, "users", 1048576, 4) == HB_STATUS_EXISTS,
+         "HBCreate of an existing filter should fail");
+  assert(HBCreate(c, "bad", 100000, 4) == HB_STATUS_BAD_REQUEST,
+         "HBCreate with an invalid size should fail");
+  assert(HBCreate(c, "huge", 1 << 25, 4) == HB_STATUS_BAD_REQUEST,
+         "HBCreate above the server's maximum size should fail");
+  assert(HBCreate(c, "greedy", 2048, HB_MAX_HASHES + 1) ==
+             HB_STATUS_BAD_REQUEST,
+         "HBCreate with too many hash functions should fail");
+  assert(HBCreate(c, "greedy", 2048, HB_MAX_HASHES) == HB_STATUS_OK,
+         "HBCreate with the most hash functions should succeed");
+  assert(HBInsert(c, "missing", keys, 4) == HB_STATUS_NOT_FOUND,
+         "HBInsert into a missing filter should fail");
+
+  assert(HBInsert(c, "users", keys, 2) == HB_STATUS_OK,
+         "HBInsert should succeed");
+  assert(HBLookup(c, "users", keys, 4, found) == HB_STATUS_OK,
+         "HBLookup should succeed");
+  assert(found[0] && found[1], "Inserted keys should exist in the filter");
+  assert(!found[2] && !found[3], "Other keys should not exist in the filter");
+  assert(HBLookup(c, "users", fakes, 4, found) == HB_STATUS_OK,
+         "HBLookup should succeed");
+  assert(!found[0] && !found[1] && !found[2] && !found[3],
+         "Fake keys should not exist in the filter");
+
+  // Merge a second filter in.
+  assert(HBCreate(c, "more", 1048576, 4) == HB_STATUS_OK,
+         "HBCreate should succeed");
+  assert(HBCreate(c, "small", 2048, 4) == HB_STATUS_OK,
+         "HBCreate should succeed");
+  assert(HBCreate(c, "other", 1048576, 3) == HB_STATUS_OK,
+         "HBCreate should succeed");
+  assert(HBInsert(c, "more", keys + 2, 2) == HB_STATUS_OK,
+         "HBInsert should succeed");
+  assert(HBMerge(c, "users", "other", false) == HB_STATUS_MISMATCH,
+         "HBMerge of different hash counts should fail");
+  assert(HBMerge(c, "users", "more", false) == HB_STATUS_OK,
+         "HBMerge should succeed");
+  assert(HBLookup(c, "users", keys, 4, found) == HB_STATUS_OK,
+         "HBLookup should succeed");
+  assert(found[0] && found[1] && found[2] && found[3],
+         "Merged keys should exist in the filter");
+
+  // A larger source is folded down to the destination's size.
+  assert(HBMerge(c, "small", "users", false) == HB_STATUS_OK,
+         "HBMerge of different sizes should succeed");
+  assert(HBLookup(c, "small", keys, 4, found) == HB_STATUS_OK,
+         "HBLookup should succeed");
+  assert(found[0] && found[1] && found[2] && found[3],
+         "Folded keys should exist in the filter");
+
+  // A smaller source only folds the destination when asked to.
+  assert(HBCreate(c, "tiny", 1024, 4) == HB_STATUS_OK,
+         "HBCreate should succeed");
+  assert(HBMerge(c, "more", "tiny", false) == HB_STATUS_MISMATCH,
+         "HBMerge of a smaller source should fail");
+  HBFilterStats stats;
+  assert(HBStats(c, "more", &stats) == HB_STATUS_OK && stats.size == 1048576,
+         "A refused merge should not fold the destination");
+  assert(HBMerge(c, "more", "tiny", true) == HB_STATUS_OK,
+         "HBMerge with HB_FLAG_FOLD should succeed");
+  assert(HBStats(c, "more", &stats) == HB_STATUS_OK && stats.size == 1024,
+         "HB_FLAG_FOLD should fold the destination");
+  assert(HBLookup(c, "more", keys + 2, 2, found) == HB_STATUS_OK,
+         "HBLookup should succeed");
+  assert(found[0] && found[1], "Folded keys should exist in the filter");
+
+  assert(HBStats(c, "users", &stats) == HB_STATUS_OK,
+         "HBStats should succeed");
+  assert(stats.size == 1048576 && stats.hf == 4, "Stats filter parameters");
+  assert(stats.inserts == 2 && stats.lookups == 12, "Stats key counters");
+  assert(stats.bits_set > 0 && stats.bits_set <= 16, "Stats bits set");
+
+  HBDisconnect(c);
+  printf("TestHyperbloomd passed\n");
+}
+
+void TestHyperbloomdPipelining() {
+  HBClient *c = HBConnect(socketPath);
+  assert(c != NULL, "HBConnect should not return NULL");
+  assert(HBCreate(c, "uuids", 1048576, 4) == HB_STATUS_OK,
+         "HBCreate should succeed");
+
+  // 100 frames of 16 byte keys in flight at once, inserts then lookups.
+  enum { FRAMES = 100, PER_FRAME = 50, WIDTH = 16 };
+  uint8_t *keys = malloc(FRAMES * PER_FRAME * WIDTH);
+  for (size_t i = 0; i < FRAMES * PER_FRAME * WIDTH; i++) {
+    keys[i] = (uint8_t)(i * 2654435761u >> 13);
+  }
+
+  int64_t ids[2 * FRAMES];
+  for (int f = 0; f < FRAMES; f++) {
+    ids[f] = HBSendFixed(c, HB_OP_INSERT, "uuids",
+                         keys + f * PER_FRAME * WIDTH, WIDTH, PER_FRAME);
+    assert(ids[f] >= 0, "HBSendFixed should not fail");
+  }
+  for (int f = 0; f < FRAMES; f++) {
+    ids[FRAMES + f] = HBSendFixed(c, HB_OP_LOOKUP, "uuids",
+                                  keys + f * PER_FRAME * WIDTH, WIDTH,
+                                  PER_FRAME);
+    assert(ids[FRAMES + f] >= 0, "HBSendFixed should not fail");
+  }
+  assert(HBSendFixed(c, HB_OP_LOOKUP, "uuids", keys, UINT16_MAX,
+                     SIZE_MAX / 2) < 0,
+         "HBSendFixed should refuse batches whose size overflows");
+  assert(HBSendFixed(c, HB_OP_LOOKUP, "uuids", keys, UINT16_MAX,
+                     UINT16_MAX) < 0,
+         "HBSendFixed should refuse frames above HB_MAX_FRAME");
+  assert(HBFlush(c) == 0, "HBFlush should not fail");
+
+  for (int f = 0; f < 2 * FRAMES; f++) {
+    HBResponse rsp;
+    assert(HBRecv(c, &rsp) == 0, "HBRecv should not fail");
+    assert(rsp.id == (uint32_t)ids[f], "Responses should arrive in order");
+    assert(rsp.status == HB_STATUS_OK, "Pipelined frame should succeed");
+    if (f >= FRAMES) {
+      for (int i = 0; i < PER_FRAME; i++) {
+        assert(HBFound(&rsp, i), "Pipelined inserts should be found");
+      }
+    }
+  }
+
+  // Far more frames than the socket buffers hold in one flush: the daemon
+  // holds back reading until its responses are taken, so HBFlush has to take
+  // them in while it sends.
+  enum { MANY = 200000 };
+  int64_t first = -1;
+  for (int f = 0; f < MANY; f++) {
+    int64_t id = HBSendFixed(c, HB_OP_LOOKUP, "uuids",
+                             keys + (f % (FRAMES * PER_FRAME)) * WIDTH, WIDTH,
+                             1);
+    assert(id >= 0, "HBSendFixed should not fail");
+    if (f == 0) {
+      first = id;
+    }
+  }
+  assert(HBFlush(c) == 0, "HBFlush should not fail");
+  for (int f = 0; f < MANY; f++) {
+    HBResponse rsp;
+    assert(HBRecv(c, &rsp) == 0, "HBRecv should not fail");
+    assert(rsp.id == (uint32_t)(first + f), "Responses should arrive in order");
+    assert(rsp.status == HB_STATUS_OK && HBFound(&rsp, 0),
+           "Pipelined inserts should be found");
+  }
+
+  // A malformed frame (fixed-width keys, payload too short for them) gets an
+  // error response without dropping the connection.
+  uint8_t frame[sizeof(HBFrameHeader) + 11] = {0};
+  HBFrameHeader bad = {.len = 11,
+                       .id = 4242,
+                       .op = HB_OP_LOOKUP,
+                       .flags = HB_FLAG_FIXED,
+                       .count = 1};
+  uint16_t width = WIDTH;
+  memcpy(frame, &bad, sizeof(bad));
+  memcpy(frame + sizeof(bad), "\x05uuids", 6);
+  memcpy(frame + sizeof(bad) + 6, &width, sizeof(width));
+  assert(send(c->fd, frame, sizeof(frame), 0) == (ssize_t)sizeof(frame),
+         "send should not fail");
+  HBResponse rsp;
+  assert(HBRecv(c, &rsp) == 0 && rsp.id == 4242 &&
+             rsp.status == HB_STATUS_BAD_REQUEST,
+         "Short frame should be rejected");
+
+  // So is a string-key frame with bytes left over after its keys.
+  uint8_t extra[sizeof(HBFrameHeader) + 12] = {0};
+  HBFrameHeader trailing = {.len = 12,
+                            .id = 4243,
+                            .op = HB_OP_LOOKUP,
+                            .count = 1};
+  uint16_t len = 3;
+  memcpy(extra, &trailing, sizeof(trailing));
+  memcpy(extra + sizeof(trailing), "\x05uuids", 6);
+  memcpy(extra + sizeof(trailing) + 6, &len, sizeof(len));
+  memcpy(extra + sizeof(trailing) + 8, "abc", 3);
+  extra[sizeof(extra) - 1] = 'x';
+  assert(send(c->fd, extra, sizeof(extra), 0) == (ssize_t)sizeof(extra),
+         "send should not fail");
+  assert(HBRecv(c, &rsp) == 0 && rsp.id == 4243 &&
+             rsp.status == HB_STATUS_BAD_REQUEST,
+         "Trailing bytes should be rejected");
+
+  const char *again[] = {"still-alive"};
+  bool found;
+  assert(HBLookup(c, "uuids", again, 1, &found) == HB_STATUS_OK,
+         "Connection should survive a bad frame");
+
+  free(keys);
+  HBDisconnect(c);
+  printf("TestHyperbloomdPipelining passed\n");
+}
+
+/**
+ * Frames a slow reader writes without reading the responses, and how many of
+ * their bytes went out before its socket filled up.
+ */
+typedef struct SlowReader {
+  HBClient *c;
+  uint8_t *frames;
+  size_t len;
+  size_t sent;
+} SlowReader;
+
+static void *finishSending(void *arg) {
+  SlowReader *r = arg;
+  while (r->sent < r->len) {
+    ssize_t n = send(r->c->fd, r->frames + r->sent, r->len - r->sent, 0);
+    assert(n > 0, "send should not fail");
+    r->sent += (size_t)n;
+  }
+  return NULL;
+}
+
+void TestHyperbloomdSlowReader() {
+  // STATS responses are larger than the requests, so clients that pipeline
+  // them without reading fill up the server's side of their sockets. There
+  // are as many of them as workers. The filter is small so that answering
+  // them costs little.
+  HBClient *c = HBConnect(socketPath);
+  assert(c != NULL, "HBConnect should not return NULL");
+  assert(HBCreate(c, "quiet", 2048, 4) == HB_STATUS_OK,
+         "HBCreate should succeed");
+
+  enum { READERS = 2, FRAMES = 100000, FRAME = sizeof(HBFrameHeader) + 6 };
+  SlowReader readers[READERS];
+  for (int r = 0; r < READERS; r++) {
+    readers[r].c = HBConnect(socketPath);
+    assert(readers[r].c != NULL, "HBConnect should not return NULL");
+    readers[r].len = FRAMES * FRAME;
+    readers[r].frames = malloc(readers[r].len);
+    for (int f = 0; f < FRAMES; f++) {
+      HBFrameHeader hdr = {.len = 6, .id = f, .op = HB_OP_STATS};
+      memcpy(readers[r].frames + f * FRAME, &hdr, sizeof(hdr));
+      memcpy(readers[r].frames + f * FRAME + sizeof(hdr), "\x05quiet", 6);
+    }
+    // Send until the server stops taking more.
+    readers[r].sent = 0;
+    struct pollfd pfd = {.fd = readers[r].c->fd, .events = POLLOUT};
+    while (readers[r].sent < readers[r].len && poll(&pfd, 1, 200) > 0) {
+      ssize_t n = send(readers[r].c->fd, readers[r].frames + readers[r].sent,
+                       readers[r].len - readers[r].sent, MSG_DONTWAIT);
+      if (n > 0) {
+        readers[r].sent += (size_t)n;
+      }
+    }
+    assert(readers[r].sent < readers[r].len, "Slow reader should stall");
+  }
+
+  // Another client is still served right away rather than waiting for the
+  // slow readers to catch up.
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  const char *keys[] = {"not-stalled"};
+  bool found;
+  assert(HBLookup(c, "uuids", keys, 1, &found) == HB_STATUS_OK,
+         "HBLookup should succeed next to slow readers");
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Lookup next to slow readers took %.3fs\n", elapsed);
+  assert(elapsed < 1, "Slow readers should not hold up other clients");
+  HBDisconnect(c);
+
+  // The slow readers still get every response, in order, once they read.
+  for (int r = 0; r < READERS; r++) {
+    pthread_t sender;
+    pthread_create(&sender, NULL, finishSending, &readers[r]);
+    for (int f = 0; f < FRAMES; f++) {
+      HBResponse rsp;
+      assert(HBRecv(readers[r].c, &rsp) == 0, "HBRecv should not fail");
+      assert(rsp.id == (uint32_t)f, "Responses should arrive in order");
+      assert(rsp.status == HB_STATUS_OK, "STATS should succeed");
+    }
+    pthread_join(sender, NULL);
+    free(readers[r].frames);
+    HBDisconnect(readers[r].c);
+  }
+  printf("TestHyperbloomdSlowReader passed\n");
+}
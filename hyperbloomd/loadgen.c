@@ -0,0 +1,280 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+
+/**
+ * hbloadgen: drives hyperbloomd with pipelined, batched insert and lookup
+ * frames from several connections and reports throughput and latency
+ * percentiles.
+ *
+ * Usage: hbloadgen [-s socket] [-c connections] [-d depth] [-b keys/frame]
+ *                  [-t seconds] [-r lookup%] [-w key width] [-n bits] [-k hf]
+ *
+ * A key width of 0 sends hex string keys instead of fixed-width binary ones.
+ * Latency is measured per frame, from queuing it to receiving its response.
+ */
+
+typedef struct LoadConfig {
+  const char *path;
+  int conns;
+  int depth;
+  int batch;
+  int seconds;
+  int lookup_pct;
+  int width;
+  uint64_t size;
+  int hf;
+} LoadConfig;
+
+typedef struct LoadWorker {
+  const LoadConfig *cfg;
+  uint64_t seed;
+  uint64_t *latencies; // Nanoseconds, one per frame
+  size_t nlat;
+  size_t cap;
+  uint64_t keys;
+  int failed;
+  pthread_t thread;
+} LoadWorker;
+
+static uint64_t nowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+/**
+ * Queue one frame of random keys.
+ */
+static int64_t sendFrame(HBClient *c, LoadWorker *w, uint8_t *keybuf,
+                         char **strkeys) {
+  const LoadConfig *cfg = w->cfg;
+  uint8_t op = (int)(xorshift(&w->seed) % 100) < cfg->lookup_pct
+                   ? HB_OP_LOOKUP
+                   : HB_OP_INSERT;
+
+  if (cfg->width > 0) {
+    for (size_t i = 0; i < (size_t)cfg->batch * cfg->width; i += 8) {
+      uint64_t r = xorshift(&w->seed);
+      memcpy(keybuf + i, &r, 8);
+    }
+    return HBSendFixed(c, op, "loadgen", keybuf, (size_t)cfg->width,
+                       (size_t)cfg->batch);
+  }
+  for (int i = 0; i < cfg->batch; i++) {
+    snprintf(strkeys[i], 33, "%016llx%016llx",
+             (unsigned long long)xorshift(&w->seed),
+             (unsigned long long)xorshift(&w->seed));
+  }
+  return HBSendKeys(c, op, "loadgen", (const char **)strkeys,
+                    (size_t)cfg->batch);
+}
+
+static void *runWorker(void *arg) {
+  LoadWorker *w = arg;
+  const LoadConfig *cfg = w->cfg;
+  HBClient *c = HBConnect(cfg->path);
+  // Width rounded up to whole words so keys can be filled 8 bytes at a time.
+  uint8_t *keybuf = malloc((size_t)cfg->batch * ((cfg->width + 7) & ~7) + 8);
+  char **strkeys = calloc((size_t)cfg->batch, sizeof(char *));
+  uint64_t *sent = malloc((size_t)cfg->depth * sizeof(uint64_t));
+  if (c == NULL || keybuf == NULL || strkeys == NULL || sent == NULL) {
+    w->failed = 1;
+    goto out;
+  }
+  for (int i = 0; i < cfg->batch; i++) {
+    strkeys[i] = malloc(33);
+  }
+
+  uint64_t end = nowNanos() + (uint64_t)cfg->seconds * 1000000000ULL;
+  size_t head = 0, inflight = 0;
+  for (;;) {
+    // Keep `depth` frames in flight until the deadline.
+    bool more = nowNanos() < end;
+    while (more && inflight < (size_t)cfg->depth) {
+      if (sendFrame(c, w, keybuf, strkeys) < 0) {
+        w->failed = 1;
+        goto out;
+      }
+      sent[(head + inflight) % cfg->depth] = nowNanos();
+      inflight++;
+    }
+    if (HBFlush(c) != 0) {
+      w->failed = 1;
+      goto out;
+    }
+    if (inflight == 0) {
+      break;
+    }
+
+    HBResponse rsp;
+    if (HBRecv(c, &rsp) != 0 || rsp.status != HB_STATUS_OK) {
+      w->failed = 1;
+      goto out;
+    }
+    if (w->nlat == w->cap) {
+      size_t ncap = w->cap ? w->cap * 2 : 65536;
+      uint64_t *grown = realloc(w->latencies, ncap * sizeof(uint64_t));
+      if (grown == NULL) {
+        perror("Failed to allocate latencies.");
+        w->failed = 1;
+        goto out;
+      }
+      w->latencies = grown;
+      w->cap = ncap;
+    }
+    w->latencies[w->nlat++] = nowNanos() - sent[head];
+    w->keys += rsp.count;
+    head = (head + 1) % cfg->depth;
+    inflight--;
+  }
+
+out:
+  if (strkeys) {
+    for (int i = 0; i < cfg->batch; i++) {
+      free(strkeys[i]);
+    }
+  }
+  free(strkeys);
+  free(keybuf);
+  free(sent);
+  HBDisconnect(c);
+  return NULL;
+}
+
+static int compareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, size_t n, double p) {
+  size_t idx = (size_t)(p / 100.0 * (double)(n - 1));
+  return (double)sorted[idx] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+  LoadConfig cfg = {.path = "/tmp/hyperbloomd.sock",
+                    .conns = 4,
+                    .depth = 16,
+                    .batch = 64,
+                    .seconds = 5,
+                    .lookup_pct = 90,
+                    .width = 16,
+                    .size = 1ULL << 27,
+                    .hf = 4};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:d:b:t:r:w:n:k:")) != -1) {
+    switch (opt) {
+    case 's':
+      cfg.path = optarg;
+      break;
+    case 'c':
+      cfg.conns = atoi(optarg);
+      break;
+    case 'd':
+      cfg.depth = atoi(optarg);
+      break;
+    case 'b':
+      cfg.batch = atoi(optarg);
+      break;
+    case 't':
+      cfg.seconds = atoi(optarg);
+      break;
+    case 'r':
+      cfg.lookup_pct = atoi(optarg);
+      break;
+    case 'w':
+      cfg.width = atoi(optarg);
+      break;
+    case 'n':
+      cfg.size = strtoull(optarg, NULL, 10);
+      break;
+    case 'k':
+      cfg.hf = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-s socket] [-c connections] [-d depth] "
+              "[-b keys/frame] [-t seconds] [-r lookup%%] [-w key width] "
+              "[-n bits] [-k hf]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (cfg.conns < 1 || cfg.depth < 1 || cfg.batch < 1 ||
+      cfg.batch > UINT16_MAX || cfg.width < 0) {
+    fprintf(stderr, "Invalid load configuration\n");
+    return 1;
+  }
+
+  HBClient *setup = HBConnect(cfg.path);
+  if (setup == NULL) {
+    return 1;
+  }
+  int status = HBCreate(setup, "loadgen", cfg.size, cfg.hf);
+  HBDisconnect(setup);
+  if (status != HB_STATUS_OK && status != HB_STATUS_EXISTS) {
+    fprintf(stderr, "Failed to create the loadgen filter: %d\n", status);
+    return 1;
+  }
+
+  LoadWorker *workers = calloc((size_t)cfg.conns, sizeof(LoadWorker));
+  uint64_t start = nowNanos();
+  for (int i = 0; i < cfg.conns; i++) {
+    workers[i].cfg = &cfg;
+    workers[i].seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+    pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+  }
+
+  size_t total = 0;
+  uint64_t keys = 0;
+  int failed = 0;
+  for (int i = 0; i < cfg.conns; i++) {
+    pthread_join(workers[i].thread, NULL);
+    total += workers[i].nlat;
+    keys += workers[i].keys;
+    failed |= workers[i].failed;
+  }
+  double elapsed = (double)(nowNanos() - start) / 1e9;
+
+  uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+  size_t off = 0;
+  for (int i = 0; i < cfg.conns; i++) {
+    memcpy(all + off, workers[i].latencies,
+           workers[i].nlat * sizeof(uint64_t));
+    off += workers[i].nlat;
+    free(workers[i].latencies);
+  }
+  free(workers);
+
+  if (total == 0) {
+    fprintf(stderr, "No frames completed\n");
+    free(all);
+    return 1;
+  }
+  qsort(all, total, sizeof(uint64_t), compareU64);
+
+  printf("connections=%d depth=%d keys/frame=%d width=%d lookups=%d%%\n",
+         cfg.conns, cfg.depth, cfg.batch, cfg.width, cfg.lookup_pct);
+  printf("frames: %zu in %.2fs (%.0f frames/s, %.0f keys/s)\n", total,
+         elapsed, (double)total / elapsed, (double)keys / elapsed);
+  printf("latency us: p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+         percentile(all, total, 50), percentile(all, total, 90),
+         percentile(all, total, 99), percentile(all, total, 99.9),
+         (double)all[total - 1] / 1000.0);
+
+  free(all);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * hyperbloomd wire protocol.
+ *
+ * Every message, in both directions, is a fixed 12 byte HBFrameHeader
+ * followed by `len` bytes of payload. The daemon only listens on a Unix
+ * domain socket, so all integers are in host byte order.
+ *
+ * Clients may pipeline: any number of requests can be written before reading
+ * the responses. Responses on a connection come back in request order and
+ * echo the request `id`.
+ *
+ * Request payloads (a "name" is a u8 length followed by that many bytes):
+ *
+ * - HB_OP_CREATE: name, u64 size (bits), u32 hash functions (1 to
+ *   HB_MAX_HASHES). The server also refuses sizes above its configured
+ *   maximum.
+ * - HB_OP_INSERT / HB_OP_LOOKUP: name, then `count` keys. Without
+ *   HB_FLAG_FIXED each key is a u16 length followed by the key bytes. With
+ *   HB_FLAG_FIXED the name is followed by a u16 key width and `count` keys of
+ *   exactly that width, back to back (hashed with the vectorized batch path).
+ * - HB_OP_MERGE: name of the destination, name of the source filter. A larger
+ *   source is folded down to the destination's size as it is OR-ed in. A
+ *   smaller source gets HB_STATUS_MISMATCH unless the request carries
+ *   HB_FLAG_FOLD, which folds the destination down to the source's size.
+ * - HB_OP_STATS: name
+ *
+ * A payload must end with its last field; extra bytes make it malformed.
+ *
+ * Response payloads:
+ *
+ * - HB_OP_LOOKUP: a bitmap of ceil(count / 8) bytes, bit i set if key i may
+ *   be in the filter
+ * - HB_OP_STATS: an HBFilterStats
+ * - everything else: empty, only `status` matters
+ */
+
+#define HB_OP_CREATE 1
+#define HB_OP_INSERT 2
+#define HB_OP_LOOKUP 3
+#define HB_OP_MERGE 4
+#define HB_OP_STATS 5
+
+#define HB_FLAG_FIXED 0x01 // INSERT / LOOKUP: fixed-width keys
+#define HB_FLAG_FOLD 0x02  // MERGE: fold a larger destination to match
+
+#define HB_STATUS_OK 0
+#define HB_STATUS_NOT_FOUND 1   // No filter with that name
+#define HB_STATUS_EXISTS 2      // CREATE of a name that is already taken
+#define HB_STATUS_BAD_REQUEST 3 // Malformed payload or unknown op
+#define HB_STATUS_MISMATCH 4    // MERGE of filters that can't be combined
+#define HB_STATUS_INTERNAL 5    // Allocation or filter error on the server
+
+/**
+ * Upper bound on a frame payload; larger frames are rejected and the
+ * connection is closed.
+ */
+#define HB_MAX_FRAME (1u << 20)
+
+/**
+ * Most hash functions a CREATE may ask for. Matches the probe helpers' stack
+ * buffer, so lookups never fall back to allocating.
+ */
+#define HB_MAX_HASHES 64
+
+typedef struct HBFrameHeader {
+  uint32_t len;   // Bytes of payload following the header
+  uint32_t id;    // Request id, echoed in the response
+  uint8_t op;     // HB_OP_*
+  uint8_t flags;  // HB_FLAG_* on requests, HB_STATUS_* on responses
+  uint16_t count; // Number of keys in the payload
+} HBFrameHeader;
+
+_Static_assert(sizeof(HBFrameHeader) == 12, "HBFrameHeader is 12 bytes");
+
+typedef struct HBFilterStats {
+  uint64_t size;     // Size of bit vector in bits
+  uint64_t hf;       // Number of hash functions
+  uint64_t bits_set; // Number of bits set
+  uint64_t inserts;  // Keys inserted since the daemon started
+  uint64_t lookups;  // Keys looked up since the daemon started
+} HBFilterStats;
+
+/**
+ * Bounds-checked little cursor used to decode payloads.
+ */
+typedef struct HBReader {
+  const uint8_t *p;
+  const uint8_t *end;
+} HBReader;
+
+static inline int hbRead(HBReader *r, void *out, size_t n) {
+  if ((size_t)(r->end - r->p) < n) {
+    return -1;
+  }
+  memcpy(out, r->p, n);
+  r->p += n;
+  return 0;
+}
+
+/**
+ * Whether every byte of the payload has been read. A request with bytes left
+ * over after its last field is malformed.
+ */
+static inline bool hbAtEnd(const HBReader *r) { return r->p == r->end; }
+
+/**
+ * Reads a name into `out`, which must hold at least 256 bytes. The result is
+ * NUL terminated.
+ */
+static inline int hbReadName(HBReader *r, char *out) {
+  uint8_t len;
+  if (hbRead(r, &len, 1) != 0 || hbRead(r, out, len) != 0) {
+    return -1;
+  }
+  out[len] = '\0';
+  return 0;
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,733 @@
+#define _GNU_SOURCE // accept4
+
+#include "server.h"
+#include "bitvec.h"
+#include "hashing.h"
+#include "xxhash.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Most bytes read from one connection per wakeup before its frames are
+ * executed, so a client that floods requests can't make the server buffer
+ * without bound. Whatever is left is picked up on the next wakeup.
+ */
+#define HB_READ_BUDGET (4u << 20)
+
+typedef struct HBFilterEntry {
+  char name[256];
+  BloomFilter *bf;
+  uint64_t inserts; // Updated atomically
+  uint64_t lookups; // Updated atomically
+  struct HBFilterEntry *next;
+} HBFilterEntry;
+
+typedef struct HBConn {
+  int fd;
+  uint8_t *in; // Bytes read but not yet executed
+  size_t in_len;
+  size_t in_cap;
+  uint8_t *out; // Responses not yet written
+  size_t out_len;
+  size_t out_cap;
+  bool eof; // The client has stopped sending
+  struct HBConn *next_ready;      // Work queue link
+  struct HBConn *prev, *next_all; // All connections, for shutdown
+} HBConn;
+
+struct HBServer {
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int listen_fd;
+  int wake_fd;
+  int epoll_fd;
+  int nworkers;
+  pthread_t *workers;
+  uint64_t max_size; // Largest filter a client may CREATE, in bits
+
+  // Hosted filters. Filters are only ever added, so entries found under the
+  // read lock stay valid after it is released.
+  pthread_rwlock_t registry_lock;
+  HBFilterEntry *filters;
+
+  // Connections ready to be served, handed from the event loop to workers.
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond;
+  HBConn *ready_head;
+  HBConn *ready_tail;
+  bool stopping;
+
+  pthread_mutex_t conns_lock;
+  HBConn *conns;
+};
+
+static HBFilterEntry *findFilter(HBServer *s, const char *name) {
+  pthread_rwlock_rdlock(&s->registry_lock);
+  HBFilterEntry *e = s->filters;
+  while (e != NULL && strcmp(e->name, name) != 0) {
+    e = e->next;
+  }
+  pthread_rwlock_unlock(&s->registry_lock);
+  return e;
+}
+
+/**
+ * Adds a filter under `name`. Returns HB_STATUS_EXISTS if the name is taken.
+ */
+static int addFilter(HBServer *s, const char *name, BloomFilter *bf) {
+  HBFilterEntry *entry = calloc(1, sizeof(HBFilterEntry));
+  if (entry == NULL) {
+    return HB_STATUS_INTERNAL;
+  }
+  snprintf(entry->name, sizeof(entry->name), "%s", name);
+  entry->bf = bf;
+
+  pthread_rwlock_wrlock(&s->registry_lock);
+  for (HBFilterEntry *e = s->filters; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      pthread_rwlock_unlock(&s->registry_lock);
+      free(entry);
+      return HB_STATUS_EXISTS;
+    }
+  }
+  entry->next = s->filters;
+  s->filters = entry;
+  pthread_rwlock_unlock(&s->registry_lock);
+  return HB_STATUS_OK;
+}
+
+HBServer *NewHBServer(const char *path, int workers) {
+  if (workers < 1) {
+    fprintf(stderr, "Server needs at least one worker\n");
+    return NULL;
+  }
+
+  HBServer *s = calloc(1, sizeof(HBServer));
+  if (s == NULL) {
+    perror("Failed to allocate server.");
+    return NULL;
+  }
+  s->listen_fd = s->wake_fd = s->epoll_fd = -1;
+  s->nworkers = workers;
+  s->max_size = HB_DEFAULT_MAX_SIZE;
+  pthread_rwlock_init(&s->registry_lock, NULL);
+  pthread_mutex_init(&s->queue_lock, NULL);
+  pthread_cond_init(&s->queue_cond, NULL);
+  pthread_mutex_init(&s->conns_lock, NULL);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    DestroyHBServer(s);
+    return NULL;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s->listen_fd < 0) {
+    perror("Failed to create socket");
+    DestroyHBServer(s);
+    return NULL;
+  }
+
+  unlink(path); // A socket file left behind by a previous run
+  if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(s->listen_fd, SOMAXCONN) != 0) {
+    perror("Failed to listen on socket");
+    DestroyHBServer(s);
+    return NULL;
+  }
+  snprintf(s->path, sizeof(s->path), "%s", path);
+
+  s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->wake_fd < 0 || s->epoll_fd < 0) {
+    perror("Failed to set up event loop");
+    DestroyHBServer(s);
+    return NULL;
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &s->listen_fd};
+  struct epoll_event wake = {.events = EPOLLIN, .data.ptr = &s->wake_fd};
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) != 0 ||
+      epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &wake) != 0) {
+    perror("Failed to set up event loop");
+    DestroyHBServer(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+void SetHBServerMaxSize(HBServer *s, uint64_t size) { s->max_size = size; }
+
+int AddHBServerFilter(HBServer *s, const char *name, BloomFilter *bf) {
+  if (strlen(name) > 255) {
+    fprintf(stderr, "Filter name too long: %s\n", name);
+    return -1;
+  }
+  if (addFilter(s, name, bf) != HB_STATUS_OK) {
+    fprintf(stderr, "Filter %s already exists\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Grow `*buf` so that it can hold at least `need` bytes.
+ */
+static int reserve(uint8_t **buf, size_t *cap, size_t need) {
+  if (need <= *cap) {
+    return 0;
+  }
+  size_t ncap = *cap ? *cap : 4096;
+  while (ncap < need) {
+    ncap *= 2;
+  }
+  uint8_t *nbuf = realloc(*buf, ncap);
+  if (nbuf == NULL) {
+    return -1;
+  }
+  *buf = nbuf;
+  *cap = ncap;
+  return 0;
+}
+
+/**
+ * Appends a response with room for `payload_len` bytes of payload and returns
+ * a pointer to the payload, or NULL if out of memory.
+ */
+static uint8_t *appendResponse(HBConn *c, const HBFrameHeader *req,
+                               uint8_t status, size_t payload_len) {
+  if (reserve(&c->out, &c->out_cap,
+              c->out_len + sizeof(HBFrameHeader) + payload_len) != 0) {
+    return NULL;
+  }
+  HBFrameHeader rsp = {.len = (uint32_t)payload_len,
+                       .id = req->id,
+                       .op = req->op,
+                       .flags = status,
+                       .count = req->count};
+  memcpy(c->out + c->out_len, &rsp, sizeof(rsp));
+  uint8_t *payload = c->out + c->out_len + sizeof(rsp);
+  memset(payload, 0, payload_len);
+  c->out_len += sizeof(rsp) + payload_len;
+  return payload;
+}
+
+static uint8_t handleCreate(HBServer *s, HBReader *r) {
+  char name[256];
+  uint64_t size;
+  uint32_t hf;
+  if (hbReadName(r, name) != 0 || hbRead(r, &size, sizeof(size)) != 0 ||
+      hbRead(r, &hf, sizeof(hf)) != 0 || !hbAtEnd(r)) {
+    return HB_STATUS_BAD_REQUEST;
+  }
+  if (hf == 0 || hf > HB_MAX_HASHES || size > s->max_size) {
+    return HB_STATUS_BAD_REQUEST;
+  }
+  if (findFilter(s, name) != NULL) {
+    return HB_STATUS_EXISTS;
+  }
+
+  BloomFilter *bf = NewBloomFilter(size, (int)hf);
+  if (bf == NULL) {
+    return HB_STATUS_BAD_REQUEST;
+  }
+  uint8_t status = (uint8_t)addFilter(s, name, bf);
+  if (status != HB_STATUS_OK) {
+    DestroyBloomFilter(bf);
+  }
+  return status;
+}
+
+/**
+ * Executes an INSERT or LOOKUP frame. For lookups, `bitmap` receives one bit
+ * per key. String keys are hashed up front and probed under a single lock
+ * acquisition for the whole frame; fixed-width keys go through the
+ * vectorized batch path.
+ */
+static uint8_t handleKeys(HBServer *s, const HBFrameHeader *hdr, HBReader *r,
+                          uint8_t *bitmap) {
+  bool insert = hdr->op == HB_OP_INSERT;
+  char name[256];
+  if (hbReadName(r, name) != 0) {
+    return HB_STATUS_BAD_REQUEST;
+  }
+  HBFilterEntry *e = findFilter(s, name);
+  if (e == NULL) {
+    return HB_STATUS_NOT_FOUND;
+  }
+  BloomFilter *bf = e->bf;
+
+  if (hdr->flags & HB_FLAG_FIXED) {
+    uint16_t width;
+    if (hbRead(r, &width, sizeof(width)) != 0 || width == 0 ||
+        (size_t)(r->end - r->p) != (size_t)width * hdr->count) {
+      return HB_STATUS_BAD_REQUEST;
+    }
+    if (insert) {
+      if (InsertBatch(bf, r->p, width, hdr->count) != 0) {
+        return HB_STATUS_INTERNAL;
+      }
+    } else {
+      // One batch block at a time, so results go straight into the bitmap
+      // without a frame-sized buffer on the worker's stack.
+      bool found[BATCH_BLOCK];
+      for (size_t start = 0; start < hdr->count; start += BATCH_BLOCK) {
+        size_t n = hdr->count - start < BATCH_BLOCK ? hdr->count - start
+                                                    : BATCH_BLOCK;
+        if (LookupBatch(bf, r->p + start * width, width, n, found) != 0) {
+          return HB_STATUS_INTERNAL;
+        }
+        for (size_t i = 0; i < n; i++) {
+          bitmap[(start + i) / 8] |= (uint8_t)(found[i] << ((start + i) % 8));
+        }
+      }
+    }
+  } else {
+    // Hash and validate every key before taking the filter lock.
+    uint64_t *hashes = malloc((size_t)hdr->count * sizeof(uint64_t));
+    uint64_t *expanded = malloc((size_t)bf->hf * sizeof(uint64_t));
+    if (hashes == NULL || expanded == NULL) {
+      free(hashes);
+      free(expanded);
+      return HB_STATUS_INTERNAL;
+    }
+    for (uint16_t i = 0; i < hdr->count; i++) {
+      uint16_t len;
+      if (hbRead(r, &len, sizeof(len)) != 0 || (size_t)(r->end - r->p) < len) {
+        free(hashes);
+        free(expanded);
+        return HB_STATUS_BAD_REQUEST;
+      }
+      hashes[i] = XXH64(r->p, len, 0);
+      r->p += len;
+    }
+    if (!hbAtEnd(r)) {
+      free(hashes);
+      free(expanded);
+      return HB_STATUS_BAD_REQUEST;
+    }
+
+    if (insert) {
+      pthread_rwlock_wrlock(&bf->rwlock);
+    } else {
+      pthread_rwlock_rdlock(&bf->rwlock);
+    }
+    for (uint16_t i = 0; i < hdr->count; i++) {
+      bool found = true;
+      expandHash(hashes[i], bf->hf, expanded);
+      for (int j = 0; j < bf->hf && found; j++) {
+        uint64_t idx = expanded[j] & (bf->size - 1);
+        if (insert) {
+          bf->bv[idx / 64] |= (1ULL << (idx & 63));
+        } else {
+          found = (bf->bv[idx / 64] & (1ULL << (idx & 63))) != 0;
+        }
+      }
+      if (!insert && found) {
+        bitmap[i / 8] |= (uint8_t)(1u << (i % 8));
+      }
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+    free(hashes);
+    free(expanded);
+  }
+
+  __atomic_fetch_add(insert ? &e->inserts : &e->lookups, hdr->count,
+                     __ATOMIC_RELAXED);
+  return HB_STATUS_OK;
+}
+
+static uint8_t handleMerge(HBServer *s, const HBFrameHeader *hdr,
+                           HBReader *r) {
+  char dst_name[256], src_name[256];
+  if (hbReadName(r, dst_name) != 0 || hbReadName(r, src_name) != 0 ||
+      !hbAtEnd(r)) {
+    return HB_STATUS_BAD_REQUEST;
+  }
+  HBFilterEntry *dst = findFilter(s, dst_name);
+  HBFilterEntry *src = findFilter(s, src_name);
+  if (dst == NULL || src == NULL) {
+    return HB_STATUS_NOT_FOUND;
+  }
+  if (dst->bf->hf != src->bf->hf) {
+    return HB_STATUS_MISMATCH;
+  }
+  if (dst == src) {
+    return HB_STATUS_OK;
+  }
+
+  // Lock in address order so that concurrent A<-B and B<-A merges can't
+  // deadlock.
+  BloomFilter *d = dst->bf, *sr = src->bf;
+  if (d < sr) {
+    pthread_rwlock_wrlock(&d->rwlock);
+    pthread_rwlock_rdlock(&sr->rwlock);
+  } else {
+    pthread_rwlock_rdlock(&sr->rwlock);
+    pthread_rwlock_wrlock(&d->rwlock);
+  }
+  // Sizes are only compared under both locks, so that a concurrent merge
+  // into either filter can't change them in between. A larger source is
+  // folded as it is OR-ed in; a larger destination is only folded if the
+  // client asked for it.
+  uint8_t status = HB_STATUS_OK;
+  if (d->size > sr->size) {
+    if (hdr->flags & HB_FLAG_FOLD) {
+      foldVector(d->bv, d->size / 8, d->size / sr->size);
+      d->size = sr->size;
+    } else {
+      status = HB_STATUS_MISMATCH;
+    }
+  }
+  if (status == HB_STATUS_OK) {
+    orFolded(d->bv, d->size / 8, sr->bv, sr->size / 8);
+  }
+  pthread_rwlock_unlock(&sr->rwlock);
+  pthread_rwlock_unlock(&d->rwlock);
+  return status;
+}
+
+static uint8_t handleStats(HBServer *s, HBReader *r, HBFilterStats *out) {
+  char name[256];
+  if (hbReadName(r, name) != 0 || !hbAtEnd(r)) {
+    return HB_STATUS_BAD_REQUEST;
+  }
+  HBFilterEntry *e = findFilter(s, name);
+  if (e == NULL) {
+    return HB_STATUS_NOT_FOUND;
+  }
+
+  pthread_rwlock_rdlock(&e->bf->rwlock);
+  out->size = e->bf->size;
+  out->bits_set = countBits(e->bf->bv, e->bf->size / 8);
+  pthread_rwlock_unlock(&e->bf->rwlock);
+
+  out->hf = (uint64_t)e->bf->hf;
+  out->inserts = __atomic_load_n(&e->inserts, __ATOMIC_RELAXED);
+  out->lookups = __atomic_load_n(&e->lookups, __ATOMIC_RELAXED);
+  return HB_STATUS_OK;
+}
+
+/**
+ * Executes one frame and appends its response. Returns -1 only if the
+ * response can't be buffered.
+ */
+static int handleFrame(HBServer *s, HBConn *c, const HBFrameHeader *hdr,
+                       const uint8_t *payload) {
+  HBReader r = {payload, payload + hdr->len};
+  uint8_t *out;
+
+  switch (hdr->op) {
+  case HB_OP_CREATE:
+    return appendResponse(c, hdr, handleCreate(s, &r), 0) ? 0 : -1;
+  case HB_OP_INSERT:
+    return appendResponse(c, hdr, handleKeys(s, hdr, &r, NULL), 0) ? 0 : -1;
+  case HB_OP_LOOKUP: {
+    size_t bitmap_len = ((size_t)hdr->count + 7) / 8;
+    if ((out = appendResponse(c, hdr, HB_STATUS_OK, bitmap_len)) == NULL) {
+      return -1;
+    }
+    uint8_t status = handleKeys(s, hdr, &r, out);
+    if (status != HB_STATUS_OK) {
+      // Replace the provisional response with a bare error.
+      c->out_len -= sizeof(HBFrameHeader) + bitmap_len;
+      return appendResponse(c, hdr, status, 0) ? 0 : -1;
+    }
+    return 0;
+  }
+  case HB_OP_MERGE:
+    return appendResponse(c, hdr, handleMerge(s, hdr, &r), 0) ? 0 : -1;
+  case HB_OP_STATS: {
+    HBFilterStats stats;
+    uint8_t status = handleStats(s, &r, &stats);
+    if (status != HB_STATUS_OK) {
+      return appendResponse(c, hdr, status, 0) ? 0 : -1;
+    }
+    if ((out = appendResponse(c, hdr, status, sizeof(stats))) == NULL) {
+      return -1;
+    }
+    memcpy(out, &stats, sizeof(stats));
+    return 0;
+  }
+  default:
+    return appendResponse(c, hdr, HB_STATUS_BAD_REQUEST, 0) ? 0 : -1;
+  }
+}
+
+/**
+ * Reads what the client has sent, up to the read budget. Returns false once
+ * the peer has closed the connection or it failed.
+ */
+static bool readConn(HBConn *c) {
+  size_t budget = HB_READ_BUDGET;
+  while (budget > 0) {
+    if (reserve(&c->in, &c->in_cap, c->in_len + 65536) != 0) {
+      return false;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+    if (n > 0) {
+      c->in_len += (size_t)n;
+      budget = (size_t)n >= budget ? 0 : budget - (size_t)n;
+    } else if (n == 0) {
+      return false;
+    } else if (errno == EINTR) {
+      continue;
+    } else {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+  }
+  return true;
+}
+
+/**
+ * Executes every complete frame in the input buffer. Returns -1 if the
+ * connection has to be dropped (oversized frame or out of memory).
+ */
+static int executeFrames(HBServer *s, HBConn *c) {
+  size_t off = 0;
+  while (c->in_len - off >= sizeof(HBFrameHeader)) {
+    HBFrameHeader hdr;
+    memcpy(&hdr, c->in + off, sizeof(hdr));
+    if (hdr.len > HB_MAX_FRAME) {
+      fprintf(stderr, "Dropping client: frame of %u bytes\n", hdr.len);
+      return -1;
+    }
+    if (c->in_len - off < sizeof(hdr) + hdr.len) {
+      break;
+    }
+    if (handleFrame(s, c, &hdr, c->in + off + sizeof(hdr)) != 0) {
+      return -1;
+    }
+    off += sizeof(hdr) + hdr.len;
+  }
+
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+  return 0;
+}
+
+/**
+ * Writes as much of the buffered responses as the socket takes without
+ * blocking. What the client isn't ready for stays buffered until the socket
+ * is writable again. Returns false if the connection failed.
+ */
+static bool flushConn(HBConn *c) {
+  size_t off = 0;
+  bool ok = true;
+  while (off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + off, c->out_len - off, MSG_NOSIGNAL);
+    if (n >= 0) {
+      off += (size_t)n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      ok = false;
+      break;
+    }
+  }
+  memmove(c->out, c->out + off, c->out_len - off);
+  c->out_len -= off;
+  return ok;
+}
+
+static void closeConn(HBServer *s, HBConn *c) {
+  pthread_mutex_lock(&s->conns_lock);
+  if (c->prev) {
+    c->prev->next_all = c->next_all;
+  } else {
+    s->conns = c->next_all;
+  }
+  if (c->next_all) {
+    c->next_all->prev = c->prev;
+  }
+  pthread_mutex_unlock(&s->conns_lock);
+
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+static void serveConn(HBServer *s, HBConn *c) {
+  // A connection with responses still waiting isn't read until the client
+  // has taken them, so a client that pipelines without reading neither ties
+  // up a worker nor makes the server buffer without bound.
+  if (c->out_len == 0 && !c->eof) {
+    c->eof = !readConn(c);
+    if (executeFrames(s, c) != 0) {
+      closeConn(s, c);
+      return;
+    }
+  }
+  if (!flushConn(c) || (c->eof && c->out_len == 0)) {
+    closeConn(s, c);
+    return;
+  }
+
+  uint32_t events = c->out_len > 0 ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+  struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = c};
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) != 0) {
+    closeConn(s, c);
+  }
+}
+
+static void *workerMain(void *arg) {
+  HBServer *s = arg;
+  for (;;) {
+    pthread_mutex_lock(&s->queue_lock);
+    while (s->ready_head == NULL && !s->stopping) {
+      pthread_cond_wait(&s->queue_cond, &s->queue_lock);
+    }
+    if (s->ready_head == NULL) {
+      pthread_mutex_unlock(&s->queue_lock);
+      return NULL;
+    }
+    HBConn *c = s->ready_head;
+    s->ready_head = c->next_ready;
+    if (s->ready_head == NULL) {
+      s->ready_tail = NULL;
+    }
+    pthread_mutex_unlock(&s->queue_lock);
+
+    serveConn(s, c);
+  }
+}
+
+static void enqueueConn(HBServer *s, HBConn *c) {
+  c->next_ready = NULL;
+  pthread_mutex_lock(&s->queue_lock);
+  if (s->ready_tail) {
+    s->ready_tail->next_ready = c;
+  } else {
+    s->ready_head = c;
+  }
+  s->ready_tail = c;
+  pthread_cond_signal(&s->queue_cond);
+  pthread_mutex_unlock(&s->queue_lock);
+}
+
+static void acceptConns(HBServer *s) {
+  for (;;) {
+    int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("Failed to accept connection");
+      }
+      return;
+    }
+
+    HBConn *c = calloc(1, sizeof(HBConn));
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+
+    pthread_mutex_lock(&s->conns_lock);
+    c->next_all = s->conns;
+    if (s->conns) {
+      s->conns->prev = c;
+    }
+    s->conns = c;
+    pthread_mutex_unlock(&s->conns_lock);
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                             .data.ptr = c};
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      closeConn(s, c);
+    }
+  }
+}
+
+int RunHBServer(HBServer *s) {
+  s->workers = calloc((size_t)s->nworkers, sizeof(pthread_t));
+  if (s->workers == NULL) {
+    perror("Failed to allocate workers.");
+    return -1;
+  }
+  int started = 0;
+  for (; started < s->nworkers; started++) {
+    if (pthread_create(&s->workers[started], NULL, workerMain, s) != 0) {
+      perror("Failed to start worker");
+      break;
+    }
+  }
+
+  bool running = started == s->nworkers;
+  struct epoll_event events[64];
+  while (running) {
+    int n = epoll_wait(s->epoll_fd, events, 64, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait failed");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &s->listen_fd) {
+        acceptConns(s);
+      } else if (events[i].data.ptr == &s->wake_fd) {
+        running = false;
+      } else {
+        enqueueConn(s, events[i].data.ptr);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&s->queue_lock);
+  s->stopping = true;
+  pthread_cond_broadcast(&s->queue_cond);
+  pthread_mutex_unlock(&s->queue_lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(s->workers[i], NULL);
+  }
+  free(s->workers);
+  s->workers = NULL;
+  return started == s->nworkers ? 0 : -1;
+}
+
+void StopHBServer(HBServer *s) {
+  uint64_t one = 1;
+  ssize_t rc = write(s->wake_fd, &one, sizeof(one));
+  (void)rc;
+}
+
+void DestroyHBServer(HBServer *s) {
+  if (s == NULL) {
+    return;
+  }
+
+  while (s->conns) {
+    closeConn(s, s->conns);
+  }
+  while (s->filters) {
+    HBFilterEntry *e = s->filters;
+    s->filters = e->next;
+    DestroyBloomFilter(e->bf);
+    free(e);
+  }
+
+  if (s->listen_fd >= 0) {
+    close(s->listen_fd);
+  }
+  if (s->path[0] != '\0') {
+    unlink(s->path);
+  }
+  if (s->wake_fd >= 0) {
+    close(s->wake_fd);
+  }
+  if (s->epoll_fd >= 0) {
+    close(s->epoll_fd);
+  }
+  pthread_rwlock_destroy(&s->registry_lock);
+  pthread_mutex_destroy(&s->queue_lock);
+  pthread_cond_destroy(&s->queue_cond);
+  pthread_mutex_destroy(&s->conns_lock);
+  free(s);
+}
@@ -0,0 +1,62 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "bloom.h"
+#include "protocol.h"
+
+/**
+ * HBServer hosts named bit-vector BloomFilters in memory and serves them over
+ * the protocol in protocol.h on a Unix domain socket.
+ *
+ * One thread runs an epoll loop that accepts connections and waits for them
+ * to become readable. Readable connections are handed to a pool of worker
+ * threads, which read everything available, execute every complete frame and
+ * write back as much of the responses as the socket takes. A connection with
+ * responses left over waits in the loop for EPOLLOUT, and isn't read again
+ * until they are all written. Connections are registered with EPOLLONESHOT,
+ * so a connection is owned by at most one worker at a time and pipelined
+ * requests are answered in order without any per-connection lock.
+ */
+typedef struct HBServer HBServer;
+
+/**
+ * Largest filter, in bits, a client may CREATE unless the server is given
+ * another limit with SetHBServerMaxSize (2 GiB of memory).
+ */
+#define HB_DEFAULT_MAX_SIZE (1ull << 34)
+
+/**
+ * Create a server listening on the Unix socket at `path` (replacing a stale
+ * socket file if there is one), with `workers` worker threads.
+ */
+HBServer *NewHBServer(const char *path, int workers);
+
+/**
+ * Limit the size, in bits, of filters clients may CREATE. Call before
+ * RunHBServer. Preloaded filters aren't subject to the limit.
+ */
+void SetHBServerMaxSize(HBServer *s, uint64_t size);
+
+/**
+ * Host an existing filter under `name`. The server takes ownership of `bf`.
+ * Used to preload filters saved with Write before serving.
+ */
+int AddHBServerFilter(HBServer *s, const char *name, BloomFilter *bf);
+
+/**
+ * Run the event loop until StopHBServer is called. Returns 0 on a clean stop.
+ */
+int RunHBServer(HBServer *s);
+
+/**
+ * Ask a running server to stop. Safe to call from a signal handler or from
+ * another thread.
+ */
+void StopHBServer(HBServer *s);
+
+/**
+ * Close all connections, free all hosted filters and remove the socket file.
+ */
+void DestroyHBServer(HBServer *s);
+
+#endif // SERVER_H
@@ -1,8 +1,11 @@
 #include "naive.h"
+#include "bitvec.h"
+#include "chunkio.h"
 #include "hashing.h"
+#include "probe.h"
 #include "xxhash.h"
 
-BloomFilter *NewBloomFilter(uint64_t size, int hf) {
+NaiveBloomFilter *NewNaiveBloomFilter(uint64_t size, int hf) {
   if (size < 64) {
     fprintf(stderr, "Filter size must be at least 64\n");
     return NULL;
@@ -12,7 +15,7 @@ BloomFilter *NewBloomFilter(uint64_t size, int hf) {
     return NULL;
   }
 
-  BloomFilter *bf = (BloomFilter *)malloc(sizeof(BloomFilter));
+  NaiveBloomFilter *bf = (NaiveBloomFilter *)malloc(sizeof(NaiveBloomFilter));
   if (!bf) {
     perror("Failed to allocate bloom filter.");
     return NULL;
@@ -20,10 +23,12 @@ BloomFilter *NewBloomFilter(uint64_t size, int hf) {
 
   bf->size = size;
   bf->hf = hf;
-  bf->bv = calloc(size, sizeof(uint8_t));
+  // Padded for the 4 byte gathers in probe.h.
+  bf->bv = calloc(size + PROBE_BYTE_PAD, sizeof(uint8_t));
 
   if (!bf->bv) {
     perror("Failed to allocate byte vector.");
+    free(bf);
     return NULL;
   }
 
@@ -37,7 +42,7 @@ BloomFilter *NewBloomFilter(uint64_t size, int hf) {
   return bf;
 }
 
-void DestroyBloomFilter(BloomFilter *bf) {
+void DestroyNaiveBloomFilter(NaiveBloomFilter *bf) {
   if (bf) {
     pthread_rwlock_destroy(&bf->rwlock);
     free(bf->bv);
@@ -45,7 +50,7 @@ void DestroyBloomFilter(BloomFilter *bf) {
   }
 }
 
-int setByte(BloomFilter *bf, uint64_t idx) {
+int setByte(NaiveBloomFilter *bf, uint64_t idx) {
   if (idx > bf->size - 1) {
     perror("Index cannot be larger than filter size");
     return -1;
@@ -57,7 +62,7 @@ int setByte(BloomFilter *bf, uint64_t idx) {
   return 0;
 }
 
-int setByteAsync(BloomFilter *bf, uint64_t idx) {
+int setByteAsync(NaiveBloomFilter *bf, uint64_t idx) {
   if (idx >= bf->size) {
     fprintf(stderr, "Index can't be larger than filter size\n");
     return -1;
@@ -68,7 +73,7 @@ int setByteAsync(BloomFilter *bf, uint64_t idx) {
   return 0;
 }
 
-bool getByte(BloomFilter *bf, uint64_t idx) {
+bool getByte(NaiveBloomFilter *bf, uint64_t idx) {
   if (idx > bf->size - 1) {
     perror("Index cannot be larger than filter size");
     return -1;
@@ -85,75 +90,183 @@ bool getByte(BloomFilter *bf, uint64_t idx) {
   }
 }
 
-bool getBitAsync(BloomFilter *bf, uint64_t idx) {
+bool getByteAsync(NaiveBloomFilter *bf, uint64_t idx) {
   if (idx >= bf->size) {
     fprintf(stderr, "Index can't be larger than filter size\n");
     return false;
   }
 
-  switch (bf->bv[idx]) {
-  case 1:
-    pthread_rwlock_unlock(&bf->rwlock);
-    return true;
-  default:
-    pthread_rwlock_unlock(&bf->rwlock);
+  // No locking here
+  return bf->bv[idx] == 1;
+}
+
+bool NaiveLookup(NaiveBloomFilter *bf, const char *entry) {
+  uint64_t *hashes = hashEntry(entry, strlen(entry), bf->hf);
+  if (hashes == NULL) {
     return false;
   }
+  bool found = true;
+  for (int i = 0; i < bf->hf && found; i++) {
+    uint64_t lookup_idx = hashes[i] & (bf->size - 1);
+    found = getByte(bf, lookup_idx);
+  }
+  free(hashes);
+  return found;
 }
 
-bool Lookup(BloomFilter *bf, const char *entry) {
+int NaiveInsert(NaiveBloomFilter *bf, const char *entry) {
   uint64_t *hashes = hashEntry(entry, strlen(entry), bf->hf);
-  for (int i = 0; i < bf->hf; i++) {
+  if (hashes == NULL) {
+    return -1;
+  }
+  int rc = 0;
+  for (int i = 0; i < bf->hf && rc == 0; i++) {
     uint64_t lookup_idx = hashes[i] & (bf->size - 1);
-    if (!getByte(bf, lookup_idx)) {
-      return false;
-    }
+    rc = setByte(bf, lookup_idx);
   }
-  return true;
+  free(hashes);
+  return rc;
 }
 
-int Insert(BloomFilter *bf, const char *entry) {
-  uint64_t *hashes = hashEntry(entry, strlen(entry), bf->hf);
+bool NaiveLookupAsync(NaiveBloomFilter *bf, const char *entry) {
+  uint64_t stack[PROBE_STACK_HASHES];
+  uint64_t *hashes = bf->hf <= PROBE_STACK_HASHES
+                         ? stack
+                         : malloc(bf->hf * sizeof(uint64_t));
+  if (hashes == NULL) {
+    perror("Failed to allocate memory for hashes.");
+    return false;
+  }
+
+  // No locking here
+  expandHash(XXH64(entry, strlen(entry), 0), bf->hf, hashes);
+  bool found = probeBytes(bf->bv, bf->size - 1, hashes, bf->hf);
+  if (hashes != stack) {
+    free(hashes);
+  }
+  return found;
+}
+
+int NaiveInsertAsync(NaiveBloomFilter *bf, const char *entry) {
+  uint64_t stack[PROBE_STACK_HASHES];
+  uint64_t *hashes = bf->hf <= PROBE_STACK_HASHES
+                         ? stack
+                         : malloc(bf->hf * sizeof(uint64_t));
+  if (hashes == NULL) {
+    perror("Failed to allocate memory for hashes.");
+    return -1;
+  }
+
+  // No locking here
+  expandHash(XXH64(entry, strlen(entry), 0), bf->hf, hashes);
   for (int i = 0; i < bf->hf; i++) {
-    uint64_t lookup_idx = hashes[i] & (bf->size - 1);
-    if (setByte(bf, lookup_idx) != 0) {
-      return -1;
-    }
+    uint64_t idx = hashes[i] & (bf->size - 1);
+    bf->bv[idx] = 1;
+  }
+  if (hashes != stack) {
+    free(hashes);
   }
   return 0;
 }
 
-int Write(BloomFilter *bf, const char *filename) {
-  FILE *f = fopen(filename, "wb");
-  if (f == NULL) {
-    perror("Failed to open file for writing");
+/**
+ * Prefetch every byte the block of hashes is about to touch so the probing
+ * pass overlaps its cache misses instead of taking them one at a time.
+ */
+static void prefetchBlock(NaiveBloomFilter *bf, const uint64_t *hashes,
+                          size_t count, uint64_t *expanded, int rw) {
+  for (size_t j = 0; j < count; j++) {
+    expandHash(hashes[j], bf->hf, expanded);
+    for (int i = 0; i < bf->hf; i++) {
+      uint64_t idx = expanded[i] & (bf->size - 1);
+      if (rw) {
+        __builtin_prefetch(&bf->bv[idx], 1);
+      } else {
+        __builtin_prefetch(&bf->bv[idx], 0);
+      }
+    }
+  }
+}
+
+int NaiveInsertBatch(NaiveBloomFilter *bf, const uint8_t *keys, size_t width,
+                     size_t n) {
+  uint64_t hashes[BATCH_BLOCK];
+  uint64_t *expanded = malloc(bf->hf * sizeof(uint64_t));
+  if (expanded == NULL) {
+    perror("Failed to allocate memory for hashes.");
     return -1;
   }
 
-  printf("Writing byte vector to file...\n");
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_wrlock(&bf->rwlock);
+    prefetchBlock(bf, hashes, count, expanded, 1);
+    for (size_t j = 0; j < count; j++) {
+      expandHash(hashes[j], bf->hf, expanded);
+      for (int i = 0; i < bf->hf; i++) {
+        bf->bv[expanded[i] & (bf->size - 1)] = 1;
+      }
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+  }
 
-  // Write the size and number of hash functions
-  if (fwrite(&bf->size, sizeof(uint64_t), 1, f) != 1 ||
-      fwrite(&bf->hf, sizeof(int), 1, f) != 1) {
-    perror("Failed to write filter metadata");
-    fclose(f);
+  free(expanded);
+  return 0;
+}
+
+int NaiveLookupBatch(NaiveBloomFilter *bf, const uint8_t *keys, size_t width,
+                     size_t n, bool *out) {
+  uint64_t hashes[BATCH_BLOCK];
+  uint64_t *expanded = malloc(bf->hf * sizeof(uint64_t));
+  if (expanded == NULL) {
+    perror("Failed to allocate memory for hashes.");
     return -1;
   }
 
-  // Write the byte vector
-  size_t bv_size = bf->size;
-  if (fwrite(bf->bv, sizeof(uint8_t), bv_size, f) != bv_size) {
-    perror("Failed to write byte vector");
-    fclose(f);
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+
+    pthread_rwlock_rdlock(&bf->rwlock);
+    prefetchBlock(bf, hashes, count, expanded, 0);
+    for (size_t j = 0; j < count; j++) {
+      bool found = true;
+      expandHash(hashes[j], bf->hf, expanded);
+      for (int i = 0; i < bf->hf && found; i++) {
+        found = bf->bv[expanded[i] & (bf->size - 1)] == 1;
+      }
+      out[start + j] = found;
+    }
+    pthread_rwlock_unlock(&bf->rwlock);
+  }
+
+  free(expanded);
+  return 0;
+}
+
+int NaiveWrite(NaiveBloomFilter *bf, const char *filename) {
+  printf("Writing byte vector to file...\n");
+
+  pthread_rwlock_rdlock(&bf->rwlock);
+  BloomFileMeta meta = {.size = bf->size, .hf = (uint64_t)bf->hf};
+  int rc = WriteChunkedFile(filename, CHUNKED_KIND_NAIVE, &meta, sizeof(meta),
+                            bf->bv, bf->size, CHUNKED_FILE_CHUNK_SIZE, 0);
+  pthread_rwlock_unlock(&bf->rwlock);
+  if (rc != 0) {
     return -1;
   }
 
-  fclose(f);
   printf("Successfully wrote byte-vector to file: %s\n", filename);
   return 0;
 }
 
-BloomFilter *Load(const char *filename) {
+/**
+ * Reads a file in the original unchunked layout: size, number of hash
+ * functions, then the raw byte vector.
+ */
+static NaiveBloomFilter *loadLegacy(const char *filename) {
   FILE *f = fopen(filename, "rb");
   if (f == NULL) {
     perror("Failed to open file for reading");
@@ -171,7 +284,8 @@ BloomFilter *Load(const char *filename) {
     return NULL;
   }
 
-  BloomFilter *bf = NewBloomFilter(size, hf);
+  // Legacy files predate double hashing.
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(size, singleHashHf(hf));
   if (bf == NULL) {
     fclose(f);
     return NULL;
@@ -181,38 +295,165 @@ BloomFilter *Load(const char *filename) {
   size_t bv_size = size;
   if (fread(bf->bv, sizeof(uint8_t), bv_size, f) != bv_size) {
     perror("Failed to read byte vector");
-    DestroyBloomFilter(bf);
+    DestroyNaiveBloomFilter(bf);
     fclose(f);
     return NULL;
   }
 
   fclose(f);
-  printf("Loaded bitvector from file: %s\n", filename);
   return bf;
 }
 
 /**
- * Function to merge a loaded BloomFilter with an existing one
+ * Reads a chunked file, folding it by `factor` (a power of 2) on the way in.
+ * Falls back to the legacy layout, folded after loading, when the file isn't
+ * chunked.
+ */
+static NaiveBloomFilter *loadChunked(const char *filename, uint64_t factor) {
+  BloomFileMeta meta;
+  NaiveBloomFilter *bf;
+  ChunkedFile *cf =
+      OpenChunkedFile(filename, CHUNKED_KIND_NAIVE, &meta, sizeof(meta));
+
+  if (cf == NULL) {
+    if (errno != EILSEQ) {
+      return NULL;
+    }
+    bf = loadLegacy(filename);
+    if (bf != NULL && FoldNaiveBloomFilter(bf, factor) != 0) {
+      DestroyNaiveBloomFilter(bf);
+      return NULL;
+    }
+  } else {
+    bf = meta.size / factor >= 64
+             ? NewNaiveBloomFilter(meta.size / factor, (int)meta.hf)
+             : NULL;
+    if (bf == NULL || cf->hdr.payload_len != meta.size) {
+      fprintf(stderr, "%s: bad filter metadata\n", filename);
+      DestroyNaiveBloomFilter(bf);
+      CloseChunkedFile(cf);
+      return NULL;
+    }
+
+    int64_t corrupt = factor == 1
+                          ? ReadChunkedPayload(cf, bf->bv, 0)
+                          : ReadChunkedPayloadFolded(cf, bf->bv, bf->size, 0);
+    CloseChunkedFile(cf);
+    if (corrupt != 0) {
+      if (corrupt > 0) {
+        fprintf(stderr, "%s: %lld corrupt chunk(s), refusing to load\n",
+                filename, (long long)corrupt);
+      }
+      DestroyNaiveBloomFilter(bf);
+      return NULL;
+    }
+  }
+
+  if (bf != NULL) {
+    printf("Loaded byte vector from file: %s\n", filename);
+  }
+  return bf;
+}
+
+NaiveBloomFilter *NaiveLoad(const char *filename) {
+  return loadChunked(filename, 1);
+}
+
+NaiveBloomFilter *NaiveLoadFolded(const char *filename, uint64_t factor,
+                                  double target_fpr) {
+  if (factor == 0) {
+    NaiveBloomFilter *bf = NaiveLoad(filename);
+    if (bf != NULL &&
+        FoldNaiveBloomFilter(bf, NaiveFoldFactor(bf, target_fpr)) != 0) {
+      DestroyNaiveBloomFilter(bf);
+      return NULL;
+    }
+    return bf;
+  }
+  if ((factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return NULL;
+  }
+  return loadChunked(filename, factor);
+}
+
+int FoldNaiveBloomFilter(NaiveBloomFilter *bf, uint64_t factor) {
+  if (factor == 0 || (factor & (factor - 1)) != 0) {
+    fprintf(stderr, "Fold factor must be a power of 2\n");
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&bf->rwlock);
+  if (bf->size / factor < 64) {
+    pthread_rwlock_unlock(&bf->rwlock);
+    fprintf(stderr, "Folded filter size must be at least 64\n");
+    return -1;
+  }
+  if (factor > 1) {
+    // Folded in place, as in FoldBloomFilter. The padding the gathers read
+    // past the end is now the start of the unused upper part.
+    foldVector(bf->bv, bf->size, factor);
+    bf->size /= factor;
+  }
+  pthread_rwlock_unlock(&bf->rwlock);
+  return 0;
+}
+
+double NaiveFillRatio(NaiveBloomFilter *bf) {
+  pthread_rwlock_rdlock(&bf->rwlock);
+  double fill = (double)countBits(bf->bv, bf->size) / (double)bf->size;
+  pthread_rwlock_unlock(&bf->rwlock);
+  return fill;
+}
+
+uint64_t NaiveFoldFactor(NaiveBloomFilter *bf, double target_fpr) {
+  pthread_rwlock_rdlock(&bf->rwlock);
+  uint64_t factor = foldFactorFor(countBits(bf->bv, bf->size), bf->size,
+                                  bf->hf, 64, target_fpr);
+  pthread_rwlock_unlock(&bf->rwlock);
+  return factor;
+}
+
+/**
+ * Merges the filter saved in `filename` into `bf`, folding `bf` down to the
+ * size of a smaller file if `fold` is set.
  */
-int MergeBloomFilter(BloomFilter *bf, const char *filename) {
-  BloomFilter *loaded_bf = Load(filename);
+static int mergeFile(NaiveBloomFilter *bf, const char *filename, bool fold) {
+  NaiveBloomFilter *loaded_bf = NaiveLoad(filename);
   if (loaded_bf == NULL) {
     return -1;
   }
 
-  if (bf->size != loaded_bf->size || bf->hf != loaded_bf->hf) {
-    fprintf(stderr, "Mismatch in BloomFilter parameters\n");
-    DestroyBloomFilter(loaded_bf);
+  if (bf->hf != loaded_bf->hf) {
+    fprintf(stderr, "Mismatch in NaiveBloomFilter parameters\n");
+    DestroyNaiveBloomFilter(loaded_bf);
     return -1;
   }
 
-  size_t bv_size = bf->size;
+  // A larger file is folded down as it is OR-ed in. A smaller one means
+  // folding `bf`, which only happens if the caller asked for it.
   pthread_rwlock_wrlock(&bf->rwlock);
-  for (size_t i = 0; i < bv_size; i++) {
-    bf->bv[i] |= loaded_bf->bv[i];
+  int rc = 0;
+  if (bf->size > loaded_bf->size && fold) {
+    foldVector(bf->bv, bf->size, bf->size / loaded_bf->size);
+    bf->size = loaded_bf->size;
+  }
+  if (bf->size <= loaded_bf->size) {
+    orFolded(bf->bv, bf->size, loaded_bf->bv, loaded_bf->size);
+  } else {
+    fprintf(stderr, "Filter in file is smaller; fold the filter first\n");
+    rc = -1;
   }
   pthread_rwlock_unlock(&bf->rwlock);
 
-  DestroyBloomFilter(loaded_bf);
-  return 0;
+  DestroyNaiveBloomFilter(loaded_bf);
+  return rc;
+}
+
+int MergeNaiveBloomFilter(NaiveBloomFilter *bf, const char *filename) {
+  return mergeFile(bf, filename, false);
+}
+
+int MergeNaiveBloomFilterFolding(NaiveBloomFilter *bf, const char *filename) {
+  return mergeFile(bf, filename, true);
 }
\ No newline at end of file
@@ -1,3 +1,6 @@
+#ifndef NAIVE_H
+#define NAIVE_H
+
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
@@ -30,8 +33,8 @@
  * assigned to a whole byte. This alignment can lead to faster memory access on
  * many hardware architectures.
  */
-typedef struct BloomFilter {
-  uint8_t *bv;   // Bit vector
+typedef struct NaiveBloomFilter {
+  uint8_t *bv;   // Bit vector, padded by PROBE_BYTE_PAD bytes (probe.h)
   uint64_t size; // Size of bit vector. Must be a power of 2.
   int hf;        // Number of hash functions
 
@@ -43,7 +46,7 @@ typedef struct BloomFilter {
    * until all active readers finish.
    */
   pthread_rwlock_t rwlock;
-} BloomFilter;
+} NaiveBloomFilter;
 
 /**
  * Create and return a pointer to a new Bloom filter, given a size and number of
@@ -53,12 +56,12 @@ typedef struct BloomFilter {
  * - `size`: the size (in bits) of the filter
  * - `hf`: number of hash functions to apply in the filter.
  */
-BloomFilter *NewBloomFilter(uint64_t size, int hf);
+NaiveBloomFilter *NewNaiveBloomFilter(uint64_t size, int hf);
 
 /**
  * Manually free a Bloom filter after use in order to avoid memory leaks.
  */
-void DestroyBloomFilter(BloomFilter *bf);
+void DestroyNaiveBloomFilter(NaiveBloomFilter *bf);
 
 /**
  * Function to set a byte in the filter at a particular position.
@@ -66,7 +69,7 @@ void DestroyBloomFilter(BloomFilter *bf);
  * - `bf`: Bloom filter
  * - `idx`: index at which the byte needs to be set.
  */
-int setByte(BloomFilter *bf, uint64_t idx);
+int setByte(NaiveBloomFilter *bf, uint64_t idx);
 
 /**
  * Asynchronous function to set a byte in the filter at a particular position.
@@ -76,7 +79,7 @@ int setByte(BloomFilter *bf, uint64_t idx);
  * - `bf`: Bloom filter
  * - `idx`: index at which the byte needs to be set.
  */
-int setByteAsync(BloomFilter *bf, uint64_t idx);
+int setByteAsync(NaiveBloomFilter *bf, uint64_t idx);
 
 /**
  * Function to read a byte at a position from the filter.
@@ -85,7 +88,7 @@ int setByteAsync(BloomFilter *bf, uint64_t idx);
  * - `bf`: Bloom filter
  * - `idx`: index from which the byte needs to be read.
  */
-bool getByte(BloomFilter *bf, uint64_t idx);
+bool getByte(NaiveBloomFilter *bf, uint64_t idx);
 
 /**
  * Asynchronous function to read a byte at a position from the filter.
@@ -96,7 +99,7 @@ bool getByte(BloomFilter *bf, uint64_t idx);
  * - `bf`: Bloom filter
  * - `idx`: index from which the byte needs to be read.
  */
-bool getByteAsync(BloomFilter *bf, uint64_t idx);
+bool getByteAsync(NaiveBloomFilter *bf, uint64_t idx);
 
 /**
  * Looks up an entry into the NaiveBloomFilter. Returns true if a match is
@@ -108,33 +111,112 @@ bool getByteAsync(BloomFilter *bf, uint64_t idx);
  * - `bf`: Bloom filter
  * - `entry`: string that needs to be added to the bloom filter
  */
-bool Lookup(BloomFilter *bf, const char *entry);
+bool NaiveLookup(NaiveBloomFilter *bf, const char *entry);
 
 /**
  * Inserts an entry into the filter.
  * This performs a writer lock on the filter (all readers must wait until
  * the active writer finishes and releases the lock).
  */
-int Insert(BloomFilter *bf, const char *entry);
+int NaiveInsert(NaiveBloomFilter *bf, const char *entry);
+
+/**
+ * Looks up an entry without taking the lock. All of the entry's positions are
+ * fetched at once with AVX2/AVX-512 gathers (a scalar loop elsewhere) and
+ * checked without branching, so this is much faster than NaiveLookup on filters
+ * that fit in cache. To be used when nothing inserts concurrently.
+ */
+bool NaiveLookupAsync(NaiveBloomFilter *bf, const char *entry);
+
+/**
+ * Inserts an entry without taking the lock. To be used in a single threaded
+ * context to avoid the mutex wait.
+ */
+int NaiveInsertAsync(NaiveBloomFilter *bf, const char *entry);
+
+/**
+ * Inserts `n` fixed-width keys into the filter. The keys are laid out back to
+ * back in `keys`, `width` bytes each (e.g. 16 byte UUIDs). Keys are hashed
+ * several at a time with the vectorized kernels in hashing.h and the writer
+ * lock is taken once per block of keys rather than once per byte.
+ *
+ * A key inserted here is found by NaiveLookup on the same bytes and vice
+ * versa.
+ */
+int NaiveInsertBatch(NaiveBloomFilter *bf, const uint8_t *keys, size_t width,
+                     size_t n);
+
+/**
+ * Looks up `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each. `out[i]` is set to true if the i-th key may be in the filter. Takes the
+ * reader lock once per block of keys.
+ */
+int NaiveLookupBatch(NaiveBloomFilter *bf, const uint8_t *keys, size_t width,
+                     size_t n, bool *out);
+
+/**
+ * Flushes the Bloom filter to a file. The byte vector is written in
+ * checksummed chunks, like Write in bloom.h.
+ */
+int NaiveWrite(NaiveBloomFilter *bf, const char *filename);
+
+/**
+ * Reads an existing Bloom filter from a file. Files in the original unchunked
+ * layout are still accepted.
+ */
+NaiveBloomFilter *NaiveLoad(const char *filename);
+
+/**
+ * Like NaiveLoad, but folds the filter by `factor` (a power of 2) as it is
+ * read. With a `factor` of 0 the filter is loaded whole and folded by
+ * NaiveFoldFactor(bf, target_fpr). See LoadFolded in bloom.h.
+ */
+NaiveBloomFilter *NaiveLoadFolded(const char *filename, uint64_t factor,
+                                  double target_fpr);
 
 /**
- * Flushes the Bloom filter to a file.
+ * Shrinks the filter to `size / factor` bytes, for a power of 2 `factor`, by
+ * OR-ing the upper parts of the byte vector into the lowest one. Like
+ * FoldBloomFilter in bloom.h, it folds in place and must not run alongside
+ * NaiveLookupAsync, NaiveInsertAsync, getByteAsync or setByteAsync.
  */
-int Write(BloomFilter *bf, const char *filename);
+int FoldNaiveBloomFilter(NaiveBloomFilter *bf, uint64_t factor);
 
 /**
- * Reads an existing Bloom filter from a file.
+ * Fraction of the filter's bytes that are set.
  */
-BloomFilter *Load(const char *filename);
+double NaiveFillRatio(NaiveBloomFilter *bf);
 
 /**
- * Function to merge a loaded BloomFilter with an existing one
+ * The largest fold factor that keeps the estimated false positive rate at or
+ * under `target_fpr` (1 if the filter can't be folded).
  */
-int MergeBloomFilter(BloomFilter *bf, const char *filename);
+uint64_t NaiveFoldFactor(NaiveBloomFilter *bf, double target_fpr);
+
+/**
+ * Function to merge a loaded NaiveBloomFilter with an existing one. A larger
+ * filter in the file is folded down to the size of `bf` as it is merged. A
+ * smaller one is refused; to merge it, fold `bf` down to its size first or
+ * use MergeNaiveBloomFilterFolding.
+ */
+int MergeNaiveBloomFilter(NaiveBloomFilter *bf, const char *filename);
+
+/**
+ * Like MergeNaiveBloomFilter, but a smaller filter in the file is merged by
+ * first folding `bf` down to its size (see FoldNaiveBloomFilter).
+ */
+int MergeNaiveBloomFilterFolding(NaiveBloomFilter *bf, const char *filename);
 
 /**
  * Testing functions to verify intended functionality.
  */
 void TestBFSetByte();
-void TestNewBloomFilter();
-void TestBloomFilter();
\ No newline at end of file
+void TestNewNaiveBloomFilter();
+void TestNaiveBloomFilter();
+void TestNaiveBatch();
+void TestNaiveWriteLoad();
+void TestNaiveFold();
+void TestNaiveAsync();
+void TestNaiveCompat();
+
+#endif // NAIVE_H
@@ -0,0 +1,57 @@
+#ifndef NAIVE_COMPAT_H
+#define NAIVE_COMPAT_H
+
+#include "naive.h"
+
+/**
+ * The names the byte-vector filter had before it took the `Naive` prefix, for
+ * callers that haven't moved over yet. They clash with bloom/bloom.h, so this
+ * header can't be used in a file that also includes it. Include it instead of
+ * naive.h; every name here is deprecated.
+ */
+
+#ifdef BLOOM_H
+#error "naive_compat.h can't be used together with bloom.h"
+#endif
+
+#define HB_NAIVE_DEPRECATED(replacement)                                      \
+  __attribute__((deprecated("use " replacement)))
+
+typedef NaiveBloomFilter BloomFilter;
+
+HB_NAIVE_DEPRECATED("NewNaiveBloomFilter")
+static inline BloomFilter *NewBloomFilter(uint64_t size, int hf) {
+  return NewNaiveBloomFilter(size, hf);
+}
+
+HB_NAIVE_DEPRECATED("DestroyNaiveBloomFilter")
+static inline void DestroyBloomFilter(BloomFilter *bf) {
+  DestroyNaiveBloomFilter(bf);
+}
+
+HB_NAIVE_DEPRECATED("NaiveLookup")
+static inline bool Lookup(BloomFilter *bf, const char *entry) {
+  return NaiveLookup(bf, entry);
+}
+
+HB_NAIVE_DEPRECATED("NaiveInsert")
+static inline int Insert(BloomFilter *bf, const char *entry) {
+  return NaiveInsert(bf, entry);
+}
+
+HB_NAIVE_DEPRECATED("NaiveWrite")
+static inline int Write(BloomFilter *bf, const char *filename) {
+  return NaiveWrite(bf, filename);
+}
+
+HB_NAIVE_DEPRECATED("NaiveLoad")
+static inline BloomFilter *Load(const char *filename) {
+  return NaiveLoad(filename);
+}
+
+HB_NAIVE_DEPRECATED("MergeNaiveBloomFilter")
+static inline int MergeBloomFilter(BloomFilter *bf, const char *filename) {
+  return MergeNaiveBloomFilter(bf, filename);
+}
+
+#endif // NAIVE_COMPAT_H
@@ -4,20 +4,25 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "naive.h"
+#include "naive_compat.h"
 
 int main() {
   printf("Running tests...\n");
   TestBFSetByte();
-  TestNewBloomFilter();
-  TestBloomFilter();
+  TestNewNaiveBloomFilter();
+  TestNaiveBloomFilter();
+  TestNaiveBatch();
+  TestNaiveWriteLoad();
+  TestNaiveFold();
+  TestNaiveAsync();
+  TestNaiveCompat();
   printf("All tests passed!\n");
   return 0;
 }
 
 void TestBFSetByte() {
-  BloomFilter *bf = NewBloomFilter(1048576, 4);
-  assert(bf != NULL, "NewBloomFilter should not return NULL");
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewNaiveBloomFilter should not return NULL");
 
   int err = setByte(bf, 100);
   assert(err == 0, "setByte should not return an error");
@@ -28,24 +33,26 @@ void TestBFSetByte() {
   bool falseBit = getByte(bf, 1048575);
   assert(!falseBit, "Byte 1048575 should not be set");
 
-  DestroyBloomFilter(bf);
+  DestroyNaiveBloomFilter(bf);
   printf("TestBFSetBit passed\n");
 }
 
-void TestNewBloomFilter() {
-  BloomFilter *bf = NewBloomFilter(100000, 4);
-  assert(bf == NULL, "NewBloomFilter should return NULL for invalid size");
+void TestNewNaiveBloomFilter() {
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(100000, 4);
+  assert(bf == NULL,
+         "NewNaiveBloomFilter should return NULL for invalid size");
 
-  bf = NewBloomFilter(1048576, 4);
-  assert(bf != NULL, "NewBloomFilter should not return NULL for valid size");
+  bf = NewNaiveBloomFilter(1048576, 4);
+  assert(bf != NULL,
+         "NewNaiveBloomFilter should not return NULL for valid size");
 
-  DestroyBloomFilter(bf);
-  printf("TestNewBloomFilter passed\n");
+  DestroyNaiveBloomFilter(bf);
+  printf("TestNewNaiveBloomFilter passed\n");
 }
 
-void TestBloomFilter() {
-  BloomFilter *bf = NewBloomFilter(1048576, 4);
-  assert(bf != NULL, "NewBloomFilter should not return NULL");
+void TestNaiveBloomFilter() {
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewNaiveBloomFilter should not return NULL");
 
   const char *e1 = "b99afb65c9f97b2e0feea844eea55f69";
   const char *e2 = "f530e3093a1617d64f400c5578005b7c";
@@ -56,21 +63,214 @@ void TestBloomFilter() {
   const char *fake3 = "turnips";
   const char *fake4 = "lavacakes";
 
-  assert(Insert(bf, e1) == 0, "Insert should not return an error");
-  assert(Insert(bf, e2) == 0, "Insert should not return an error");
-  assert(Insert(bf, e3) == 0, "Insert should not return an error");
-  assert(Insert(bf, e4) == 0, "Insert should not return an error");
+  assert(NaiveInsert(bf, e1) == 0, "NaiveInsert should not return an error");
+  assert(NaiveInsert(bf, e2) == 0, "NaiveInsert should not return an error");
+  assert(NaiveInsert(bf, e3) == 0, "NaiveInsert should not return an error");
+  assert(NaiveInsert(bf, e4) == 0, "NaiveInsert should not return an error");
+
+  assert(NaiveLookup(bf, e1), "e1 should exist in the filter");
+  assert(NaiveLookup(bf, e2), "e2 should exist in the filter");
+  assert(NaiveLookup(bf, e3), "e3 should exist in the filter");
+  assert(NaiveLookup(bf, e4), "e4 should exist in the filter");
+
+  assert(!NaiveLookup(bf, fake1), "fake1 should not exist in the filter");
+  assert(!NaiveLookup(bf, fake2), "fake2 should not exist in the filter");
+  assert(!NaiveLookup(bf, fake3), "fake3 should not exist in the filter");
+  assert(!NaiveLookup(bf, fake4), "fake4 should not exist in the filter");
+
+  DestroyNaiveBloomFilter(bf);
+  printf("TestNaiveBloomFilter passed\n");
+}
+
+void TestNaiveBatch() {
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewNaiveBloomFilter should not return NULL");
+
+  const char *present = "b99afb65c9f97b2e0feea844eea55f69"
+                        "f530e3093a1617d64f400c5578005b7c"
+                        "b29317ac342ceafc79e59996678efeb3"
+                        "00421829519ccc2834eedc2bac21df68";
+  const char *absent = "hahaidontexisthahaidontexist0000"
+                       "foobarfoobarfoobarfoobarfoobar00";
+  bool found[4];
+
+  assert(NaiveInsertBatch(bf, (const uint8_t *)present, 32, 4) == 0,
+         "NaiveInsertBatch should not return an error");
+
+  // Batch inserts must be visible to single-key lookups.
+  char key[33] = {0};
+  for (int i = 0; i < 4; i++) {
+    memcpy(key, present + i * 32, 32);
+    assert(NaiveLookup(bf, key),
+           "Batch inserted key should exist in the filter");
+  }
+
+  assert(NaiveLookupBatch(bf, (const uint8_t *)present, 32, 4, found) == 0,
+         "NaiveLookupBatch should not return an error");
+  for (int i = 0; i < 4; i++) {
+    assert(found[i], "Batch inserted key should be found by LookupBatch");
+  }
+
+  assert(NaiveLookupBatch(bf, (const uint8_t *)absent, 32, 2, found) == 0,
+         "NaiveLookupBatch should not return an error");
+  assert(!found[0] && !found[1], "Absent keys should not exist in the filter");
+
+  DestroyNaiveBloomFilter(bf);
+  printf("TestNaiveBatch passed\n");
+}
+
+void TestNaiveWriteLoad() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-naive-%d.bf", (int)getpid());
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewNaiveBloomFilter should not return NULL");
+  assert(NaiveInsert(bf, "b99afb65c9f97b2e0feea844eea55f69") == 0,
+         "NaiveInsert should not return an error");
+
+  assert(NaiveWrite(bf, path) == 0, "NaiveWrite should not fail");
+  NaiveBloomFilter *loaded = NaiveLoad(path);
+  assert(loaded != NULL, "NaiveLoad should not return NULL");
+  assert(loaded->size == bf->size && loaded->hf == bf->hf,
+         "Loaded filter parameters should match");
+  assert(memcmp(loaded->bv, bf->bv, bf->size) == 0,
+         "Loaded byte vector should match");
+  assert(NaiveLookup(loaded, "b99afb65c9f97b2e0feea844eea55f69"),
+         "Inserted key should exist in the loaded filter");
+  DestroyNaiveBloomFilter(loaded);
 
-  assert(Lookup(bf, e1), "e1 should exist in the filter");
-  assert(Lookup(bf, e2), "e2 should exist in the filter");
-  assert(Lookup(bf, e3), "e3 should exist in the filter");
-  assert(Lookup(bf, e4), "e4 should exist in the filter");
+  // Files in the original layout: size, hash functions, raw byte vector.
+  FILE *f = fopen(path, "wb");
+  assert(f != NULL, "fopen should not fail");
+  int hf = bf->hf;
+  fwrite(&bf->size, sizeof(uint64_t), 1, f);
+  fwrite(&hf, sizeof(int), 1, f);
+  fwrite(bf->bv, 1, bf->size, f);
+  fclose(f);
 
-  assert(!Lookup(bf, fake1), "fake1 should not exist in the filter");
-  assert(!Lookup(bf, fake2), "fake2 should not exist in the filter");
-  assert(!Lookup(bf, fake3), "fake3 should not exist in the filter");
-  assert(!Lookup(bf, fake4), "fake4 should not exist in the filter");
+  loaded = NaiveLoad(path);
+  assert(loaded != NULL, "NaiveLoad should read the legacy layout");
+  assert(loaded->hf == 1,
+         "Legacy filters predate double hashing: one hash function");
+  assert(memcmp(loaded->bv, bf->bv, bf->size) == 0,
+         "Legacy byte vector should match");
+  DestroyNaiveBloomFilter(loaded);
 
+  unlink(path);
+  DestroyNaiveBloomFilter(bf);
+  printf("TestNaiveWriteLoad passed\n");
+}
+
+void TestNaiveFold() {
+  NaiveBloomFilter *bf = NewNaiveBloomFilter(1048576, 4);
+  assert(bf != NULL, "NewNaiveBloomFilter should not return NULL");
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    NaiveInsert(bf, key);
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-nfold-%d.bf", (int)getpid());
+  assert(NaiveWrite(bf, path) == 0, "NaiveWrite should not fail");
+
+  // 1000 keys of 4 bytes in 2^20 bytes: folding by 8 keeps the false
+  // positive rate under 2e-6 (about 8e-7), folding by 16 doesn't (about 1e-5).
+  uint64_t factor = NaiveFoldFactor(bf, 2e-6);
+  assert(factor == 8, "Fold factor for a 2e-6 target should be 8");
+  assert(FoldNaiveBloomFilter(bf, factor) == 0,
+         "FoldNaiveBloomFilter should not fail");
+  assert(bf->size == 131072, "Folded filter should be 2^17 bytes");
+  double fill = NaiveFillRatio(bf);
+  assert(fill * fill * fill * fill <= 2e-6,
+         "Folded filter should meet the target");
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(NaiveLookup(bf, key), "Keys should survive folding");
+  }
+
+  // Folding on load gives the same bytes as folding in memory.
+  NaiveBloomFilter *loaded = NaiveLoadFolded(path, 8, 0);
+  assert(loaded != NULL, "NaiveLoadFolded should not return NULL");
+  assert(loaded->size == bf->size, "Folded sizes should match");
+  assert(memcmp(loaded->bv, bf->bv, bf->size) == 0,
+         "Streamed fold should match folding in memory");
+  DestroyNaiveBloomFilter(loaded);
+
+  // Merging filters of different sizes folds the larger one.
+  NaiveBloomFilter *small = NewNaiveBloomFilter(65536, 4);
+  NaiveInsert(small, "small-key");
+  assert(MergeNaiveBloomFilter(small, path) == 0,
+         "Merging a larger filter should fold it");
+  assert(small->size == 65536, "Smaller filter should keep its size");
+  assert(NaiveLookup(small, "key-1") && NaiveLookup(small, "small-key"),
+         "Merged filter should have both filters' keys");
+
+  unlink(path);
+  DestroyNaiveBloomFilter(small);
+  DestroyNaiveBloomFilter(bf);
+  printf("TestNaiveFold passed\n");
+}
+
+void TestNaiveAsync() {
+  // Hash counts that fill, split and overrun the gather vectors.
+  int hfs[] = {1, 3, 4, 8, 9, 17, 70};
+  char key[32];
+
+  for (size_t h = 0; h < sizeof(hfs) / sizeof(hfs[0]); h++) {
+    NaiveBloomFilter *bf = NewNaiveBloomFilter(4096, hfs[h]);
+    assert(bf != NULL, "NewNaiveBloomFilter should not return NULL");
+    for (int i = 0; i < 300; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      if (i % 2 == 0) {
+        assert(NaiveInsert(bf, key) == 0, "NaiveInsert should not fail");
+      } else {
+        assert(NaiveInsertAsync(bf, key) == 0,
+               "NaiveInsertAsync should not fail");
+      }
+    }
+
+    for (int i = 0; i < 300; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      assert(NaiveLookupAsync(bf, key), "Inserted key should be found");
+    }
+    // Unlocked lookups answer exactly like the locked ones.
+    for (int i = 300; i < 3000; i++) {
+      snprintf(key, sizeof(key), "key-%d", i);
+      assert(NaiveLookupAsync(bf, key) == NaiveLookup(bf, key),
+             "NaiveLookupAsync should agree with NaiveLookup");
+    }
+    DestroyNaiveBloomFilter(bf);
+  }
+
+  printf("TestNaiveAsync passed\n");
+}
+
+// The old names are deprecated; this test is the one place meant to use them.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+void TestNaiveCompat() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/hyperbloom-compat-%d.bf", (int)getpid());
+  BloomFilter *bf = NewBloomFilter(65536, 4);
+  assert(bf != NULL, "NewBloomFilter should not return NULL");
+  assert(Insert(bf, "b99afb65c9f97b2e0feea844eea55f69") == 0,
+         "Insert should not return an error");
+  assert(Lookup(bf, "b99afb65c9f97b2e0feea844eea55f69"),
+         "Inserted key should exist in the filter");
+  assert(NaiveLookup(bf, "b99afb65c9f97b2e0feea844eea55f69"),
+         "The old names should act on the same filter");
+
+  assert(Write(bf, path) == 0, "Write should not fail");
+  BloomFilter *loaded = Load(path);
+  assert(loaded != NULL, "Load should not return NULL");
+  assert(Lookup(loaded, "b99afb65c9f97b2e0feea844eea55f69"),
+         "Inserted key should exist in the loaded filter");
+  assert(MergeBloomFilter(loaded, path) == 0,
+         "MergeBloomFilter should not fail");
+
+  unlink(path);
+  DestroyBloomFilter(loaded);
   DestroyBloomFilter(bf);
-  printf("TestBloomFilter passed\n");
-}
\ No newline at end of file
+  printf("TestNaiveCompat passed\n");
+}
+#pragma GCC diagnostic pop
@@ -0,0 +1,205 @@
+#include "register.h"
+#include "hashing.h"
+#include "xxhash.h"
+
+#include <string.h>
+
+/**
+ * Bytes before each filter's words, holding its RegisterBloomFilter. Also the
+ * size of the link at the start of a slab. Keeps the words cache line
+ * aligned.
+ */
+#define HEADER_BYTES 64
+
+/**
+ * Pools allocate slabs of at least this many bytes.
+ */
+#define SLAB_BYTES (64 * 1024)
+
+_Static_assert(sizeof(RegisterBloomFilter) <= HEADER_BYTES,
+               "RegisterBloomFilter must fit in its header");
+
+/**
+ * Bytes taken by one filter of `size` bits, header included. Every filter
+ * gets at least a cache line of words so the next header starts on a line.
+ */
+static size_t filterBytes(uint64_t size) {
+  return HEADER_BYTES + (size / 8 < 64 ? 64 : size / 8);
+}
+
+/**
+ * Sets up the filter whose header starts at `mem`.
+ */
+static RegisterBloomFilter *initFilter(uint8_t *mem, uint64_t size, int hf,
+                                       RegisterBloomPool *pool) {
+  RegisterBloomFilter *rf = (RegisterBloomFilter *)mem;
+  rf->words = (uint64_t *)(mem + HEADER_BYTES);
+  rf->size = size;
+  rf->mask = size / 64 - 1;
+  rf->hf = hf;
+  rf->pool = pool;
+  rf->next = NULL;
+  return rf;
+}
+
+/**
+ * Carves a new slab into free filters of `size` bits for class `c`.
+ */
+static int growPool(RegisterBloomPool *pool, int c, uint64_t size) {
+  size_t stride = filterBytes(size);
+  size_t count = SLAB_BYTES / stride;
+  if (count == 0) {
+    count = 1;
+  }
+
+  uint8_t *slab = aligned_alloc(64, HEADER_BYTES + count * stride);
+  if (!slab) {
+    perror("Failed to allocate filter slab.");
+    return -1;
+  }
+  *(void **)slab = pool->slabs;
+  pool->slabs = slab;
+
+  for (size_t i = 0; i < count; i++) {
+    RegisterBloomFilter *rf =
+        initFilter(slab + HEADER_BYTES + i * stride, size, 0, pool);
+    rf->next = pool->free[c];
+    pool->free[c] = rf;
+  }
+  return 0;
+}
+
+RegisterBloomFilter *NewRegisterBloomFilter(RegisterBloomPool *pool,
+                                            uint64_t size, int hf) {
+  if (size < REGISTER_MIN_SIZE || size > REGISTER_MAX_SIZE ||
+      (size & (size - 1)) != 0) {
+    fprintf(stderr, "Filter size must be a power of 2 from %d to %llu\n",
+            REGISTER_MIN_SIZE, (unsigned long long)REGISTER_MAX_SIZE);
+    return NULL;
+  }
+  if (hf < 1 || hf > REGISTER_MAX_HF) {
+    fprintf(stderr, "Filter must use 1 to %d hash functions\n",
+            REGISTER_MAX_HF);
+    return NULL;
+  }
+
+  RegisterBloomFilter *rf;
+  if (pool) {
+    int c = __builtin_ctzll(size) - __builtin_ctzll(REGISTER_MIN_SIZE);
+    if (!pool->free[c] && growPool(pool, c, size) != 0) {
+      return NULL;
+    }
+    rf = pool->free[c];
+    pool->free[c] = rf->next;
+    rf->next = NULL;
+    rf->hf = hf;
+  } else {
+    uint8_t *mem = aligned_alloc(64, filterBytes(size));
+    if (!mem) {
+      perror("Failed to allocate bloom filter.");
+      return NULL;
+    }
+    rf = initFilter(mem, size, hf, NULL);
+  }
+
+  ClearRegisterBloomFilter(rf);
+  return rf;
+}
+
+void DestroyRegisterBloomFilter(RegisterBloomFilter *rf) {
+  if (!rf) {
+    return;
+  }
+  if (rf->pool) {
+    int c = __builtin_ctzll(rf->size) - __builtin_ctzll(REGISTER_MIN_SIZE);
+    rf->next = rf->pool->free[c];
+    rf->pool->free[c] = rf;
+  } else {
+    free(rf);
+  }
+}
+
+void ClearRegisterBloomFilter(RegisterBloomFilter *rf) {
+  memset(rf->words, 0, rf->size / 8);
+}
+
+/**
+ * The bits an entry sets in its word: one per 6 bit field of the hash, taken
+ * from the top down. The word index comes from the low bits, which these
+ * never reach (see REGISTER_MAX_SIZE).
+ */
+static inline uint64_t bitsOf(int hf, uint64_t h) {
+  uint64_t bits = 0;
+  for (int i = 0; i < hf; i++) {
+    bits |= 1ULL << (h >> 58);
+    h <<= 6;
+  }
+  return bits;
+}
+
+static inline void setHash(RegisterBloomFilter *rf, uint64_t h) {
+  rf->words[h & rf->mask] |= bitsOf(rf->hf, h);
+}
+
+static inline bool testHash(const RegisterBloomFilter *rf, uint64_t h) {
+  uint64_t bits = bitsOf(rf->hf, h);
+  return (rf->words[h & rf->mask] & bits) == bits;
+}
+
+bool RegisterLookup(const RegisterBloomFilter *rf, const char *entry) {
+  return testHash(rf, XXH64(entry, strlen(entry), 0));
+}
+
+int RegisterInsert(RegisterBloomFilter *rf, const char *entry) {
+  setHash(rf, XXH64(entry, strlen(entry), 0));
+  return 0;
+}
+
+int RegisterInsertBatch(RegisterBloomFilter *rf, const uint8_t *keys,
+                        size_t width, size_t n) {
+  uint64_t hashes[BATCH_BLOCK];
+
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+    for (size_t j = 0; j < count; j++) {
+      setHash(rf, hashes[j]);
+    }
+  }
+  return 0;
+}
+
+int RegisterLookupBatch(const RegisterBloomFilter *rf, const uint8_t *keys,
+                        size_t width, size_t n, bool *out) {
+  uint64_t hashes[BATCH_BLOCK];
+
+  for (size_t start = 0; start < n; start += BATCH_BLOCK) {
+    size_t count = n - start < BATCH_BLOCK ? n - start : BATCH_BLOCK;
+    hashFixedBatch(keys + start * width, width, count, hashes);
+    for (size_t j = 0; j < count; j++) {
+      out[start + j] = testHash(rf, hashes[j]);
+    }
+  }
+  return 0;
+}
+
+RegisterBloomPool *NewRegisterBloomPool() {
+  RegisterBloomPool *pool = calloc(1, sizeof(RegisterBloomPool));
+  if (!pool) {
+    perror("Failed to allocate filter pool.");
+  }
+  return pool;
+}
+
+void DestroyRegisterBloomPool(RegisterBloomPool *pool) {
+  if (!pool) {
+    return;
+  }
+  void *slab = pool->slabs;
+  while (slab) {
+    void *next = *(void **)slab;
+    free(slab);
+    slab = next;
+  }
+  free(pool);
+}
@@ -0,0 +1,145 @@
+#ifndef REGISTER_H
+#define REGISTER_H
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Macro to perform assertions.
+ */
+#define assert(condition, message)                                             \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "Assertion failed: %s\n", message);                      \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Size limits, in bits. The word index and the k bit positions are all cut
+ * from one 64 bit hash, so a filter can use at most 16 bits of it for the
+ * word and 6 bits for each of at most 8 positions.
+ */
+#define REGISTER_MIN_SIZE 64
+#define REGISTER_MAX_SIZE (1ULL << 22)
+#define REGISTER_MAX_HF 8
+
+/**
+ * Number of size classes a pool keeps, one per power of 2 from
+ * REGISTER_MIN_SIZE to REGISTER_MAX_SIZE.
+ */
+#define REGISTER_POOL_CLASSES 17
+
+typedef struct RegisterBloomPool RegisterBloomPool;
+
+/**
+ * RegisterBloomFilter is a register-blocked bloom filter for small filters
+ * that live in L1 or L2, such as a per-partition filter in a hash join. Each
+ * entry maps to a single 64 bit word and all of its bits are set in that
+ * word: the low bits of the entry hash pick the word and the top bits, 6 at a
+ * time, pick the bits. An insert is one OR and a lookup one AND and compare,
+ * with a single load either way. Packing every bit into one word raises the
+ * false positive rate over BloomFilter at the same size, more so for larger
+ * `hf`; 4 to 6 bits per entry is usually best.
+ *
+ * There is no lock. A filter is meant to be built and probed by one thread,
+ * or built once and then only read.
+ */
+typedef struct RegisterBloomFilter {
+  uint64_t *words; // size / 64 words, 64 byte aligned
+  uint64_t size;   // Size of the filter in bits. Power of 2.
+  uint64_t mask;   // size / 64 - 1, to pick a word from a hash
+  int hf;          // Number of bits set per entry
+
+  RegisterBloomPool *pool;          // Pool the filter came from, or NULL
+  struct RegisterBloomFilter *next; // Next free filter while in the pool
+} RegisterBloomFilter;
+
+/**
+ * RegisterBloomPool hands out filters so that creating one doesn't cost a
+ * malloc and a calloc. Filters are carved from slabs of at least 64 KiB, and
+ * a destroyed filter goes back on a free list for its size class to be
+ * reused, so steady-state creation is a free list pop and a memset of the
+ * words.
+ *
+ * A pool belongs to one thread, like the filters; give each thread its own.
+ */
+struct RegisterBloomPool {
+  RegisterBloomFilter *free[REGISTER_POOL_CLASSES]; // Free list per class
+  void *slabs;                                      // Every slab allocated
+};
+
+/**
+ * Create and return a pointer to a new register-blocked Bloom filter, with
+ * every bit clear.
+ *
+ * Parameters:
+ * - `pool`: pool to take the filter from, or NULL to allocate it on its own
+ * - `size`: the size (in bits) of the filter, a power of 2 from
+ *   REGISTER_MIN_SIZE to REGISTER_MAX_SIZE
+ * - `hf`: number of bits set per entry, 1 to REGISTER_MAX_HF.
+ */
+RegisterBloomFilter *NewRegisterBloomFilter(RegisterBloomPool *pool,
+                                            uint64_t size, int hf);
+
+/**
+ * Frees a filter, or gives it back to the pool it came from.
+ */
+void DestroyRegisterBloomFilter(RegisterBloomFilter *rf);
+
+/**
+ * Clears every bit of the filter so it can be reused.
+ */
+void ClearRegisterBloomFilter(RegisterBloomFilter *rf);
+
+/**
+ * Looks up an entry in the filter. Returns true if a match is found, false
+ * otherwise.
+ */
+bool RegisterLookup(const RegisterBloomFilter *rf, const char *entry);
+
+/**
+ * Inserts an entry into the filter.
+ */
+int RegisterInsert(RegisterBloomFilter *rf, const char *entry);
+
+/**
+ * Inserts `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each, hashing them with the vectorized kernels in hashing.h. A key inserted
+ * here is found by RegisterLookup on the same bytes and vice versa.
+ */
+int RegisterInsertBatch(RegisterBloomFilter *rf, const uint8_t *keys,
+                        size_t width, size_t n);
+
+/**
+ * Looks up `n` fixed-width keys laid out back to back in `keys`, `width` bytes
+ * each. `out[i]` is set to true if the i-th key may be in the filter.
+ */
+int RegisterLookupBatch(const RegisterBloomFilter *rf, const uint8_t *keys,
+                        size_t width, size_t n, bool *out);
+
+/**
+ * Create an empty pool.
+ */
+RegisterBloomPool *NewRegisterBloomPool();
+
+/**
+ * Frees a pool along with every filter it handed out, including those not
+ * destroyed yet.
+ */
+void DestroyRegisterBloomPool(RegisterBloomPool *pool);
+
+/**
+ * Testing functions to verify intended functionality.
+ */
+void TestNewRegisterBloomFilter();
+void TestRegisterBloomFilter();
+void TestRegisterBatch();
+void TestRegisterPool();
+
+#endif // REGISTER_H
@@ -0,0 +1,166 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "register.h"
+
+int main() {
+  printf("Running tests...\n");
+  TestNewRegisterBloomFilter();
+  TestRegisterBloomFilter();
+  TestRegisterBatch();
+  TestRegisterPool();
+  printf("All tests passed!\n");
+  return 0;
+}
+
+void TestNewRegisterBloomFilter() {
+  assert(NewRegisterBloomFilter(NULL, 100000, 4) == NULL,
+         "NewRegisterBloomFilter should return NULL for bad size");
+  assert(NewRegisterBloomFilter(NULL, 32, 4) == NULL,
+         "NewRegisterBloomFilter should need at least one word");
+  assert(NewRegisterBloomFilter(NULL, REGISTER_MAX_SIZE * 2, 4) == NULL,
+         "NewRegisterBloomFilter should cap the size");
+  assert(NewRegisterBloomFilter(NULL, 4096, 0) == NULL,
+         "NewRegisterBloomFilter should need a hash function");
+  assert(NewRegisterBloomFilter(NULL, 4096, REGISTER_MAX_HF + 1) == NULL,
+         "NewRegisterBloomFilter should cap the hash functions");
+
+  RegisterBloomFilter *rf = NewRegisterBloomFilter(NULL, 4096, 4);
+  assert(rf != NULL, "NewRegisterBloomFilter should not return NULL");
+  assert(((uintptr_t)rf->words & 63) == 0, "Words should be cache aligned");
+  assert(rf->mask == 63, "4096 bits should be 64 words");
+  for (uint64_t i = 0; i < 64; i++) {
+    assert(rf->words[i] == 0, "A new filter should be empty");
+  }
+
+  DestroyRegisterBloomFilter(rf);
+  printf("TestNewRegisterBloomFilter passed\n");
+}
+
+void TestRegisterBloomFilter() {
+  RegisterBloomFilter *rf = NewRegisterBloomFilter(NULL, 4096, 4);
+  assert(rf != NULL, "NewRegisterBloomFilter should not return NULL");
+
+  const char *entries[] = {"b99afb65c9f97b2e0feea844eea55f69",
+                           "f530e3093a1617d64f400c5578005b7c",
+                           "b29317ac342ceafc79e59996678efeb3",
+                           "00421829519ccc2834eedc2bac21df68"};
+  const char *fakes[] = {"hahaidontexist", "foobar", "turnips", "lavacakes"};
+
+  for (int i = 0; i < 4; i++) {
+    assert(RegisterInsert(rf, entries[i]) == 0,
+           "RegisterInsert should not return an error");
+  }
+  for (int i = 0; i < 4; i++) {
+    assert(RegisterLookup(rf, entries[i]), "Entry should exist in the filter");
+    assert(!RegisterLookup(rf, fakes[i]),
+           "Fake should not exist in the filter");
+  }
+
+  // Every entry's bits land in a single word.
+  int words = 0, bits = 0;
+  for (uint64_t i = 0; i <= rf->mask; i++) {
+    words += rf->words[i] != 0;
+    bits += __builtin_popcountll(rf->words[i]);
+  }
+  assert(words <= 4, "Four entries should touch at most four words");
+  assert(bits <= 16, "Four entries should set at most sixteen bits");
+
+  ClearRegisterBloomFilter(rf);
+  for (int i = 0; i < 4; i++) {
+    assert(!RegisterLookup(rf, entries[i]), "Clearing should empty the filter");
+  }
+
+  DestroyRegisterBloomFilter(rf);
+  printf("TestRegisterBloomFilter passed\n");
+}
+
+void TestRegisterBatch() {
+  enum { N = 1024, WIDTH = 16 };
+  RegisterBloomFilter *rf = NewRegisterBloomFilter(NULL, 16384, 4);
+  assert(rf != NULL, "NewRegisterBloomFilter should not return NULL");
+
+  uint8_t *keys = malloc(2 * N * WIDTH);
+  uint64_t x = 1;
+  for (size_t i = 0; i < 2 * N * WIDTH; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    keys[i] = 'a' + (x >> 33) % 26;
+  }
+
+  assert(RegisterInsertBatch(rf, keys, WIDTH, N) == 0,
+         "RegisterInsertBatch should not return an error");
+
+  bool *out = malloc(2 * N * sizeof(bool));
+  assert(RegisterLookupBatch(rf, keys, WIDTH, 2 * N, out) == 0,
+         "RegisterLookupBatch should not return an error");
+
+  char key[WIDTH + 1];
+  key[WIDTH] = '\0';
+  int fp = 0;
+  for (int i = 0; i < 2 * N; i++) {
+    memcpy(key, keys + i * WIDTH, WIDTH);
+    assert(out[i] == RegisterLookup(rf, key),
+           "Batch and single lookups should agree");
+    if (i < N) {
+      assert(out[i], "Inserted key should be found");
+    } else {
+      fp += out[i];
+    }
+  }
+  // 16 bits per key with 4 bits in one word is well under 1% false positives.
+  printf("False positives: %d of %d\n", fp, N);
+  assert(fp < N / 30, "False positive rate should be low");
+
+  free(out);
+  free(keys);
+  DestroyRegisterBloomFilter(rf);
+  printf("TestRegisterBatch passed\n");
+}
+
+void TestRegisterPool() {
+  RegisterBloomPool *pool = NewRegisterBloomPool();
+  assert(pool != NULL, "NewRegisterBloomPool should not return NULL");
+  assert(NewRegisterBloomFilter(pool, 100, 4) == NULL,
+         "Pooled filters should check their size too");
+
+  RegisterBloomFilter *rf = NewRegisterBloomFilter(pool, 4096, 4);
+  assert(rf != NULL, "NewRegisterBloomFilter should not return NULL");
+  assert(rf->pool == pool, "Filter should come from the pool");
+  RegisterInsert(rf, "foobar");
+  DestroyRegisterBloomFilter(rf);
+
+  // The destroyed filter is reused, and comes back empty.
+  RegisterBloomFilter *again = NewRegisterBloomFilter(pool, 4096, 2);
+  assert(again == rf, "Pool should reuse a destroyed filter");
+  assert(again->hf == 2, "A reused filter should take the new hf");
+  assert(!RegisterLookup(again, "foobar"), "A reused filter should be empty");
+  DestroyRegisterBloomFilter(again);
+
+  // Many filters of every size at once, some left for the pool to free.
+  enum { N = 10 * REGISTER_POOL_CLASSES };
+  RegisterBloomFilter **filters = malloc(N * sizeof(RegisterBloomFilter *));
+  char key[32];
+  for (int i = 0; i < N; i++) {
+    uint64_t size = REGISTER_MIN_SIZE << (i % REGISTER_POOL_CLASSES);
+    filters[i] = NewRegisterBloomFilter(pool, size, 1 + i % REGISTER_MAX_HF);
+    assert(filters[i] != NULL, "NewRegisterBloomFilter should not fail");
+    assert(((uintptr_t)filters[i]->words & 63) == 0,
+           "Pooled words should be cache aligned");
+    snprintf(key, sizeof(key), "key-%d", i);
+    RegisterInsert(filters[i], key);
+  }
+  for (int i = 0; i < N; i++) {
+    snprintf(key, sizeof(key), "key-%d", i);
+    assert(RegisterLookup(filters[i], key), "Pooled filters should not share");
+    if (i % 2 == 0) {
+      DestroyRegisterBloomFilter(filters[i]);
+    }
+  }
+
+  free(filters);
+  DestroyRegisterBloomPool(pool);
+  printf("TestRegisterPool passed\n");
+}